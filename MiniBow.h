@@ -17,16 +17,44 @@
  */
 #pragma once
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#    define MINIBOW_X86
+#    include <cpuid.h>
+#    include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#    define MINIBOW_MMAP
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
+#include <random>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace DBoW2
@@ -40,6 +68,9 @@ typedef double WordValue;
 /// Id of nodes in the vocabulary treee
 typedef unsigned int NodeId;
 
+/// Id of entries of the database
+typedef unsigned int EntryId;
+
 /// L-norms for normalization
 enum LNorm
 {
@@ -56,6 +87,111 @@ enum WeightingType
     BINARY
 };
 
+/// Allocator returning memory aligned to Alignment bytes, used for the descriptor blocks of the flat tree
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        // the original pointer is stored right in front of the aligned block
+        void* raw = std::malloc(n * sizeof(T) + Alignment + sizeof(void*));
+        if (!raw) throw std::bad_alloc();
+        uintptr_t aligned =
+            (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+        reinterpret_cast<void**>(aligned)[-1] = raw;
+        return reinterpret_cast<T*>(aligned);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        if (p) std::free(reinterpret_cast<void**>(p)[-1]);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const
+    {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const
+    {
+        return false;
+    }
+};
+
+/// Instruction set used by the descriptor kernels
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+/**
+ * Returns the best instruction set supported by the cpu and the operating system
+ */
+inline SimdLevel detectSimdLevel()
+{
+#ifdef MINIBOW_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return SIMD_SCALAR;
+
+    // the os must save the ymm/zmm registers on context switches
+    if (!(ecx & (1u << 27))) return SIMD_SCALAR;
+    unsigned int xcr0, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+    const bool ymm = (xcr0 & 0x6) == 0x6;
+    const bool zmm = (xcr0 & 0xe6) == 0xe6;
+
+    if (!ymm || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return SIMD_SCALAR;
+    const bool avx2      = ebx & (1u << 5);
+    const bool avx512f   = ebx & (1u << 16);
+    const bool vpopcntdq = ecx & (1u << 14);
+
+    if (zmm && avx512f && vpopcntdq) return SIMD_AVX512;
+    if (avx2) return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+/// Atomic because the kernels read it on every thread while setSimdLevel may change it
+inline std::atomic<SimdLevel>& activeSimdLevel()
+{
+    static std::atomic<SimdLevel> level(detectSimdLevel());
+    return level;
+}
+
+/**
+ * Returns the instruction set currently used by the kernels
+ */
+inline SimdLevel getSimdLevel()
+{
+    return activeSimdLevel().load(std::memory_order_relaxed);
+}
+
+/**
+ * Restricts the kernels to the given instruction set (for example to compare them).
+ * Levels which are not supported by the cpu are clamped to the detected level.
+ * Calls running on other threads meanwhile use either level.
+ */
+inline void setSimdLevel(SimdLevel level)
+{
+    activeSimdLevel().store(std::min(level, detectSimdLevel()), std::memory_order_relaxed);
+}
 
 
 class FORB
@@ -71,49 +207,182 @@ class FORB
      */
     static void meanValue(const std::vector<pDescriptor>& descriptors, TDescriptor& mean)
     {
-        if (descriptors.empty())
+        meanValue(descriptors.size(), [&descriptors](size_t i) -> const TDescriptor& { return *descriptors[i]; },
+                  mean);
+    }
+
+    /**
+     * Same as above for the descriptors with the given indices, so that the clusters of
+     * kmeans do not have to be copied into a vector of pointers
+     * @param descriptors
+     * @param indices indices of the n descriptors in descriptors
+     * @param n
+     * @param mean mean descriptor
+     */
+    static void meanValue(const pDescriptor* descriptors, const unsigned int* indices, size_t n, TDescriptor& mean)
+    {
+        meanValue(n, [descriptors, indices](size_t i) -> const TDescriptor& { return *descriptors[indices[i]]; },
+                  mean);
+    }
+
+    /**
+     * Same as above for descriptors stored contiguously, e.g. in a mapped file
+     */
+    static void meanValue(const TDescriptor* descriptors, const unsigned int* indices, size_t n, TDescriptor& mean)
+    {
+        meanValue(n, [descriptors, indices](size_t i) -> const TDescriptor& { return descriptors[indices[i]]; },
+                  mean);
+    }
+
+    /**
+     * Sets every bit of the mean that is set in at least half of the n descriptors (rounded up)
+     * @param n
+     * @param get returns the i-th descriptor
+     * @param mean mean descriptor, unchanged if n is 0
+     */
+    template <class Get>
+    static void meanValue(size_t n, Get get, TDescriptor& mean)
+    {
+        if (n == 0)
         {
             return;
         }
-        else if (descriptors.size() == 1)
+        else if (n == 1)
         {
-            mean = *descriptors[0];
+            mean = get(0);
+            return;
         }
-        else
+
+        // vertical counters: bit p of the number of descriptors with a bit set is that bit of
+        // planes[p], so a descriptor is added to all its counters with a few logical operations.
+        // Blocks of up to 255 descriptors are counted in 8 planes, then added to all the planes
+        const int W = L / 8;
+        int P       = 8;
+        while (P < 64 && (n >> P) != 0) ++P;
+        uint64_t planes[64][W] = {};
+        for (size_t begin = 0; begin < n; begin += 255)
         {
-            std::vector<int> sum(FORB::L * 8, 0);
+            uint64_t block[8][W];
+            countBits(get, begin, std::min(n, begin + 255), block);
+
+            uint64_t carry[W] = {};
+            for (int p = 0; p < P; ++p)
+            {
+                for (int w = 0; w < W; ++w)
+                {
+                    const uint64_t b = p < 8 ? block[p][w] : 0;
+                    const uint64_t x = planes[p][w] ^ b;
+                    const uint64_t c = (planes[p][w] & b) | (x & carry[w]);
+                    planes[p][w]     = x ^ carry[w];
+                    carry[w]         = c;
+                }
+            }
+        }
 
-            for (size_t i = 0; i < descriptors.size(); ++i)
+        // counters >= N2, comparing the planes from the most significant one
+        const size_t N2 = n / 2 + n % 2;
+        for (int w = 0; w < W; ++w)
+        {
+            uint64_t greater = 0;
+            uint64_t equal   = ~(uint64_t)0;
+            for (int p = P - 1; p >= 0; --p)
             {
-                const auto& d          = *descriptors[i];
-                const unsigned char* p = (const unsigned char*)d.data();
-                for (int j = 0; j < 32; ++j, ++p)
+                if ((N2 >> p) & 1)
+                {
+                    equal &= planes[p][w];
+                }
+                else
                 {
-                    if (*p & (1 << 7)) ++sum[j * 8];
-                    if (*p & (1 << 6)) ++sum[j * 8 + 1];
-                    if (*p & (1 << 5)) ++sum[j * 8 + 2];
-                    if (*p & (1 << 4)) ++sum[j * 8 + 3];
-                    if (*p & (1 << 3)) ++sum[j * 8 + 4];
-                    if (*p & (1 << 2)) ++sum[j * 8 + 5];
-                    if (*p & (1 << 1)) ++sum[j * 8 + 6];
-                    if (*p & (1)) ++sum[j * 8 + 7];
+                    greater |= equal & planes[p][w];
+                    equal &= ~planes[p][w];
                 }
             }
-            std::fill(mean.begin(), mean.end(), 0);
-            unsigned char* p = (unsigned char*)mean.data();
-            const int N2     = (int)descriptors.size() / 2 + descriptors.size() % 2;
-            for (size_t i = 0; i < sum.size(); ++i)
+            mean[w] = greater | equal;
+        }
+    }
+
+    /**
+     * Counts the bits of the descriptors [begin, end), at most 255, in 8 vertical planes
+     * @param get returns the i-th descriptor
+     * @param begin
+     * @param end
+     * @param block (out) planes of the counters
+     */
+    template <class Get>
+    static void countBits(Get get, size_t begin, size_t end, uint64_t (&block)[8][L / 8])
+    {
+#ifdef MINIBOW_X86
+        if (getSimdLevel() >= SIMD_AVX2)
+        {
+            countBitsAvx2(get, begin, end, block);
+            return;
+        }
+#endif
+        std::memset(block, 0, sizeof(block));
+        for (size_t i = begin; i < end; ++i)
+        {
+            const TDescriptor& d = get(i);
+            uint64_t carry[L / 8];
+            for (int w = 0; w < L / 8; ++w) carry[w] = d[w];
+            for (int p = 0; p < 8; ++p)
             {
-                if (sum[i] >= N2)
+                for (int w = 0; w < L / 8; ++w)
                 {
-                    // set bit
-                    *p |= 1 << (7 - (i % 8));
+                    const uint64_t c = block[p][w] & carry[w];
+                    block[p][w] ^= carry[w];
+                    carry[w] = c;
                 }
-                if (i % 8 == 7) ++p;
             }
         }
     }
 
+#ifdef MINIBOW_X86
+    /**
+     * Same as above with the planes in registers
+     */
+    template <class Get>
+    __attribute__((target("avx2"))) static void countBitsAvx2(Get get, size_t begin, size_t end,
+                                                              uint64_t (&block)[8][L / 8])
+    {
+        __m256i b0 = _mm256_setzero_si256(), b1 = b0, b2 = b0, b3 = b0, b4 = b0, b5 = b0, b6 = b0, b7 = b0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            __m256i carry = _mm256_loadu_si256((const __m256i*)get(i).data());
+            __m256i c;
+            c     = _mm256_and_si256(b0, carry);
+            b0    = _mm256_xor_si256(b0, carry);
+            carry = c;
+            c     = _mm256_and_si256(b1, carry);
+            b1    = _mm256_xor_si256(b1, carry);
+            carry = c;
+            c     = _mm256_and_si256(b2, carry);
+            b2    = _mm256_xor_si256(b2, carry);
+            carry = c;
+            c     = _mm256_and_si256(b3, carry);
+            b3    = _mm256_xor_si256(b3, carry);
+            carry = c;
+            c     = _mm256_and_si256(b4, carry);
+            b4    = _mm256_xor_si256(b4, carry);
+            carry = c;
+            c     = _mm256_and_si256(b5, carry);
+            b5    = _mm256_xor_si256(b5, carry);
+            carry = c;
+            c     = _mm256_and_si256(b6, carry);
+            b6    = _mm256_xor_si256(b6, carry);
+            carry = c;
+            b7    = _mm256_xor_si256(b7, carry);
+        }
+        _mm256_storeu_si256((__m256i*)block[0], b0);
+        _mm256_storeu_si256((__m256i*)block[1], b1);
+        _mm256_storeu_si256((__m256i*)block[2], b2);
+        _mm256_storeu_si256((__m256i*)block[3], b3);
+        _mm256_storeu_si256((__m256i*)block[4], b4);
+        _mm256_storeu_si256((__m256i*)block[5], b5);
+        _mm256_storeu_si256((__m256i*)block[6], b6);
+        _mm256_storeu_si256((__m256i*)block[7], b7);
+    }
+#endif
+
     /**
      * Calculates the distance between two descriptors
      * @param a
@@ -122,8 +391,12 @@ class FORB
      */
     static inline int popcnt64(uint64_t x)
     {
+#ifdef MINIBOW_X86
         __asm__("popcnt %1, %0" : "=r"(x) : "0"(x));
         return x;
+#else
+        return __builtin_popcountll(x);
+#endif
     }
     static double distance(const TDescriptor& a, const TDescriptor& b)
     {
@@ -137,6 +410,270 @@ class FORB
         }
         return dist;
     }
+
+    /**
+     * Calculates the distances between one descriptor and n descriptors stored next to each other.
+     * Dispatches at runtime to the best kernel supported by the cpu.
+     * @param a
+     * @param b array of n descriptors
+     * @param n
+     * @param dist (out) n distances
+     * @return index of the first descriptor with the smallest distance
+     */
+    static int distanceMany(const TDescriptor& a, const TDescriptor* b, int n, int* dist)
+    {
+        distances(a, b, n, dist);
+
+        int best = 0;
+        for (int i = 1; i < n; ++i)
+        {
+            if (dist[i] < dist[best]) best = i;
+        }
+        return best;
+    }
+
+    /**
+     * Same as distanceMany without looking for the nearest descriptor
+     */
+    static void distances(const TDescriptor& a, const TDescriptor* b, int n, int* dist)
+    {
+        switch (getSimdLevel())
+        {
+#ifdef MINIBOW_X86
+            case SIMD_AVX512:
+                distanceManyAvx512(a, b, n, dist);
+                break;
+            case SIMD_AVX2:
+                distanceManyAvx2(a, b, n, dist);
+                break;
+#endif
+            default:
+                distanceManyScalar(a, b, n, dist);
+                break;
+        }
+    }
+
+    /**
+     * Returns the index of the first of the n descriptors with the smallest distance to a
+     */
+    static int nearest(const TDescriptor& a, const TDescriptor* b, int n)
+    {
+        const int chunk = 32;
+        int dist[chunk];
+        int best   = 0;
+        int best_d = std::numeric_limits<int>::max();
+        for (int begin = 0; begin < n; begin += chunk)
+        {
+            const int m = std::min(chunk, n - begin);
+            const int i = distanceMany(a, b + begin, m, dist);
+            if (dist[i] < best_d)
+            {
+                best_d = dist[i];
+                best   = begin + i;
+            }
+        }
+        return best;
+    }
+
+    /**
+     * Finds the nearest and the second nearest of n descriptors stored next to each other,
+     * for ratio tests
+     * @param a
+     * @param b array of n descriptors
+     * @param n
+     * @param best (out) smallest distance
+     * @param second (out) second smallest distance, equal to best on ties,
+     *   std::numeric_limits<int>::max() if n < 2
+     * @return index of the first descriptor with the smallest distance
+     */
+    static int nearestTwo(const TDescriptor& a, const TDescriptor* b, int n, int& best, int& second)
+    {
+        const int chunk = 32;
+        const int lanes = 16;
+        const int none  = std::numeric_limits<int>::max();
+        int dist[chunk];
+        best   = none;
+        second = none;
+
+        if (n <= lanes)
+        {
+            // selects without branches, which are mispredicted half of the time on random distances
+            distances(a, b, n, dist);
+            int index = 0, first = none, next = none;
+            for (int i = 0; i < n; ++i)
+            {
+                const int d     = dist[i];
+                const bool less = d < first;
+                next            = less ? first : std::min(next, d);
+                index           = less ? i : index;
+                first           = less ? d : first;
+            }
+            best   = first;
+            second = next;
+            return index;
+        }
+
+        // the two smallest distances and the first index of the smallest one in 16 lanes,
+        // updated without branches so that the loops are vectorized
+        int best1[lanes], best2[lanes], best_i[lanes];
+        for (int l = 0; l < lanes; ++l)
+        {
+            best1[l]  = none;
+            best2[l]  = none;
+            best_i[l] = 0;
+        }
+
+        for (int begin = 0; begin < n; begin += chunk)
+        {
+            const int m = std::min(chunk, n - begin);
+            distances(a, b + begin, m, dist);
+            for (int i = m; i < chunk; ++i) dist[i] = none;
+
+            for (int r = 0; r < chunk; r += lanes)
+            {
+                for (int l = 0; l < lanes; ++l)
+                {
+                    const int d = dist[r + l];
+                    best2[l]    = std::min(best2[l], std::max(best1[l], d));
+                    best_i[l]   = d < best1[l] ? begin + r + l : best_i[l];
+                    best1[l]    = std::min(best1[l], d);
+                }
+            }
+        }
+
+        int index = 0;
+        for (int l = 0; l < lanes; ++l)
+        {
+            if (best1[l] < best || (best1[l] == best && best_i[l] < index))
+            {
+                best  = best1[l];
+                index = best_i[l];
+            }
+        }
+        for (int l = 0; l < lanes; ++l)
+        {
+            if (best1[l] != best || best_i[l] != index) second = std::min(second, best1[l]);
+            second = std::min(second, best2[l]);
+        }
+        return index;
+    }
+
+    /**
+     * Same as nearest for a number of descriptors known at compile time
+     */
+    template <int N>
+    static int nearest(const TDescriptor& a, const TDescriptor* b)
+    {
+        int dist[N];
+        switch (getSimdLevel())
+        {
+#ifdef MINIBOW_X86
+            case SIMD_AVX512:
+                distanceManyAvx512(a, b, N, dist);
+                break;
+            case SIMD_AVX2:
+                distanceManyAvx2(a, b, N, dist);
+                break;
+#endif
+            default:
+                distanceManyScalar(a, b, N, dist);
+                break;
+        }
+
+        int best = 0;
+        for (int i = 1; i < N; ++i)
+        {
+            if (dist[i] < dist[best]) best = i;
+        }
+        return best;
+    }
+
+    static void distanceManyScalar(const TDescriptor& a, const TDescriptor* b, int n, int* dist)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            dist[i] = popcnt64(a[0] ^ b[i][0]) + popcnt64(a[1] ^ b[i][1]) + popcnt64(a[2] ^ b[i][2]) +
+                      popcnt64(a[3] ^ b[i][3]);
+        }
+    }
+
+#ifdef MINIBOW_X86
+    /**
+     * Popcount of the four 64 bit lanes with the nibble lookup table (Mula et al.)
+     */
+    __attribute__((target("avx2"))) static inline __m256i popcnt256(__m256i v)
+    {
+        const __m256i lut  = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1,
+                                             2, 2, 3, 2, 3, 3, 4);
+        const __m256i mask = _mm256_set1_epi8(0x0f);
+        __m256i lo         = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+        __m256i hi         = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+    }
+
+    __attribute__((target("avx2"))) static void distanceManyAvx2(const TDescriptor& a, const TDescriptor* b, int n,
+                                                                 int* dist)
+    {
+        const __m256i q = _mm256_loadu_si256((const __m256i*)a.data());
+
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i c0 = popcnt256(_mm256_xor_si256(q, _mm256_loadu_si256((const __m256i*)b[i].data())));
+            __m256i c1 = popcnt256(_mm256_xor_si256(q, _mm256_loadu_si256((const __m256i*)b[i + 1].data())));
+            __m256i c2 = popcnt256(_mm256_xor_si256(q, _mm256_loadu_si256((const __m256i*)b[i + 2].data())));
+            __m256i c3 = popcnt256(_mm256_xor_si256(q, _mm256_loadu_si256((const __m256i*)b[i + 3].data())));
+
+            // [c0_01, c1_01, c0_23, c1_23] and [c2_01, c3_01, c2_23, c3_23]
+            __m256i s01 = _mm256_add_epi64(_mm256_unpacklo_epi64(c0, c1), _mm256_unpackhi_epi64(c0, c1));
+            __m256i s23 = _mm256_add_epi64(_mm256_unpacklo_epi64(c2, c3), _mm256_unpackhi_epi64(c2, c3));
+            // [d0, d1, d2, d3] as 64 bit integers
+            __m256i s = _mm256_add_epi64(_mm256_permute2x128_si256(s01, s23, 0x20),
+                                         _mm256_permute2x128_si256(s01, s23, 0x31));
+            s         = _mm256_permutevar8x32_epi32(s, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0));
+            _mm_storeu_si128((__m128i*)(dist + i), _mm256_castsi256_si128(s));
+        }
+        for (; i < n; ++i)
+        {
+            __m256i c = popcnt256(_mm256_xor_si256(q, _mm256_loadu_si256((const __m256i*)b[i].data())));
+            __m128i s = _mm_add_epi64(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+            dist[i]   = (int)(_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1));
+        }
+    }
+
+// the avx512 headers of gcc 12 trigger false uninitialized warnings (gcc bug 105593)
+#    pragma GCC diagnostic push
+#    pragma GCC diagnostic ignored "-Wuninitialized"
+#    pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx512f,avx512vpopcntdq"))) static void distanceManyAvx512(const TDescriptor& a,
+                                                                                      const TDescriptor* b, int n,
+                                                                                      int* dist)
+    {
+        const __m512i q = _mm512_broadcast_i64x4(_mm256_loadu_si256((const __m256i*)a.data()));
+
+        int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            // two descriptors per register
+            __m512i c01 = _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(b[i].data())));
+            __m512i c23 = _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(b[i + 2].data())));
+
+            // pairwise sums in each 128 bit lane, then add the neighbouring lane:
+            // lane 0 = [d0, d2], lane 2 = [d1, d3]
+            __m512i s = _mm512_add_epi64(_mm512_unpacklo_epi64(c01, c23), _mm512_unpackhi_epi64(c01, c23));
+            s         = _mm512_add_epi64(s, _mm512_shuffle_i64x2(s, s, _MM_SHUFFLE(2, 3, 0, 1)));
+            s         = _mm512_permutexvar_epi64(_mm512_setr_epi64(0, 4, 1, 5, 0, 0, 0, 0), s);
+            _mm_storeu_si128((__m128i*)(dist + i), _mm256_castsi256_si128(_mm512_cvtepi64_epi32(s)));
+        }
+        for (; i < n; ++i)
+        {
+            __m512i c = _mm512_popcnt_epi64(
+                _mm512_xor_si512(q, _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)b[i].data()))));
+            dist[i] = (int)_mm512_mask_reduce_add_epi64(0x0f, c);
+        }
+    }
+#    pragma GCC diagnostic pop
+#endif
 };
 /// Vector of words to represent images
 class BowVector : public std::map<WordId, WordValue>
@@ -194,1359 +731,6691 @@ class BowVector : public std::map<WordId, WordValue>
         }
     }
 };
-class FeatureVector : public std::map<NodeId, std::vector<unsigned int>>
+/**
+ * Bag of words vector stored as two parallel arrays of word ids and values, sorted by word id.
+ * Words are appended in any order with push_back and then sorted in one stable radix pass
+ * by sortAndMerge, so that building a vector does not allocate once the arrays have grown.
+ */
+class FlatBowVector
 {
    public:
-    void addFeature(NodeId id, unsigned int i_feature)
+    /// Element returned by the iterators, mirrors std::pair<const WordId, WordValue>
+    template <bool Const>
+    struct Entry
     {
-        FeatureVector::iterator vit = this->lower_bound(id);
+        WordId first;
+        typename std::conditional<Const, const WordValue&, WordValue&>::type second;
 
-        if (vit != this->end() && vit->first == id)
+        Entry* operator->() { return this; }
+    };
+
+    template <bool Const>
+    class Iterator
+    {
+       public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Entry<Const> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Entry<Const> reference;
+        typedef Entry<Const> pointer;
+        typedef typename std::conditional<Const, const FlatBowVector*, FlatBowVector*>::type Parent;
+
+        Iterator(Parent v, size_t i) : m_v(v), m_i(i) {}
+
+        Entry<Const> operator*() const { return Entry<Const>{m_v->m_words[m_i], m_v->m_values[m_i]}; }
+        Entry<Const> operator->() const { return **this; }
+
+        Iterator& operator++()
         {
-            vit->second.push_back(i_feature);
+            ++m_i;
+            return *this;
         }
-        else
+        Iterator operator++(int)
         {
-            vit = this->insert(vit, FeatureVector::value_type(id, std::vector<unsigned int>()));
-            vit->second.push_back(i_feature);
+            Iterator it = *this;
+            ++m_i;
+            return it;
         }
-    }
-};
 
-class L1Scoring
-{
-   public:
-    //    static constexpr inline int id      = 0;
-    enum
-    {
-        id = 0
+        bool operator==(const Iterator& other) const { return m_i == other.m_i; }
+        bool operator!=(const Iterator& other) const { return m_i != other.m_i; }
+
+        size_t index() const { return m_i; }
+
+       private:
+        Parent m_v;
+        size_t m_i;
     };
-    static constexpr bool mustNormalize = true;
-    static double score(const BowVector& v1, const BowVector& v2)
+
+    typedef Iterator<false> iterator;
+    typedef Iterator<true> const_iterator;
+
+    FlatBowVector() {}
+
+    /**
+     * Converts a map based bow vector
+     */
+    explicit FlatBowVector(const BowVector& v)
     {
-        BowVector::const_iterator v1_it, v2_it;
-        const BowVector::const_iterator v1_end = v1.end();
-        const BowVector::const_iterator v2_end = v2.end();
-        v1_it                                  = v1.begin();
-        v2_it                                  = v2.begin();
-        double score                           = 0;
-        while (v1_it != v1_end && v2_it != v2_end)
+        m_words.reserve(v.size());
+        m_values.reserve(v.size());
+        for (BowVector::const_iterator it = v.begin(); it != v.end(); ++it)
         {
-            const WordValue& vi = v1_it->second;
-            const WordValue& wi = v2_it->second;
-
-            if (v1_it->first == v2_it->first)
-            {
-                score += std::abs(vi - wi) - std::abs(vi) - std::abs(wi);
-                ++v1_it;
-                ++v2_it;
-            }
-            else if (v1_it->first < v2_it->first)
-            {
-                v1_it = v1.lower_bound(v2_it->first);
-            }
-            else
-            {
-                v2_it = v2.lower_bound(v1_it->first);
-            }
+            m_words.push_back(it->first);
+            m_values.push_back(it->second);
         }
-        score = -score / 2.0;
+    }
 
-        return score;  // [0..1]
+    /**
+     * Converts to a map based bow vector
+     */
+    explicit operator BowVector() const
+    {
+        BowVector v;
+        for (size_t i = 0; i < size(); ++i) v.emplace_hint(v.end(), m_words[i], m_values[i]);
+        return v;
     }
-};
 
-/// @param TDescriptor class of descriptor
-/// @param F class of descriptor functions
-template <class TDescriptor, class F, class Scoring>
-/// Generic Vocabulary
-class TemplatedVocabulary
-{
-   public:
+    size_t size() const { return m_words.size(); }
+    bool empty() const { return m_words.empty(); }
+
     /**
-     * Initiates an empty vocabulary
-     * @param k branching factor
-     * @param L depth levels
-     * @param weighting weighting type
-     * @param scoring scoring type
+     * Removes all words, the memory is kept for the next vector
      */
-    TemplatedVocabulary(int k = 10, int L = 5, WeightingType weighting = TF_IDF);
+    void clear()
+    {
+        m_words.clear();
+        m_values.clear();
+    }
+
+    void reserve(size_t n)
+    {
+        m_words.reserve(n);
+        m_values.reserve(n);
+    }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
 
     /**
-     * Creates the vocabulary by loading a file
-     * @param filename
+     * Returns the position of the word or end() if it is not in the vector
      */
-    TemplatedVocabulary(const std::string& filename);
+    const_iterator find(WordId id) const
+    {
+        const WordId* it = std::lower_bound(m_words.data(), m_words.data() + size(), id);
+        if (it == m_words.data() + size() || *it != id) return end();
+        return const_iterator(this, it - m_words.data());
+    }
+
+    WordId word(size_t i) const { return m_words[i]; }
+    WordValue value(size_t i) const { return m_values[i]; }
 
+    /// Sorted word ids
+    const WordId* words() const { return m_words.data(); }
+    /// Values of the words
+    const WordValue* values() const { return m_values.data(); }
+    WordValue* values() { return m_values.data(); }
 
     /**
-     * Destructor
+     * Appends a word. The vector is unsorted until sortAndMerge is called.
      */
-    virtual ~TemplatedVocabulary();
+    void push_back(WordId id, WordValue v)
+    {
+        m_words.push_back(id);
+        m_values.push_back(v);
+    }
+
+    /**
+     * Sorts the appended words by id and merges duplicates. The sort is stable, so the
+     * values of a word are merged in the order they were appended.
+     * @param accumulate true to sum the values of a word (like BowVector::addWeight),
+     *   false to keep the first one (like BowVector::addIfNotExist)
+     */
+    void sortAndMerge(bool accumulate)
+    {
+        const size_t n = size();
 
+        if (n < 64)
+        {
+            // insertion sort
+            for (size_t i = 1; i < n; ++i)
+            {
+                const WordId id   = m_words[i];
+                const WordValue v = m_values[i];
+                size_t j          = i;
+                for (; j > 0 && m_words[j - 1] > id; --j)
+                {
+                    m_words[j]  = m_words[j - 1];
+                    m_values[j] = m_values[j - 1];
+                }
+                m_words[j]  = id;
+                m_values[j] = v;
+            }
+        }
+        else
+        {
+            // least significant digit radix sort, only as many passes as the largest id needs
+            const WordId max_id = *std::max_element(m_words.begin(), m_words.end());
+            const int bits      = 11;
+            const WordId mask   = (1u << bits) - 1;
+            m_tmp_words.resize(n);
+            m_tmp_values.resize(n);
+
+            for (int shift = 0; shift < 32 && (max_id >> shift) > 0; shift += bits)
+            {
+                unsigned int offsets[(1 << bits) + 1] = {0};
+                for (size_t i = 0; i < n; ++i) ++offsets[((m_words[i] >> shift) & mask) + 1];
+                for (int d = 0; d < (1 << bits); ++d) offsets[d + 1] += offsets[d];
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    const unsigned int pos = offsets[(m_words[i] >> shift) & mask]++;
+                    m_tmp_words[pos]       = m_words[i];
+                    m_tmp_values[pos]      = m_values[i];
+                }
+                m_words.swap(m_tmp_words);
+                m_values.swap(m_tmp_values);
+            }
+            m_tmp_words.clear();
+            m_tmp_values.clear();
+        }
+
+        size_t out = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (out > 0 && m_words[out - 1] == m_words[i])
+            {
+                if (accumulate) m_values[out - 1] += m_values[i];
+            }
+            else
+            {
+                m_words[out]  = m_words[i];
+                m_values[out] = m_values[i];
+                ++out;
+            }
+        }
+        m_words.resize(out);
+        m_values.resize(out);
+    }
 
     /**
-     * Creates a vocabulary from the training features with the already
-     * defined parameters
-     * @param training_features
+     * L1-Normalizes the values in the vector
      */
-    virtual void create(const std::vector<std::vector<TDescriptor>>& training_features);
+    void normalize()
+    {
+        double norm = 0.0;
+        for (size_t i = 0; i < size(); ++i) norm += std::abs(m_values[i]);
+        if (norm > 0.0)
+        {
+            for (size_t i = 0; i < size(); ++i) m_values[i] /= norm;
+        }
+    }
+
+   private:
+    std::vector<WordId> m_words;
+    std::vector<WordValue> m_values;
+
+    /// Buffers of the radix sort
+    std::vector<WordId> m_tmp_words;
+    std::vector<WordValue> m_tmp_values;
+};
+
+class FeatureVector : public std::map<NodeId, std::vector<unsigned int>>
+{
+   public:
+    void addFeature(NodeId id, unsigned int i_feature)
+    {
+        FeatureVector::iterator vit = this->lower_bound(id);
+
+        if (vit != this->end() && vit->first == id)
+        {
+            vit->second.push_back(i_feature);
+        }
+        else
+        {
+            vit = this->insert(vit, FeatureVector::value_type(id, std::vector<unsigned int>()));
+            vit->second.push_back(i_feature);
+        }
+    }
+};
+
+/**
+ * Feature vector in compressed sparse row form: the sorted ids of the nodes, the offsets
+ * of their features and the indices of all the features grouped by node. (node, feature)
+ * pairs are appended with addFeature and grouped by stable counting sort passes in
+ * sortAndGroup, so the buffers are reused across images without allocating.
+ */
+class FlatFeatureVector
+{
+   public:
+    /// Indices of the features of a node, contiguous and ascending
+    struct Features
+    {
+        const unsigned int* first;
+        const unsigned int* last;
+
+        const unsigned int* begin() const { return first; }
+        const unsigned int* end() const { return last; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+        unsigned int operator[](size_t i) const { return first[i]; }
+    };
+
+    FlatFeatureVector() {}
 
     /**
-     * Creates a vocabulary from the training features, setting the branching
-     * factor and the depth levels of the tree
-     * @param training_features
-     * @param k branching factor
-     * @param L depth levels
+     * Converts a map based feature vector
      */
-    virtual void create(const std::vector<std::vector<TDescriptor>>& training_features, int k, int L);
+    explicit FlatFeatureVector(const FeatureVector& fv)
+    {
+        for (FeatureVector::const_iterator it = fv.begin(); it != fv.end(); ++it)
+        {
+            m_nodes.push_back(it->first);
+            m_offsets.push_back(m_features.size());
+            m_features.insert(m_features.end(), it->second.begin(), it->second.end());
+        }
+        m_offsets.push_back(m_features.size());
+    }
+
+    explicit operator FeatureVector() const
+    {
+        FeatureVector fv;
+        for (size_t i = 0; i < size(); ++i)
+        {
+            const Features f = features(i);
+            fv.emplace_hint(fv.end(), m_nodes[i], std::vector<unsigned int>(f.begin(), f.end()));
+        }
+        return fv;
+    }
+
+    /// Number of nodes
+    size_t size() const { return m_nodes.size(); }
+    bool empty() const { return m_nodes.empty(); }
 
     /**
-     * Creates a vocabulary from the training features, setting the branching
-     * factor nad the depth levels of the tree, and the weighting and scoring
-     * schemes
+     * Removes all nodes and features, keeping the memory
      */
-    virtual void create(const std::vector<std::vector<TDescriptor>>& training_features, int k, int L,
-                        WeightingType weighting);
+    void clear()
+    {
+        m_nodes.clear();
+        m_offsets.clear();
+        m_features.clear();
+        m_pair_nodes.clear();
+    }
+
+    NodeId node(size_t i) const { return m_nodes[i]; }
+
+    /// Features of the i-th node
+    Features features(size_t i) const
+    {
+        const Features f = {m_features.data() + m_offsets[i], m_features.data() + m_offsets[i + 1]};
+        return f;
+    }
+
+    /// Sorted node ids
+    const NodeId* nodes() const { return m_nodes.data(); }
+    /// size() + 1 offsets into indices(), the features of node i are [offsets()[i], offsets()[i + 1])
+    const unsigned int* offsets() const { return m_offsets.data(); }
+    /// Feature indices of all the nodes
+    const unsigned int* indices() const { return m_features.data(); }
 
     /**
-     * Returns the number of words in the vocabulary
-     * @return number of words
+     * Returns the position of the node or size() if it is not in the vector
      */
-    virtual inline unsigned int size() const;
+    size_t find(NodeId id) const
+    {
+        const NodeId* it = std::lower_bound(m_nodes.data(), m_nodes.data() + size(), id);
+        if (it == m_nodes.data() + size() || *it != id) return size();
+        return it - m_nodes.data();
+    }
 
     /**
-     * Returns whether the vocabulary is empty (i.e. it has not been trained)
-     * @return true iff the vocabulary is empty
+     * Replaces the contents with n nodes given like nodes(), offsets() and indices() return them
      */
-    virtual inline bool empty() const;
+    void assign(const NodeId* nodes, const unsigned int* offsets, size_t n, const unsigned int* indices)
+    {
+        m_nodes.assign(nodes, nodes + n);
+        m_offsets.assign(offsets, offsets + n + 1);
+        m_features.assign(indices, indices + offsets[n]);
+        m_pair_nodes.clear();
+    }
 
     /**
-     * Transforms a set of descriptores into a bow vector
-     * @param features
-     * @param v (out) bow vector of weighted words
+     * Appends a feature of a node. The vector is not valid until sortAndGroup is called.
      */
-    virtual void transform(const std::vector<TDescriptor>& features, BowVector& v) const;
+    void addFeature(NodeId id, unsigned int i_feature)
+    {
+        m_pair_nodes.push_back(id);
+        m_features.push_back(i_feature);
+    }
 
     /**
-     * Transform a set of descriptors into a bow vector and a feature vector
-     * @param features
-     * @param v (out) bow vector
-     * @param fv (out) feature vector of nodes and feature indexes
-     * @param levelsup levels to go up the vocabulary tree to get the node index
+     * Groups the appended features by node. The sort is stable, so the features of a node
+     * keep the order they were added in.
      */
-    virtual void transform(const std::vector<TDescriptor>& features, BowVector& v, FeatureVector& fv,
-                           int levelsup) const;
+    void sortAndGroup()
+    {
+        const size_t n = m_pair_nodes.size();
+        if (n > 0)
+        {
+            // least significant digit radix sort, only as many passes as the largest id needs
+            const NodeId max_id = *std::max_element(m_pair_nodes.begin(), m_pair_nodes.end());
+            const int bits      = 11;
+            const NodeId mask   = (1u << bits) - 1;
+            m_tmp_nodes.resize(n);
+            m_tmp_features.resize(n);
+
+            for (int shift = 0; shift < 32 && (max_id >> shift) > 0; shift += bits)
+            {
+                unsigned int offsets[(1 << bits) + 1] = {0};
+                for (size_t i = 0; i < n; ++i) ++offsets[((m_pair_nodes[i] >> shift) & mask) + 1];
+                for (int d = 0; d < (1 << bits); ++d) offsets[d + 1] += offsets[d];
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    const unsigned int pos = offsets[(m_pair_nodes[i] >> shift) & mask]++;
+                    m_tmp_nodes[pos]       = m_pair_nodes[i];
+                    m_tmp_features[pos]    = m_features[i];
+                }
+                m_pair_nodes.swap(m_tmp_nodes);
+                m_features.swap(m_tmp_features);
+            }
+        }
+
+        m_nodes.clear();
+        m_offsets.clear();
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (i == 0 || m_pair_nodes[i] != m_pair_nodes[i - 1])
+            {
+                m_nodes.push_back(m_pair_nodes[i]);
+                m_offsets.push_back(i);
+            }
+        }
+        m_offsets.push_back(n);
+        m_pair_nodes.clear();
+    }
+
+   private:
+    std::vector<NodeId> m_nodes;
+    std::vector<unsigned int> m_offsets;
+    std::vector<unsigned int> m_features;
+
+    /// Node of every feature before grouping, and buffers of the sort
+    std::vector<NodeId> m_pair_nodes;
+    std::vector<NodeId> m_tmp_nodes;
+    std::vector<unsigned int> m_tmp_features;
+};
+
+class L1Scoring
+{
+   public:
+    //    static constexpr inline int id      = 0;
+    enum
+    {
+        id = 0
+    };
+    static constexpr bool mustNormalize = true;
+    static double score(const BowVector& v1, const BowVector& v2)
+    {
+        BowVector::const_iterator v1_it, v2_it;
+        const BowVector::const_iterator v1_end = v1.end();
+        const BowVector::const_iterator v2_end = v2.end();
+        v1_it                                  = v1.begin();
+        v2_it                                  = v2.begin();
+        double score                           = 0;
+        while (v1_it != v1_end && v2_it != v2_end)
+        {
+            const WordValue& vi = v1_it->second;
+            const WordValue& wi = v2_it->second;
+
+            if (v1_it->first == v2_it->first)
+            {
+                score += std::abs(vi - wi) - std::abs(vi) - std::abs(wi);
+                ++v1_it;
+                ++v2_it;
+            }
+            else if (v1_it->first < v2_it->first)
+            {
+                v1_it = v1.lower_bound(v2_it->first);
+            }
+            else
+            {
+                v2_it = v2.lower_bound(v1_it->first);
+            }
+        }
+        score = -score / 2.0;
+
+        return score;  // [0..1]
+    }
 
     /**
-     * Transforms a single feature into a word (without weight)
-     * @param feature
-     * @return word id
+     * Score of two flat bow vectors. Picks galloping search if one vector is much
+     * shorter than the other, otherwise a block intersection with the best
+     * instruction set. All variants add the matches in word order, so they return
+     * exactly the same value as the map based score.
      */
-    virtual WordId transform(const TDescriptor& feature) const;
+    static double score(const FlatBowVector& v1, const FlatBowVector& v2)
+    {
+        const size_t n1 = v1.size();
+        const size_t n2 = v2.size();
+        if (n1 * 32 < n2 || n2 * 32 < n1) return scoreGalloping(v1, v2);
+
+#ifdef MINIBOW_X86
+        if (getSimdLevel() >= SIMD_AVX2) return scoreAvx2(v1, v2);
+#endif
+        return scoreScalar(v1, v2);
+    }
+
+    /// Contribution of a word present in both vectors
+    static inline double term(WordValue vi, WordValue wi) { return std::abs(vi - wi) - std::abs(vi) - std::abs(wi); }
+
+    /// Upper bound of the score added by a word, -term(vi, wi) / 2, for any |wi| <= max_wi
+    static inline double termBound(WordValue vi, WordValue max_wi) { return std::min(std::abs(vi), max_wi); }
+
+    static double scoreScalar(const FlatBowVector& v1, const FlatBowVector& v2)
+    {
+        double score = 0;
+        size_t i = 0, j = 0;
+        scoreScalar(v1, v2, i, j, score);
+        return -score / 2.0;  // [0..1]
+    }
 
     /**
-     * Returns the score of two vectors
-     * @param a vector
-     * @param b vector
-     * @return score between vectors
-     * @note the vectors must be already sorted and normalized if necessary
+     * Merges the vectors from position i and j on and adds the matches to score
      */
-    inline double score(const BowVector& a, const BowVector& b) const;
+    static void scoreScalar(const FlatBowVector& v1, const FlatBowVector& v2, size_t& i, size_t& j, double& score)
+    {
+        const WordId* w1    = v1.words();
+        const WordId* w2    = v2.words();
+        const WordValue* x1 = v1.values();
+        const WordValue* x2 = v2.values();
+        const size_t n1     = v1.size();
+        const size_t n2     = v2.size();
+        while (i < n1 && j < n2)
+        {
+            if (w1[i] == w2[j])
+            {
+                score += term(x1[i], x2[j]);
+                ++i;
+                ++j;
+            }
+            else if (w1[i] < w2[j])
+            {
+                ++i;
+            }
+            else
+            {
+                ++j;
+            }
+        }
+    }
 
     /**
-     * Returns the id of the node that is "levelsup" levels from the word given
-     * @param wid word id
-     * @param levelsup 0..L
-     * @return node id. if levelsup is 0, returns the node id associated to the
-     *   word id
+     * Looks up every word of the shorter vector in the longer one with an exponential search
      */
-    virtual NodeId getParentNode(WordId wid, int levelsup) const;
+    static double scoreGalloping(const FlatBowVector& v1, const FlatBowVector& v2)
+    {
+        const bool swapped         = v1.size() > v2.size();
+        const FlatBowVector& small = swapped ? v2 : v1;
+        const FlatBowVector& large = swapped ? v1 : v2;
+        const WordId* ws    = small.words();
+        const WordId* wl    = large.words();
+        const WordValue* xs = small.values();
+        const WordValue* xl = large.values();
+        const size_t nl     = large.size();
+        double score        = 0;
+
+        size_t j = 0;
+        for (size_t i = 0; i < small.size() && j < nl; ++i)
+        {
+            const WordId id = ws[i];
+
+            // find a range [j + step / 2, j + step] containing id, then binary search in it
+            size_t step = 1;
+            while (j + step < nl && wl[j + step] < id) step *= 2;
+            j = std::lower_bound(wl + j + step / 2, wl + std::min(j + step + 1, nl), id) - wl;
+
+            if (j < nl && wl[j] == id) score += swapped ? term(xl[j], xs[i]) : term(xs[i], xl[j]);
+        }
+        return -score / 2.0;  // [0..1]
+    }
+
+#ifdef MINIBOW_X86
+    /**
+     * Intersects blocks of 8 word ids by comparing against all 8 rotations of the other block.
+     * For each word of v1 the position of the match in the v2 block is tracked, so the matches
+     * can be added in word order.
+     */
+    __attribute__((target("avx2"))) static double scoreAvx2(const FlatBowVector& v1, const FlatBowVector& v2)
+    {
+        static const int rotations[16] = {0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7};
+
+        const WordId* w1    = v1.words();
+        const WordId* w2    = v2.words();
+        const WordValue* x1 = v1.values();
+        const WordValue* x2 = v2.values();
+        const size_t n1     = v1.size();
+        const size_t n2     = v2.size();
+
+        double score = 0;
+        size_t i = 0, j = 0;
+        while (i + 8 <= n1 && j + 8 <= n2)
+        {
+            const __m256i a = _mm256_loadu_si256((const __m256i*)(w1 + i));
+            const __m256i b = _mm256_loadu_si256((const __m256i*)(w2 + j));
+
+            __m256i match    = _mm256_setzero_si256();
+            __m256i position = _mm256_setzero_si256();
+            for (int r = 0; r < 8; ++r)
+            {
+                const __m256i rot = _mm256_loadu_si256((const __m256i*)(rotations + r));
+                const __m256i eq  = _mm256_cmpeq_epi32(a, _mm256_permutevar8x32_epi32(b, rot));
+                match             = _mm256_or_si256(match, eq);
+                position          = _mm256_blendv_epi8(position, rot, eq);
+            }
+
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+            if (mask != 0)
+            {
+                int pos[8];
+                _mm256_storeu_si256((__m256i*)pos, position);
+                while (mask != 0)
+                {
+                    const int l = __builtin_ctz(mask);
+                    score += term(x1[i + l], x2[j + pos[l]]);
+                    mask &= mask - 1;
+                }
+            }
+
+            const WordId a_max = w1[i + 7];
+            const WordId b_max = w2[j + 7];
+            if (a_max <= b_max) i += 8;
+            if (b_max <= a_max) j += 8;
+        }
+
+        scoreScalar(v1, v2, i, j, score);
+        return -score / 2.0;  // [0..1]
+    }
+#endif
+
+    /**
+     * Query vector prepared once to be scored against many vectors, giving the same
+     * values as score(query, candidate). Map candidates are scored with one pass
+     * over their own entries and a hashed copy of the query, flat candidates with
+     * the block intersection above against a flat copy of the query.
+     */
+    class Query
+    {
+       public:
+        explicit Query(const BowVector& q) : m_flat(q) { build(); }
+        explicit Query(const FlatBowVector& q) : m_flat(q) { build(); }
+
+        double score(const BowVector& v) const
+        {
+            double score = 0;
+            for (BowVector::const_iterator it = v.begin(); it != v.end(); ++it)
+            {
+                const WordValue* q = find(it->first);
+                if (q != NULL) score += term(*q, it->second);
+            }
+            return -score / 2.0;  // [0..1]
+        }
+
+        double score(const FlatBowVector& v) const { return L1Scoring::score(m_flat, v); }
+
+       private:
+        static WordId empty() { return std::numeric_limits<WordId>::max(); }
+
+        void build()
+        {
+            // power of two with a load factor of at most 1/2
+            m_shift = 32 - 4;
+            while ((size_t(1) << (32 - m_shift)) < 2 * m_flat.size()) --m_shift;
+            m_keys.assign(size_t(1) << (32 - m_shift), empty());
+            m_values.resize(m_keys.size());
+
+            const size_t mask = m_keys.size() - 1;
+            for (size_t i = 0; i < m_flat.size(); ++i)
+            {
+                size_t h = slot(m_flat.word(i));
+                while (m_keys[h] != empty()) h = (h + 1) & mask;
+                m_keys[h]   = m_flat.word(i);
+                m_values[h] = m_flat.value(i);
+            }
+        }
+
+        inline size_t slot(WordId id) const { return (uint32_t)(id * 2654435761u) >> m_shift; }
+
+        inline const WordValue* find(WordId id) const
+        {
+            const size_t mask = m_keys.size() - 1;
+            for (size_t h = slot(id); m_keys[h] != empty(); h = (h + 1) & mask)
+            {
+                if (m_keys[h] == id) return &m_values[h];
+            }
+            return NULL;
+        }
+
+        FlatBowVector m_flat;
+        std::vector<WordId> m_keys;
+        std::vector<WordValue> m_values;
+        int m_shift;
+    };
+};
+
+/**
+ * Compiled copy of the vocabulary tree used for the descent in transform.
+ * The children of every inner node form one block: their descriptors are stored
+ * next to each other in a 64 byte aligned array, and the child node ids, word ids,
+ * weights and the location of the child's own block are kept in parallel arrays.
+ * Blocks are ordered breadth first, starting with the children of the root.
+ */
+template <class TDescriptor>
+struct FlatTree
+{
+    struct Block
+    {
+        /// Index of the first child slot
+        unsigned int begin;
+        /// Number of children, 0 for leaves
+        unsigned int size;
+    };
+
+    /// Block of the root's children
+    Block root = {0, 0};
+
+    /// Per child slot data
+    std::vector<TDescriptor, AlignedAllocator<TDescriptor, 64>> descriptors;
+    /// Block of the child's own children
+    std::vector<Block> children;
+    std::vector<NodeId> node_ids;
+    std::vector<WordId> word_ids;
+    std::vector<WordValue> weights;
+
+    bool empty() const { return descriptors.empty(); }
+
+    void clear()
+    {
+        root.begin = 0;
+        root.size  = 0;
+        descriptors.clear();
+        children.clear();
+        node_ids.clear();
+        word_ids.clear();
+        weights.clear();
+    }
+
+    /**
+     * Hints the cpu to load the given block, so that it is cached when the descent reaches it
+     */
+    void prefetch(const Block& b) const
+    {
+#ifdef __GNUC__
+        const char* d = reinterpret_cast<const char*>(descriptors.data() + b.begin);
+        for (size_t i = 0; i < b.size * sizeof(TDescriptor); i += 64) __builtin_prefetch(d + i);
+        __builtin_prefetch(children.data() + b.begin);
+#endif
+    }
+};
+
+/**
+ * Work stealing thread pool for the parallel versions of transform.
+ * Every worker has its own task queue; tasks submitted by a worker go to its own
+ * queue, idle workers steal from the others. The thread calling parallelFor takes
+ * part in the work and only waits for iterations that are already running, so
+ * parallelFor may be nested.
+ */
+class ThreadPool
+{
+   public:
+    /**
+     * @param threads number of threads working on a parallelFor, including the calling thread
+     */
+    explicit ThreadPool(int threads = (int)std::thread::hardware_concurrency())
+    {
+        // queue 0 receives the tasks of threads outside the pool
+        const int workers = std::max(threads, 1) - 1;
+        for (int i = 0; i <= workers; ++i) m_queues.emplace_back(new Queue());
+        for (int i = 1; i <= workers; ++i)
+        {
+            m_workers.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (std::thread& t : m_workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /**
+     * Returns the number of threads working on a parallelFor, including the calling thread
+     */
+    int size() const { return (int)m_workers.size() + 1; }
+
+    /**
+     * Calls f(i, worker) for all i in [0, n) and returns when all calls are finished.
+     * Iterations are claimed one by one, so uneven iterations are balanced automatically.
+     * worker is in [0, size()) and unique among the threads working on this call,
+     * so it can be used to index per thread scratch buffers.
+     */
+    template <typename Fn>
+    void parallelFor(size_t n, Fn&& f)
+    {
+        if (m_workers.empty() || n <= 1)
+        {
+            for (size_t i = 0; i < n; ++i) f(i, 0);
+            return;
+        }
+
+        struct State
+        {
+            std::atomic<size_t> next;
+            std::atomic<size_t> done;
+            std::atomic<int> workers;
+        };
+        std::shared_ptr<State> state = std::make_shared<State>();
+        state->next                  = 0;
+        state->done                  = 0;
+        state->workers               = 0;
+
+        // helpers that start after all iterations have been claimed return immediately
+        std::function<void()> body = [state, n, &f]() {
+            if (state->next >= n) return;
+            const int worker = state->workers++;
+            size_t i;
+            while ((i = state->next++) < n)
+            {
+                f(i, worker);
+                state->done++;
+            }
+        };
+
+        const size_t helpers = std::min(n - 1, m_workers.size());
+        for (size_t i = 0; i < helpers; ++i) push(body);
+
+        body();
+        while (state->done < n)
+        {
+            if (!runPendingTask(queueIndex())) std::this_thread::yield();
+        }
+    }
+
+   private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    /// Index of the calling thread's queue
+    int queueIndex() const
+    {
+        const std::pair<const ThreadPool*, int>& current = currentWorker();
+        return current.first == this ? current.second : 0;
+    }
+
+    static std::pair<const ThreadPool*, int>& currentWorker()
+    {
+        static thread_local std::pair<const ThreadPool*, int> current(nullptr, 0);
+        return current;
+    }
+
+    void push(std::function<void()> task)
+    {
+        Queue& q = *m_queues[queueIndex()];
+        {
+            std::unique_lock<std::mutex> lock(q.mutex);
+            q.tasks.push_back(std::move(task));
+        }
+        m_pending++;
+        {
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+        }
+        m_cv.notify_one();
+    }
+
+    /// Pops the newest task of the own queue, or steals the oldest task of another queue
+    bool runPendingTask(int own)
+    {
+        std::function<void()> task;
+        for (size_t k = 0; k < m_queues.size() && !task; ++k)
+        {
+            Queue& q = *m_queues[(own + k) % m_queues.size()];
+            std::unique_lock<std::mutex> lock(q.mutex);
+            if (q.tasks.empty()) continue;
+            if (k == 0)
+            {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+        }
+        if (!task) return false;
+
+        m_pending--;
+        task();
+        return true;
+    }
+
+    void workerLoop(int index)
+    {
+        currentWorker() = std::make_pair(this, index);
+        while (true)
+        {
+            if (runPendingTask(index)) continue;
+
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || m_pending > 0; });
+            if (m_stop && m_pending == 0) return;
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::atomic<int> m_pending{0};
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_cv;
+    bool m_stop = false;
+};
+
+/**
+ * Contents of a file in memory, mapped copy-on-write where mmap is available and read
+ * otherwise. Either way the data is 8 byte aligned and, unless it is opened read only,
+ * writable, and the file never changes.
+ */
+class MappedFile
+{
+   public:
+    MappedFile() : m_data(NULL), m_size(0), m_mapped(false) {}
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * Maps or reads a whole file
+     * @param writable if false, a mapping is read only, which does not reserve memory for copies
+     *   of its pages and may be larger than the memory of the machine
+     * @return false if the file cannot be read or is empty
+     */
+    bool open(const std::string& file, bool writable = true)
+    {
+        close();
+#ifdef MINIBOW_MMAP
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            const int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+            void* data     = mmap(NULL, st.st_size, prot, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                m_data   = static_cast<unsigned char*>(data);
+                m_size   = st.st_size;
+                m_mapped = true;
+            }
+        }
+        ::close(fd);
+        if (m_mapped) return true;
+#endif
+        std::ifstream in(file, std::ios::binary | std::ios::ate);
+        const std::streamoff size = in.tellg();
+        if (!in || size <= 0) return false;
+        m_data = static_cast<unsigned char*>(std::malloc(size));
+        if (m_data == NULL) throw std::bad_alloc();
+        m_size = size;
+        in.seekg(0);
+        if (!in.read(reinterpret_cast<char*>(m_data), size))
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef MINIBOW_MMAP
+        if (m_mapped) munmap(m_data, m_size);
+#endif
+        if (!m_mapped) std::free(m_data);
+        m_data   = NULL;
+        m_size   = 0;
+        m_mapped = false;
+    }
+
+    unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+   private:
+    unsigned char* m_data;
+    size_t m_size;
+    bool m_mapped;
+};
+
+/**
+ * Reusable scratch memory to transform images without building a map per image.
+ * Words are accumulated in a dense array with one value per vocabulary word,
+ * which is only reset at the words touched by the last image.
+ * A context must not be used by several threads at once.
+ */
+struct TransformContext
+{
+    /// Value of every word, 0 for words not in the current image
+    std::vector<WordValue> accumulator;
+    /// Words with a non-zero accumulator, in order of appearance
+    std::vector<WordId> touched;
+    /// Buffer to sort the words when flushing into a map
+    FlatBowVector sorted;
+
+    /**
+     * Makes room for the words of a vocabulary
+     */
+    void resize(size_t words)
+    {
+        if (accumulator.size() < words) accumulator.resize(words, 0);
+    }
+
+    /**
+     * Adds a word with a positive weight
+     * @param accumulate true to sum the weights (like BowVector::addWeight),
+     *   false to keep the first one (like BowVector::addIfNotExist)
+     */
+    inline void add(WordId id, WordValue weight, bool accumulate)
+    {
+        WordValue& a = accumulator[id];
+        if (a == 0)
+        {
+            touched.push_back(id);
+            a = weight;
+        }
+        else if (accumulate)
+        {
+            a += weight;
+        }
+    }
+
+    /**
+     * Moves the accumulated words into a bow vector, sorted by id, and resets the accumulator
+     */
+    void flush(BowVector& v)
+    {
+        flush(sorted);
+        v.clear();
+        for (size_t i = 0; i < sorted.size(); ++i) v.emplace_hint(v.end(), sorted.word(i), sorted.value(i));
+    }
+
+    void flush(FlatBowVector& v)
+    {
+        v.clear();
+        for (size_t i = 0; i < touched.size(); ++i)
+        {
+            v.push_back(touched[i], accumulator[touched[i]]);
+            accumulator[touched[i]] = 0;
+        }
+        touched.clear();
+        v.sortAndMerge(true);  // there are no duplicates left to merge
+    }
+};
+
+/**
+ * Settings of the kmeans runs that create the tree of a vocabulary. The defaults run every
+ * kmeans on all the descriptors of its node until no descriptor changes its cluster.
+ */
+struct TrainingParameters
+{
+    /// Maximum number of iterations of every kmeans, 0 for no limit
+    int max_iterations = 0;
+    /// Every kmeans stops once at most this fraction of its descriptors change their cluster
+    double min_changed_fraction = 0;
+    /// Nodes with more descriptors than this, and than k, run kmeans on a random sample of this
+    /// size, and then assign all their descriptors once to the resulting clusters. 0 to never sample
+    size_t sample_size = 0;
+    /// Seed of the random numbers of the training, negative to draw it with rand().
+    /// The same seed gives the same vocabulary with any number of threads
+    int64_t seed = -1;
+    /// Whether kmeans keeps Hamerly's bounds of the distances of every descriptor, to skip the
+    /// ones that cannot change their cluster. The vocabulary is the same, and about half of the
+    /// distances are skipped, but the bounds take 4 more bytes per descriptor, and when computing
+    /// a distance is as cheap as reading it, like for ORB descriptors, training is not faster
+    bool bounded_assignment = false;
+};
+
+/**
+ * Work of the kmeans assignments of the last training, by level of the tree: index 0 holds the
+ * kmeans of the root, which create the nodes of level 1
+ */
+struct TrainingStatistics
+{
+    /// Distances between descriptors and clusters computed by the assignments
+    std::vector<uint64_t> computed_distances;
+    /// Distances that assignments without bounds would have computed
+    std::vector<uint64_t> exhaustive_distances;
+};
+
+/// @param TDescriptor class of descriptor
+/// @param F class of descriptor functions
+template <class TDescriptor, class F, class Scoring>
+/// Generic Vocabulary
+class TemplatedVocabulary
+{
+   public:
+    /**
+     * Initiates an empty vocabulary
+     * @param k branching factor
+     * @param L depth levels
+     * @param weighting weighting type
+     * @param scoring scoring type
+     */
+    TemplatedVocabulary(int k = 10, int L = 5, WeightingType weighting = TF_IDF);
+
+    /**
+     * Creates the vocabulary by loading a file
+     * @param filename
+     */
+    TemplatedVocabulary(const std::string& filename);
+
+
+    /**
+     * Destructor
+     */
+    virtual ~TemplatedVocabulary();
+
+
+    /**
+     * Creates a vocabulary from the training features with the already
+     * defined parameters
+     * @param training_features
+     */
+    virtual void create(const std::vector<std::vector<TDescriptor>>& training_features);
+
+    /**
+     * Creates a vocabulary from the training features, setting the branching
+     * factor and the depth levels of the tree
+     * @param training_features
+     * @param k branching factor
+     * @param L depth levels
+     */
+    virtual void create(const std::vector<std::vector<TDescriptor>>& training_features, int k, int L);
+
+    /**
+     * Creates a vocabulary from the training features, setting the branching
+     * factor nad the depth levels of the tree, and the weighting and scoring
+     * schemes
+     */
+    virtual void create(const std::vector<std::vector<TDescriptor>>& training_features, int k, int L,
+                        WeightingType weighting);
+
+    /**
+     * Same as create(training_features), but sibling subtrees are trained in parallel, and so
+     * are the kmeans loops and seeding of the large clusters of the upper levels. Every node
+     * draws its random numbers from its own generator, seeded from its position in the tree
+     * and the seed of the training parameters, or one call to rand() if it is negative, so
+     * the vocabulary does not depend on the number of threads.
+     * @param training_features
+     * @param pool
+     */
+    void create(const std::vector<std::vector<TDescriptor>>& training_features, ThreadPool& pool);
+
+    /**
+     * Same as above, with a temporary pool of the given number of threads
+     */
+    void create(const std::vector<std::vector<TDescriptor>>& training_features, int threads);
+
+    /**
+     * Same as create(training_features, pool), reading the training features from files
+     * instead of memory, for sets that do not fit in it. The descriptors are mapped, not
+     * loaded, and besides them training only needs about 12 bytes per descriptor, 16 with
+     * TrainingParameters::bounded_assignment. With the same seed of rand(), the vocabulary
+     * is the same as the one created from memory.
+     * @param descriptor_file raw descriptors of all the images, one image after the other
+     * @param index_file one uint64_t per image: index of the descriptor after its last one
+     * @param pool
+     * @return false if the files cannot be read, do not match or hold 2^31 descriptors or more
+     */
+    bool createFromFiles(const std::string& descriptor_file, const std::string& index_file, ThreadPool& pool);
+
+    /**
+     * Same as above, with a temporary pool of the given number of threads
+     */
+    bool createFromFiles(const std::string& descriptor_file, const std::string& index_file, int threads = 1);
+
+    /**
+     * Returns the number of words in the vocabulary
+     * @return number of words
+     */
+    virtual inline unsigned int size() const;
+
+    /**
+     * Returns whether the vocabulary is empty (i.e. it has not been trained)
+     * @return true iff the vocabulary is empty
+     */
+    virtual inline bool empty() const;
+
+    /**
+     * Transforms a set of descriptores into a bow vector
+     * @param features
+     * @param v (out) bow vector of weighted words
+     */
+    virtual void transform(const std::vector<TDescriptor>& features, BowVector& v) const;
+
+    /**
+     * Transform a set of descriptors into a bow vector and a feature vector
+     * @param features
+     * @param v (out) bow vector
+     * @param fv (out) feature vector of nodes and feature indexes
+     * @param levelsup levels to go up the vocabulary tree to get the node index
+     */
+    virtual void transform(const std::vector<TDescriptor>& features, BowVector& v, FeatureVector& fv,
+                           int levelsup) const;
+
+    /**
+     * Same as the two transforms above, with a flat bow vector. Reusing the same
+     * flat vector for every image avoids all allocations once it has grown.
+     */
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v) const;
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FeatureVector& fv,
+                   int levelsup) const;
+
+    /**
+     * Same as the transforms above, but the words are accumulated in the dense array
+     * of the context instead of a map, so the cost per feature does not depend on the
+     * number of words in the image. Reusing the context across images avoids any
+     * allocation with flat bow vectors. The results are identical.
+     * @param features
+     * @param v (out) bow vector
+     * @param ctx scratch memory, reused across calls
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, TransformContext& ctx) const;
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, TransformContext& ctx) const;
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FeatureVector& fv, int levelsup,
+                   TransformContext& ctx) const;
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FeatureVector& fv, int levelsup,
+                   TransformContext& ctx) const;
+
+    /**
+     * Same as the transforms above, filling a feature vector in compressed sparse row form.
+     * Together with a flat bow vector and a context, transforming an image does not
+     * allocate once the buffers have grown.
+     * @param features
+     * @param v (out) bow vector
+     * @param fv (out) feature vector of nodes and feature indexes
+     * @param levelsup levels to go up the vocabulary tree to get the node index
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FlatFeatureVector& fv,
+                   int levelsup) const;
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FlatFeatureVector& fv,
+                   int levelsup) const;
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FlatFeatureVector& fv, int levelsup,
+                   TransformContext& ctx) const;
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FlatFeatureVector& fv,
+                   int levelsup, TransformContext& ctx) const;
+
+    /**
+     * Same as transform(features, v, fv, levelsup), but the features are split
+     * across the threads of the pool. The result is identical to the sequential one.
+     * @param features
+     * @param v (out) bow vector
+     * @param fv (out) feature vector of nodes and feature indexes
+     * @param levelsup levels to go up the vocabulary tree to get the node index
+     * @param pool
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FeatureVector& fv, int levelsup,
+                   ThreadPool& pool) const;
+
+    /**
+     * Same as above, with a temporary pool of the given number of threads.
+     * Prefer passing a persistent pool when transforming many images.
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FeatureVector& fv, int levelsup,
+                   int threads) const;
+
+    /**
+     * Transforms many images at once. The images are spread across the threads of the pool,
+     * every thread reuses its own scratch buffers. The results are the same as calling
+     * transform on each image.
+     * @param images features of each image
+     * @param vs (out) bow vector of each image
+     * @param fvs (out) if given, feature vector of each image
+     * @param levelsup levels to go up the vocabulary tree to get the node index
+     * @param pool
+     */
+    void transformBatch(const std::vector<std::vector<TDescriptor>>& images, std::vector<BowVector>& vs,
+                        std::vector<FeatureVector>* fvs, int levelsup, ThreadPool& pool) const;
+
+    /**
+     * Same as above, with a temporary pool of the given number of threads
+     */
+    void transformBatch(const std::vector<std::vector<TDescriptor>>& images, std::vector<BowVector>& vs,
+                        std::vector<FeatureVector>* fvs = NULL, int levelsup = 0,
+                        int threads = (int)std::thread::hardware_concurrency()) const;
+
+    /**
+     * Transforms a single feature into a word (without weight)
+     * @param feature
+     * @return word id
+     */
+    virtual WordId transform(const TDescriptor& feature) const;
+
+    /**
+     * Transforms n features into words. The features are pushed down the tree
+     * in groups, one level at a time, and the blocks of the next level are
+     * prefetched while the current level is computed.
+     * @param features array of n features
+     * @param n
+     * @param word_ids (out) n word ids
+     * @param weights (out) n word weights
+     * @param nids (out) if given, n ids of the nodes "levelsup" levels up
+     * @param levelsup
+     */
+    void transformWords(const TDescriptor* features, size_t n, WordId* word_ids, WordValue* weights,
+                        NodeId* nids = NULL, int levelsup = 0) const;
+
+    /**
+     * Returns the score of two vectors
+     * @param a vector
+     * @param b vector
+     * @return score between vectors
+     * @note the vectors must be already sorted and normalized if necessary
+     */
+    inline double score(const BowVector& a, const BowVector& b) const;
+    inline double score(const FlatBowVector& a, const FlatBowVector& b) const;
+
+    /**
+     * Scores a query against many candidates. The query is prepared once, so every
+     * candidate costs a single pass over its own entries. out[i] is the same value
+     * as score(q, *candidates[i]).
+     * @param q query vector
+     * @param candidates n pointers to candidate vectors
+     * @param n
+     * @param out (out) n scores
+     * @param pool
+     */
+    template <class TBowVector>
+    void scoreMany(const TBowVector& q, const TBowVector* const* candidates, size_t n, double* out,
+                   ThreadPool& pool) const;
+
+    /**
+     * Same as above, with a temporary pool of the given number of threads
+     */
+    template <class TBowVector>
+    void scoreMany(const TBowVector& q, const TBowVector* const* candidates, size_t n, double* out,
+                   int threads = 1) const;
+
+    /**
+     * Scores a query against many candidates and keeps the best ones
+     * @param q query vector
+     * @param candidates n pointers to candidate vectors
+     * @param n
+     * @param top (out) (candidate index, score) of the max_results best candidates,
+     *   by descending score, ties by ascending index
+     * @param max_results
+     * @param threads
+     */
+    template <class TBowVector>
+    void scoreMany(const TBowVector& q, const TBowVector* const* candidates, size_t n,
+                   std::vector<std::pair<size_t, double>>& top, size_t max_results, int threads = 1) const;
+
+    /**
+     * Returns the id of the node that is "levelsup" levels from the word given
+     * @param wid word id
+     * @param levelsup 0..L
+     * @return node id. if levelsup is 0, returns the node id associated to the
+     *   word id
+     */
+    virtual NodeId getParentNode(WordId wid, int levelsup) const;
+
+    /**
+     * Returns the ids of all the words that are under the given node id,
+     * by traversing any of the branches that goes down from the node
+     * @param nid starting node id
+     * @param words ids of words
+     */
+    void getWordsFromNode(NodeId nid, std::vector<WordId>& words) const;
+
+    /**
+     * Returns the branching factor of the tree (k)
+     * @return k
+     */
+    inline int getBranchingFactor() const { return m_k; }
+
+    /**
+     * Returns the depth levels of the tree (L)
+     * @return L
+     */
+    inline int getDepthLevels() const { return m_L; }
+
+    /**
+     * Returns the real depth levels of the tree on average
+     * @return average of depth levels of leaves
+     */
+    float getEffectiveLevels() const;
+
+    /**
+     * Returns the descriptor of a word
+     * @param wid word id
+     * @return descriptor
+     */
+    virtual inline TDescriptor getWord(WordId wid) const;
+
+    /**
+     * Returns the weight of a word
+     * @param wid word id
+     * @return weight
+     */
+    virtual inline WordValue getWordWeight(WordId wid) const;
+
+    /**
+     * Returns the weighting method
+     * @return weighting method
+     */
+    inline WeightingType getWeightingType() const { return m_weighting; }
+
+
+    /**
+     * Changes the weighting method
+     * @param type new weighting type
+     */
+    inline void setWeightingType(WeightingType type);
+
+    /**
+     * Returns the settings of the kmeans runs of create
+     */
+    const TrainingParameters& getTrainingParameters() const { return m_training; }
+
+    /**
+     * Changes the settings of the kmeans runs of the next calls to create
+     * @param params
+     */
+    void setTrainingParameters(const TrainingParameters& params) { m_training = params; }
+
+    /**
+     * Returns the work of the kmeans assignments of the last call to create
+     */
+    const TrainingStatistics& getTrainingStatistics() const { return m_statistics; }
+
+    /**
+     * Changes the scoring method
+     * @param type new scoring type
+     */
+
+
+
+    virtual void saveRaw(const std::string& file) const;
+    virtual void loadRaw(const std::string& file);
+
+    /**
+     * Returns a hash of the tree, the weights and the settings of the vocabulary, to reject
+     * data created with another vocabulary, like database snapshots
+     */
+    uint64_t checksum() const;
+
+
+    /**
+     * Stops those words whose weight is below minWeight.
+     * Words are stopped by setting their weight to 0. There are not returned
+     * later when transforming image features into vectors.
+     * Note that when using IDF or TF_IDF, the weight is the idf part, which
+     * is equivalent to -log(f), where f is the frequency of the word
+     * (f = Ni/N, Ni: number of training images where the word is present,
+     * N: number of training images).
+     * Note that the old weight is forgotten, and subsequent calls to this
+     * function with a lower minWeight have no effect.
+     * @return number of words stopped now
+     */
+    virtual int stopWords(double minWeight);
+
+   protected:
+    template <class, class, int, int>
+    friend class StaticVocabulary;
+
+    /// Pointer to descriptor
+    typedef const TDescriptor* pDescriptor;
+
+    /// Tree node
+    struct Node
+    {
+        /// Node id
+        NodeId id;
+        /// Weight if the node is a word
+        WordValue weight;
+        /// Children
+        std::vector<NodeId> children;
+        /// Parent node (undefined in case of root)
+        NodeId parent;
+        /// Node descriptor
+        TDescriptor descriptor;
+
+        /// Word id if the node is a word
+        WordId word_id;
+
+        /**
+         * Empty constructor
+         */
+        Node() : id(0), weight(0), parent(0), descriptor(), word_id(0) {}
+
+        /**
+         * Constructor
+         * @param _id node id
+         */
+        Node(NodeId _id) : id(_id), weight(0), parent(0), descriptor(), word_id(0) {}
+
+        /**
+         * Returns whether the node is a leaf node
+         * @return true iff the node is a leaf
+         */
+        inline bool isLeaf() const { return children.empty(); }
+    };
+
+   protected:
+    /**
+     * Returns a set of pointers to descriptores
+     * @param training_features all the features
+     * @param features (out) pointers to the training features
+     */
+    void getFeatures(const std::vector<std::vector<TDescriptor>>& training_features,
+                     std::vector<pDescriptor>& features) const;
+
+    /**
+     * Returns the word id associated to a feature. The transforms of sets of features only
+     * call it while the vocabulary has no flat tree, which create and loadRaw build: they
+     * descend the flat tree themselves, so overriding this does not change their results.
+     * @param feature
+     * @param id (out) word id
+     * @param weight (out) word weight
+     * @param nid (out) if given, id of the node "levelsup" levels up
+     * @param levelsup
+     */
+    virtual void transform(const TDescriptor& feature, WordId& id, WordValue& weight, NodeId* nid = NULL,
+                           int levelsup = 0) const;
+
+    /**
+     * Returns the word id associated to a feature
+     * @param feature
+     * @param id (out) word id
+     */
+    virtual void transform(const TDescriptor& feature, WordId& id) const;
+
+    /**
+     * Adds n transformed features to a bow vector and, if given, to a feature vector
+     * @param weighting weighting type
+     * @param ids word ids
+     * @param weights word weights, stopped words have weight 0
+     * @param nids node ids for the feature vector
+     * @param n
+     * @param first_feature index of the first of the n features
+     * @param v bow vector
+     * @param fv feature vector, flat feature vector or NULL
+     */
+    template <class TFeatureVector>
+    static void addWords(WeightingType weighting, const WordId* ids, const WordValue* weights, const NodeId* nids,
+                         size_t n, unsigned int first_feature, BowVector& v, TFeatureVector* fv);
+
+    /**
+     * Scales or normalizes a bow vector after all words have been added
+     */
+    static void finishBowVector(WeightingType weighting, BowVector& v);
+
+    /**
+     * Same as above for flat bow vectors, the words are only appended and
+     * sorted by finishBowVector
+     */
+    template <class TFeatureVector>
+    static void addWords(WeightingType weighting, const WordId* ids, const WordValue* weights, const NodeId* nids,
+                         size_t n, unsigned int first_feature, FlatBowVector& v, TFeatureVector* fv);
+    static void finishBowVector(WeightingType weighting, FlatBowVector& v);
+
+    /**
+     * Same as above, accumulating the words in a transform context
+     */
+    template <class TFeatureVector>
+    static void addWords(WeightingType weighting, const WordId* ids, const WordValue* weights, const NodeId* nids,
+                         size_t n, unsigned int first_feature, TransformContext& ctx, TFeatureVector* fv);
+
+    /**
+     * Groups the features of a flat feature vector after all words have been added
+     */
+    static void finishFeatureVector(FeatureVector* fv) { (void)fv; }
+    static void finishFeatureVector(FlatFeatureVector* fv)
+    {
+        if (fv != NULL) fv->sortAndGroup();
+    }
+
+    /**
+     * Scales or normalizes a bow vector that is already sorted and merged
+     */
+    static void scaleBowVector(WeightingType weighting, BowVector& v);
+    static void scaleBowVector(WeightingType weighting, FlatBowVector& v);
+
+    /**
+     * Implements the transforms of a set of descriptors for all kinds of bow and feature vectors
+     * @param fv feature vector or NULL
+     * @param ctx if given, the words are accumulated in the context instead of v
+     */
+    template <class TBowVector, class TFeatureVector>
+    void transformImpl(const std::vector<TDescriptor>& features, TBowVector& v, TFeatureVector* fv,
+                       int levelsup, TransformContext* ctx = NULL) const;
+
+    /// Node of the tree while it is trained, before the node ids are assigned
+    struct TrainingNode
+    {
+        TDescriptor descriptor;
+        std::vector<TrainingNode> children;
+        /// Distances computed by the kmeans that created the children, and without bounds
+        uint64_t computed_distances   = 0;
+        uint64_t exhaustive_distances = 0;
+    };
+
+    /// Training descriptors, stored contiguously or through pointers, addressed by 32-bit indices
+    struct TrainingSet
+    {
+        /// Contiguous descriptors, or NULL to use the pointers
+        const TDescriptor* descriptors;
+        const pDescriptor* pointers;
+
+        const TDescriptor& operator[](unsigned int i) const
+        {
+            return descriptors != NULL ? descriptors[i] : *pointers[i];
+        }
+
+        /**
+         * Calculates the mean value of the n descriptors with the given indices
+         */
+        void meanValue(const unsigned int* indices, size_t n, TDescriptor& mean) const
+        {
+            if (descriptors != NULL)
+                F::meanValue(descriptors, indices, n, mean);
+            else
+                F::meanValue(pointers, indices, n, mean);
+        }
+    };
+
+    /**
+     * Creates the tree, the words and their weights from a training set
+     * @param set
+     * @param image_ends index of the descriptor after the last one of every image
+     * @param pool
+     */
+    void train(const TrainingSet& set, const std::vector<unsigned int>& image_ends, ThreadPool& pool);
+
+    /**
+     * Creates a level in the tree, under the parent, by running kmeans with
+     * a descriptor set, and recursively creates the subsequent levels too.
+     * The children are trained in parallel, and so are the kmeans loops of large sets.
+     * The indices are partitioned in place, so that the descriptors of every child are a
+     * subrange of the ones of its parent, in the same order. Nodes larger than the sample size
+     * of m_training run the kmeans on a sample, and assign all their descriptors at the end.
+     * @param parent node to create the children of
+     * @param set training set
+     * @param indices indices in the set of the n descriptors to run the kmeans on
+     * @param n
+     * @param current_level current level in the tree
+     * @param seed seed of the random numbers of the parent
+     * @param pool
+     */
+    void HKmeansStep(TrainingNode& parent, const TrainingSet& set, unsigned int* indices, size_t n,
+                     int current_level, uint64_t seed, ThreadPool& pool);
+
+    /**
+     * Runs kmeans on n descriptors until it converges or reaches the limits of m_training
+     * @param set training set
+     * @param indices indices in the set of the n descriptors
+     * @param n
+     * @param rng random generator of the node
+     * @param pool
+     * @param clusters (out) cluster centres
+     * @param association (out) cluster of every descriptor
+     * @param members (out) indices of the descriptors of every cluster, one cluster after the other
+     * @param first (out) the members of cluster i start at members[first[i]], first[k] is n
+     * @param computed (in/out) distances computed by the assignments
+     * @param exhaustive (in/out) distances computed by assignments without bounds
+     */
+    void kmeans(const TrainingSet& set, const unsigned int* indices, size_t n, std::mt19937_64& rng, ThreadPool& pool,
+                std::vector<TDescriptor>& clusters, std::vector<int>& association,
+                std::vector<unsigned int>& members, std::vector<size_t>& first, uint64_t& computed,
+                uint64_t& exhaustive);
+
+    /**
+     * Associates n descriptors with their closest clusters
+     * @param association cluster of every descriptor, updated
+     * @return number of descriptors whose cluster changed
+     */
+    size_t assignClusters(const TrainingSet& set, const unsigned int* indices, size_t n,
+                          const std::vector<TDescriptor>& clusters, std::vector<int>& association, ThreadPool& pool);
+
+    /**
+     * Same as assignClusters with the bounds of Hamerly's kmeans, which skip the descriptors that
+     * cannot change their cluster. Hamming distances are a metric, so the clusters are the same.
+     * @param drift distance every cluster moved since the last assignment, NULL for the first one
+     * @param upper upper bound of the distance of every descriptor to its cluster, updated
+     * @param lower lower bound of the distance of every descriptor to any other cluster, updated
+     * @param computed (in/out) distances computed
+     * @return number of descriptors whose cluster changed
+     */
+    size_t assignClustersBounded(const TrainingSet& set, const unsigned int* indices, size_t n,
+                                 const std::vector<TDescriptor>& clusters, const std::vector<int>* drift,
+                                 std::vector<int>& association, std::vector<uint16_t>& upper,
+                                 std::vector<uint16_t>& lower, ThreadPool& pool, uint64_t& computed);
+
+    /**
+     * Groups the indices of n descriptors by cluster, keeping their order, into members and first
+     * as returned by kmeans
+     */
+    static void groupClusters(const unsigned int* indices, size_t n, const std::vector<int>& association, size_t k,
+                              std::vector<unsigned int>& members, std::vector<size_t>& first);
+
+    /**
+     * Appends the trained children of a node to m_nodes in the order of a sequential
+     * recursion: all the children of a node get consecutive ids, then their subtrees
+     * are added one after the other
+     * @param parent_id id of the node in m_nodes
+     * @param parent trained node, its children are released
+     * @param level level of the parent, its kmeans are added to m_statistics
+     */
+    void addTrainedNodes(NodeId parent_id, TrainingNode& parent, int level);
+
+    /**
+     * Creates k clusters from the given descriptors with some seeding algorithm.
+     * @note In this class, kmeans++ is used, but this function should be
+     *   overriden by inherited classes.
+     * @param set training set
+     * @param indices indices in the set of the n descriptors
+     * @param n
+     * @param clusters resulting clusters
+     * @param rng random generator of the node
+     * @param pool
+     */
+    virtual void initiateClusters(const TrainingSet& set, const unsigned int* indices, size_t n,
+                                  std::vector<TDescriptor>& clusters, std::mt19937_64& rng, ThreadPool& pool) const;
+
+    /**
+     * Creates k clusters from the given descriptor sets by running the
+     * initial step of kmeans++. The distances of large sets are updated in parallel.
+     * @param set training set
+     * @param indices indices in the set of the n descriptors
+     * @param n
+     * @param clusters resulting clusters
+     * @param rng random generator of the node
+     * @param pool
+     */
+    void initiateClustersKMpp(const TrainingSet& set, const unsigned int* indices, size_t n,
+                              std::vector<TDescriptor>& clusters, std::mt19937_64& rng, ThreadPool& pool) const;
+
+    /**
+     * Create the words of the vocabulary once the tree has been built
+     */
+    void createWords();
+
+    /**
+     * Builds m_flat from m_nodes. Must be called whenever the structure of the tree changes
+     */
+    void buildFlatTree();
+
+    /**
+     * Copies the node weights into m_flat after they have been changed
+     */
+    void updateFlatWeights();
+
+    /**
+     * Sets the weights of the nodes of tree according to the given features.
+     * Before calling this function, the nodes and the words must be already
+     * created (by calling HKmeansStep and createWords)
+     * @param set training set
+     * @param image_ends index of the descriptor after the last one of every image
+     * @param pool the images are split across the threads
+     */
+    void setNodeWeights(const TrainingSet& set, const std::vector<unsigned int>& image_ends, ThreadPool& pool);
+
+    /**
+     * Returns a random number in the range [min..max]
+     * @param rng
+     * @param min
+     * @param max
+     * @return random T number in [min..max]
+     */
+    template <class T>
+    static T RandomValue(std::mt19937_64& rng, T min, T max)
+    {
+        return ((T)rng() / (T)std::mt19937_64::max()) * (max - min) + min;
+    }
+
+    /**
+     * Returns a random int in the range [min..max]
+     * @param rng
+     * @param min
+     * @param max
+     * @return random int in [min..max]
+     */
+    static int RandomInt(std::mt19937_64& rng, int min, int max)
+    {
+        int d = max - min + 1;
+        return std::min(int(((double)rng() / ((double)std::mt19937_64::max() + 1.0)) * d), d - 1) + min;
+    }
+
+    /**
+     * Returns the seed of the random numbers of the i-th child of a node (splitmix64)
+     */
+    static uint64_t childSeed(uint64_t seed, unsigned int i)
+    {
+        uint64_t z = seed + 0x9e3779b97f4a7c15ull * (i + 1);
+        z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z          = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    /**
+     * Calls f(i) for all i in [0, n), on the threads of the pool if parallel is true
+     */
+    template <class Fn>
+    static void forEach(ThreadPool& pool, bool parallel, size_t n, Fn&& f)
+    {
+        if (parallel)
+            pool.parallelFor(n, [&f](size_t i, int) { f(i); });
+        else
+            for (size_t i = 0; i < n; ++i) f(i);
+    }
+
+    /// Descriptors of a node from which its kmeans loops run in parallel
+    static const size_t PARALLEL_KMEANS_SIZE = 32768;
+    /// Descriptors of a node from which its children are trained in parallel
+    static const size_t PARALLEL_SUBTREE_SIZE = 1024;
+
+   protected:
+    /// Branching factor
+    int m_k;
+
+    /// Depth levels
+    int m_L;
+
+    /// Weighting method
+    WeightingType m_weighting;
+
+    /// Settings of the kmeans runs of create
+    TrainingParameters m_training;
+
+    /// Work of the kmeans assignments of the last call to create
+    TrainingStatistics m_statistics;
+
+
+
+    /// Tree nodes
+    std::vector<Node> m_nodes;
+
+    /// Words of the vocabulary (tree leaves)
+    /// this condition holds: m_words[wid]->word_id == wid
+    std::vector<Node*> m_words;
+
+    /// Cache friendly layout of m_nodes used by transform
+    FlatTree<TDescriptor> m_flat;
+};
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+TemplatedVocabulary<TDescriptor, F, Scoring>::TemplatedVocabulary(int k, int L, WeightingType weighting)
+    : m_k(k), m_L(L), m_weighting(weighting)
+{
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+TemplatedVocabulary<TDescriptor, F, Scoring>::TemplatedVocabulary(const std::string& filename)
+{
+    loadRaw(filename);
+}
+
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::setWeightingType(WeightingType type)
+{
+    this->m_weighting = type;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+TemplatedVocabulary<TDescriptor, F, Scoring>::~TemplatedVocabulary()
+{
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
+    const std::vector<std::vector<TDescriptor>>& training_features)
+{
+    ThreadPool pool(1);
+    create(training_features, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
+    const std::vector<std::vector<TDescriptor>>& training_features, ThreadPool& pool)
+{
+    std::vector<pDescriptor> features;
+    getFeatures(training_features, features);
+    assert(features.size() <= (size_t)std::numeric_limits<int>::max());
+
+    std::vector<unsigned int> image_ends;
+    image_ends.reserve(training_features.size());
+    unsigned int end = 0;
+    for (size_t i = 0; i < training_features.size(); ++i)
+    {
+        end += training_features[i].size();
+        image_ends.push_back(end);
+    }
+
+    TrainingSet set = {NULL, features.data()};
+    train(set, image_ends, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
+    const std::vector<std::vector<TDescriptor>>& training_features, int threads)
+{
+    ThreadPool pool(threads);
+    create(training_features, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+bool TemplatedVocabulary<TDescriptor, F, Scoring>::createFromFiles(const std::string& descriptor_file,
+                                                                   const std::string& index_file, ThreadPool& pool)
+{
+    static_assert(std::is_trivially_copyable<TDescriptor>::value, "descriptors must be stored raw in the file");
+
+    MappedFile descriptors, index;
+    if (!descriptors.open(descriptor_file, false) || !index.open(index_file, false)) return false;
+    if (descriptors.size() % sizeof(TDescriptor) != 0 || index.size() % sizeof(uint64_t) != 0) return false;
+
+    // kmeans++ draws the descriptors with RandomInt
+    const uint64_t n = descriptors.size() / sizeof(TDescriptor);
+    if (n > (uint64_t)std::numeric_limits<int>::max()) return false;
+
+    const uint64_t* ends = reinterpret_cast<const uint64_t*>(index.data());
+    std::vector<unsigned int> image_ends(index.size() / sizeof(uint64_t));
+    for (size_t i = 0; i < image_ends.size(); ++i)
+    {
+        if (ends[i] > n || (i > 0 && ends[i] < ends[i - 1])) return false;
+        image_ends[i] = (unsigned int)ends[i];
+    }
+    if (image_ends.back() != n) return false;
+    index.close();
+
+    TrainingSet set = {reinterpret_cast<const TDescriptor*>(descriptors.data()), NULL};
+    train(set, image_ends, pool);
+    return true;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+bool TemplatedVocabulary<TDescriptor, F, Scoring>::createFromFiles(const std::string& descriptor_file,
+                                                                   const std::string& index_file, int threads)
+{
+    ThreadPool pool(threads);
+    return createFromFiles(descriptor_file, index_file, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::train(const TrainingSet& set,
+                                                         const std::vector<unsigned int>& image_ends,
+                                                         ThreadPool& pool)
+{
+    m_nodes.clear();
+    m_words.clear();
+
+    // create the tree
+    TrainingNode root;
+    {
+        std::vector<unsigned int> indices(image_ends.empty() ? 0 : image_ends.back());
+        std::iota(indices.begin(), indices.end(), 0u);
+        const uint64_t seed = m_training.seed >= 0 ? (uint64_t)m_training.seed : (uint64_t)rand();
+        HKmeansStep(root, set, indices.data(), indices.size(), 1, seed, pool);
+    }
+
+    // expected_nodes = Sum_{i=0..L} ( k^i )
+    int expected_nodes = (int)((std::pow((double)m_k, (double)m_L + 1) - 1) / (m_k - 1));
+
+    m_nodes.reserve(expected_nodes);  // avoid allocations when creating the tree
+
+    // create root
+    m_nodes.push_back(Node(0));  // root
+    m_statistics.computed_distances.assign(m_L, 0);
+    m_statistics.exhaustive_distances.assign(m_L, 0);
+    addTrainedNodes(0, root, 0);
+
+    // create the words
+    createWords();
+    buildFlatTree();
+
+    // and set the weight of each node of the tree
+    setNodeWeights(set, image_ends, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
+    const std::vector<std::vector<TDescriptor>>& training_features, int k, int L)
+{
+    m_k = k;
+    m_L = L;
+
+    create(training_features);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
+    const std::vector<std::vector<TDescriptor>>& training_features, int k, int L, WeightingType weighting)
+{
+    m_k         = k;
+    m_L         = L;
+    m_weighting = weighting;
+
+
+    create(training_features);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::getFeatures(
+    const std::vector<std::vector<TDescriptor>>& training_features, std::vector<pDescriptor>& features) const
+{
+    features.resize(0);
+
+    // reserving image by image would reallocate the whole vector for every image
+    size_t total = 0;
+    typename std::vector<std::vector<TDescriptor>>::const_iterator vvit;
+    for (vvit = training_features.begin(); vvit != training_features.end(); ++vvit) total += vvit->size();
+    features.reserve(total);
+
+    typename std::vector<TDescriptor>::const_iterator vit;
+    for (vvit = training_features.begin(); vvit != training_features.end(); ++vvit)
+    {
+        for (vit = vvit->begin(); vit != vvit->end(); ++vit)
+        {
+            features.push_back(&(*vit));
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::HKmeansStep(TrainingNode& parent, const TrainingSet& set,
+                                                               unsigned int* indices, size_t n, int current_level,
+                                                               uint64_t seed, ThreadPool& pool)
+{
+    if (n == 0) return;
+
+    // features associated to each cluster
+    std::vector<TDescriptor> clusters;
+    // indices of the descriptors of every cluster, one cluster after the other,
+    // the ones of cluster i start at members[first[i]]
+    std::vector<unsigned int> members;
+    std::vector<size_t> first;
+
+    clusters.reserve(m_k);
+
+    if (n <= (size_t)m_k)
+    {
+        // trivial case: one cluster per feature
+        for (size_t i = 0; i < n; i++)
+        {
+            first.push_back(i);
+
+#ifdef USE_CV_FORB
+            clusters.push_back(set[indices[i]].clone());
+#else
+            clusters.push_back(set[indices[i]]);
+#endif
+        }
+        first.push_back(n);
+    }
+    else
+    {
+        // select clusters and groups with kmeans
+        std::mt19937_64 rng(seed);
+        std::vector<int> association;
+
+        const size_t sample_size = m_training.sample_size;
+        if (sample_size > (size_t)m_k && n > sample_size)
+        {
+            // selection sampling, which keeps the order of the descriptors
+            std::vector<unsigned int> sample;
+            sample.reserve(sample_size);
+            for (size_t i = 0; i < n && sample.size() < sample_size; ++i)
+            {
+                if (rng() % (n - i) < sample_size - sample.size()) sample.push_back(indices[i]);
+            }
+
+            kmeans(set, sample.data(), sample.size(), rng, pool, clusters, association, members, first,
+                   parent.computed_distances, parent.exhaustive_distances);
+            std::vector<unsigned int>().swap(sample);
+
+            // all the descriptors are assigned once to the clusters of the sample
+            association.assign(n, -1);
+            assignClusters(set, indices, n, clusters, association, pool);
+            parent.computed_distances += n * clusters.size();
+            parent.exhaustive_distances += n * clusters.size();
+            groupClusters(indices, n, association, clusters.size(), members, first);
+        }
+        else
+        {
+            kmeans(set, indices, n, rng, pool, clusters, association, members, first, parent.computed_distances,
+                   parent.exhaustive_distances);
+        }
+        std::vector<int>().swap(association);
+
+        // the children take consecutive subranges of the indices
+        std::copy(members.begin(), members.end(), indices);
+        std::vector<unsigned int>().swap(members);
+
+    }  // if must run kmeans
+
+    // create nodes
+    parent.children.resize(clusters.size());
+    for (unsigned int i = 0; i < clusters.size(); ++i) parent.children[i].descriptor = clusters[i];
+
+    // go on with the next level
+    if (current_level < m_L)
+    {
+        // iterate again with the resulting clusters
+        const bool parallel_children = n >= PARALLEL_SUBTREE_SIZE && pool.size() > 1;
+        forEach(pool, parallel_children, clusters.size(), [&](size_t i) {
+            const size_t size = first[i + 1] - first[i];
+            if (size > 1)
+            {
+                HKmeansStep(parent.children[i], set, indices + first[i], size, current_level + 1, childSeed(seed, i),
+                            pool);
+            }
+        });
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::kmeans(const TrainingSet& set, const unsigned int* indices,
+                                                          size_t n, std::mt19937_64& rng, ThreadPool& pool,
+                                                          std::vector<TDescriptor>& clusters,
+                                                          std::vector<int>& association,
+                                                          std::vector<unsigned int>& members,
+                                                          std::vector<size_t>& first, uint64_t& computed,
+                                                          uint64_t& exhaustive)
+{
+    // the loops of the large nodes of the upper levels are split across the threads,
+    // the deep levels have enough subtrees to keep the threads busy
+    const bool parallel = n >= PARALLEL_KMEANS_SIZE && pool.size() > 1;
+
+    // 1. random sample
+    initiateClusters(set, indices, n, clusters, rng, pool);
+
+    // allocated after the seeding, which needs memory of its own
+    association.assign(n, -1);
+    std::vector<uint16_t> upper, lower;
+    if (m_training.bounded_assignment)
+    {
+        upper.resize(n);
+        lower.resize(n);
+    }
+
+    // clusters before the last update, and the distance they moved
+    std::vector<TDescriptor> previous;
+    std::vector<int> drift(clusters.size());
+
+    for (int iteration = 1;; ++iteration)
+    {
+        // 2. Associate features with clusters
+        size_t changed;
+        if (m_training.bounded_assignment)
+        {
+            changed = assignClustersBounded(set, indices, n, clusters, iteration > 1 ? &drift : NULL, association,
+                                            upper, lower, pool, computed);
+        }
+        else
+        {
+            changed = assignClusters(set, indices, n, clusters, association, pool);
+            computed += n * clusters.size();
+        }
+        exhaustive += n * clusters.size();
+        groupClusters(indices, n, association, clusters.size(), members, first);
+
+        // kmeans++ ensures all the clusters has any feature associated with them
+
+        // 3. check convergence, the seeds always move
+        if (iteration > 1 && (double)changed <= m_training.min_changed_fraction * n) break;
+        if (m_training.max_iterations > 0 && iteration >= m_training.max_iterations) break;
+
+        // calculate cluster centres
+        if (m_training.bounded_assignment) previous = clusters;
+        forEach(pool, parallel, clusters.size(), [&](size_t c) {
+            set.meanValue(members.data() + first[c], first[c + 1] - first[c], clusters[c]);
+        });
+
+        if (m_training.bounded_assignment)
+        {
+            for (size_t c = 0; c < clusters.size(); ++c) drift[c] = (int)F::distance(previous[c], clusters[c]);
+            computed += clusters.size();
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+size_t TemplatedVocabulary<TDescriptor, F, Scoring>::assignClusters(const TrainingSet& set,
+                                                                    const unsigned int* indices, size_t n,
+                                                                    const std::vector<TDescriptor>& clusters,
+                                                                    std::vector<int>& association, ThreadPool& pool)
+{
+    const bool parallel = n >= PARALLEL_KMEANS_SIZE && pool.size() > 1;
+
+    // calculate distances to cluster centers, in blocks of descriptors
+    std::atomic<size_t> changed(0);
+
+    const size_t block = 4096;
+    forEach(pool, parallel, (n + block - 1) / block, [&](size_t b) {
+        // distances of one descriptor to all clusters
+        std::vector<int> dists(clusters.size());
+        size_t block_changed = 0;
+        const size_t end     = std::min(n, (b + 1) * block);
+        for (size_t i = b * block; i < end; ++i)
+        {
+            const int c = F::distanceMany(set[indices[i]], clusters.data(), clusters.size(), dists.data());
+            block_changed += c != association[i];
+            association[i] = c;
+        }
+        changed.fetch_add(block_changed, std::memory_order_relaxed);
+    });
+    return changed.load(std::memory_order_relaxed);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+size_t TemplatedVocabulary<TDescriptor, F, Scoring>::assignClustersBounded(
+    const TrainingSet& set, const unsigned int* indices, size_t n, const std::vector<TDescriptor>& clusters,
+    const std::vector<int>* drift, std::vector<int>& association, std::vector<uint16_t>& upper,
+    std::vector<uint16_t>& lower, ThreadPool& pool, uint64_t& computed)
+{
+    const bool parallel = n >= PARALLEL_KMEANS_SIZE && pool.size() > 1;
+    const int k         = clusters.size();
+
+    // distance from every cluster to the closest other one: a descriptor closer to its cluster
+    // than half of it is closer to its cluster than to any other one
+    std::vector<int> separation(k, std::numeric_limits<int>::max());
+    // the largest drift of the clusters, and the second largest one for the descriptors of that cluster
+    int max_drift = 0, second_drift = 0, max_cluster = -1;
+    if (drift != NULL)
+    {
+        for (int c = 0; c < k; ++c)
+        {
+            for (int other = c + 1; other < k; ++other)
+            {
+                const int dist    = (int)F::distance(clusters[c], clusters[other]);
+                separation[c]     = std::min(separation[c], dist);
+                separation[other] = std::min(separation[other], dist);
+            }
+
+            const int d = (*drift)[c];
+            if (d > max_drift)
+            {
+                second_drift = max_drift;
+                max_drift    = d;
+                max_cluster  = c;
+            }
+            else if (d > second_drift)
+            {
+                second_drift = d;
+            }
+        }
+        computed += (uint64_t)k * (k - 1) / 2;
+    }
+
+    std::atomic<size_t> changed(0);
+    std::atomic<uint64_t> computed_now(0);
+
+    const size_t block = 4096;
+    forEach(pool, parallel, (n + block - 1) / block, [&](size_t b) {
+        size_t block_changed    = 0;
+        uint64_t block_computed = 0;
+        const size_t end        = std::min(n, (b + 1) * block);
+        for (size_t i = b * block; i < end; ++i)
+        {
+            const int a = association[i];
+            if (drift != NULL)
+            {
+                // the bounds move with the clusters. They are strict, so that a descriptor is only
+                // skipped if no other cluster can be as close, and the first closest cluster wins ties
+                int u       = upper[i] + (*drift)[a];
+                const int l = std::max(0, lower[i] - (a == max_cluster ? second_drift : max_drift));
+                if (u >= l && 2 * u >= separation[a])
+                {
+                    u = (int)F::distance(set[indices[i]], clusters[a]);
+                    block_computed++;
+                }
+                if (u < l || 2 * u < separation[a])
+                {
+                    upper[i] = (uint16_t)u;
+                    lower[i] = (uint16_t)l;
+                    continue;
+                }
+            }
+
+            int best, second;
+            const int c = F::nearestTwo(set[indices[i]], clusters.data(), k, best, second);
+            block_computed += k;
+            block_changed += c != a;
+            association[i] = c;
+            upper[i]       = (uint16_t)best;
+            lower[i]       = (uint16_t)std::min<int>(second, std::numeric_limits<uint16_t>::max());
+        }
+        changed.fetch_add(block_changed, std::memory_order_relaxed);
+        computed_now.fetch_add(block_computed, std::memory_order_relaxed);
+    });
+
+    computed += computed_now.load(std::memory_order_relaxed);
+    return changed.load(std::memory_order_relaxed);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::groupClusters(const unsigned int* indices, size_t n,
+                                                                 const std::vector<int>& association, size_t k,
+                                                                 std::vector<unsigned int>& members,
+                                                                 std::vector<size_t>& first)
+{
+    members.resize(n);
+    first.assign(k + 1, 0);
+    for (size_t i = 0; i < n; ++i) first[association[i] + 1]++;
+    for (size_t c = 0; c < k; ++c) first[c + 1] += first[c];
+
+    std::vector<size_t> next(first.begin(), first.end() - 1);
+    for (size_t i = 0; i < n; ++i) members[next[association[i]]++] = indices[i];
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::addTrainedNodes(NodeId parent_id, TrainingNode& parent,
+                                                                   int level)
+{
+    if (!parent.children.empty())
+    {
+        m_statistics.computed_distances[level] += parent.computed_distances;
+        m_statistics.exhaustive_distances[level] += parent.exhaustive_distances;
+    }
+
+    const NodeId first = m_nodes.size();
+    for (unsigned int i = 0; i < parent.children.size(); ++i)
+    {
+        NodeId id = m_nodes.size();
+        m_nodes.push_back(Node(id));
+        m_nodes.back().descriptor = parent.children[i].descriptor;
+        m_nodes.back().parent     = parent_id;
+        m_nodes[parent_id].children.push_back(id);
+    }
+
+    for (unsigned int i = 0; i < parent.children.size(); ++i)
+    {
+        addTrainedNodes(first + i, parent.children[i], level + 1);
+    }
+    std::vector<TrainingNode>().swap(parent.children);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::initiateClusters(const TrainingSet& set,
+                                                                    const unsigned int* indices, size_t n,
+                                                                    std::vector<TDescriptor>& clusters,
+                                                                    std::mt19937_64& rng, ThreadPool& pool) const
+{
+    initiateClustersKMpp(set, indices, n, clusters, rng, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::initiateClustersKMpp(const TrainingSet& set,
+                                                                        const unsigned int* indices, size_t n,
+                                                                        std::vector<TDescriptor>& clusters,
+                                                                        std::mt19937_64& rng, ThreadPool& pool) const
+{
+    // Implements kmeans++ seeding algorithm
+    // Algorithm:
+    // 1. Choose one center uniformly at random from among the data points.
+    // 2. For each data point x, compute D(x), the distance between x and the nearest
+    //    center that has already been chosen.
+    // 3. Add one new data point as a center. Each point x is chosen with probability
+    //    proportional to D(x).
+    // 4. Repeat Steps 2 and 3 until k centers have been chosen.
+    // 5. Now that the initial centers have been chosen, proceed using standard k-means
+    //    clustering.
+
+    clusters.resize(0);
+    clusters.reserve(m_k);
+
+    // the distances are integers, so the sums of chunks of descriptors are exact
+    // whatever thread computes them
+    const size_t chunk  = 4096;
+    const size_t chunks = (n + chunk - 1) / chunk;
+    std::vector<uint16_t> min_dists(n, std::numeric_limits<uint16_t>::max());
+    // sum of the distances of every chunk, then their prefix sums
+    std::vector<uint64_t> prefix(chunks);
+
+    const bool parallel = n >= PARALLEL_KMEANS_SIZE && pool.size() > 1;
+
+    // 1.
+
+    int ifeature = RandomInt(rng, 0, (int)n - 1);
+
+// create first cluster
+#ifdef USE_CV_FORB
+    clusters.push_back(set[indices[ifeature]].clone());
+#else
+    clusters.push_back(set[indices[ifeature]]);
+#endif
+
+    while ((int)clusters.size() < m_k)
+    {
+        // 2.
+        const TDescriptor& last = clusters.back();
+
+        forEach(pool, parallel, chunks, [&](size_t c) {
+            uint64_t sum     = 0;
+            const size_t end = std::min(n, (c + 1) * chunk);
+            for (size_t i = c * chunk; i < end; ++i)
+            {
+                if (min_dists[i] > 0)
+                {
+                    const int dist = (int)F::distance(set[indices[i]], last);
+                    if (dist < min_dists[i]) min_dists[i] = (uint16_t)dist;
+                }
+                sum += min_dists[i];
+            }
+            prefix[c] = sum;
+        });
+
+        // 3.
+        std::partial_sum(prefix.begin(), prefix.end(), prefix.begin());
+        const double dist_sum = (double)prefix.back();
+
+        if (dist_sum > 0)
+        {
+            double cut_d;
+            do
+            {
+                cut_d = RandomValue<double>(rng, 0, dist_sum);
+            } while (cut_d == 0.0);
+
+            // first descriptor whose cumulative distance reaches cut_d
+            const size_t c = std::lower_bound(prefix.begin(), prefix.end(), cut_d,
+                                              [](uint64_t sum, double cut) { return (double)sum < cut; }) -
+                             prefix.begin();
+
+            ifeature = (int)n - 1;
+            if (c < chunks)
+            {
+                uint64_t d_up_now = c > 0 ? prefix[c - 1] : 0;
+                const size_t end  = std::min(n, (c + 1) * chunk);
+                for (size_t i = c * chunk; i < end; ++i)
+                {
+                    d_up_now += min_dists[i];
+                    if ((double)d_up_now >= cut_d)
+                    {
+                        ifeature = (int)i;
+                        break;
+                    }
+                }
+            }
+
+#ifdef USE_CV_FORB
+            clusters.push_back(set[indices[ifeature]].clone());
+#else
+            clusters.push_back(set[indices[ifeature]]);
+#endif
+
+        }  // if dist_sum > 0
+        else
+            break;
+
+    }  // while(used_clusters < m_k)
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::createWords()
+{
+    m_words.resize(0);
+
+    if (!m_nodes.empty())
+    {
+        m_words.reserve((int)pow((double)m_k, (double)m_L));
+
+        typename std::vector<Node>::iterator nit;
+
+        nit = m_nodes.begin();  // ignore root
+        for (++nit; nit != m_nodes.end(); ++nit)
+        {
+            if (nit->isLeaf())
+            {
+                nit->word_id = m_words.size();
+                m_words.push_back(&(*nit));
+            }
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::setNodeWeights(const TrainingSet& set,
+                                                                  const std::vector<unsigned int>& image_ends,
+                                                                  ThreadPool& pool)
+{
+    const unsigned int NWords = m_words.size();
+    const unsigned int NDocs  = image_ends.size();
+
+    if (m_weighting == TF || m_weighting == BINARY)
+    {
+        // idf part must be 1 always
+        for (unsigned int i = 0; i < NWords; i++) m_words[i]->weight = 1;
+    }
+    else if (m_weighting == IDF || m_weighting == TF_IDF)
+    {
+        // IDF and TF-IDF: we calculte the idf path now
+
+        // Note: this actually calculates the idf part of the tf-idf score.
+        // The complete tf-idf score is calculated in ::transform
+
+        // images per word counted by every thread, the last image that counted a word
+        // tells whether it is already counted for the current one
+        std::vector<std::vector<unsigned int>> worker_Ni(pool.size());
+        std::vector<std::vector<unsigned int>> last_image(pool.size());
+
+        pool.parallelFor(NDocs, [&](size_t image, int worker) {
+            std::vector<unsigned int>& Ni      = worker_Ni[worker];
+            std::vector<unsigned int>& counted = last_image[worker];
+            if (Ni.empty())
+            {
+                Ni.resize(NWords, 0);
+                counted.resize(NWords, std::numeric_limits<unsigned int>::max());
+            }
+
+            const unsigned int begin = image == 0 ? 0 : image_ends[image - 1];
+            for (unsigned int i = begin; i < image_ends[image]; ++i)
+            {
+                WordId word_id;
+                transform(set[i], word_id);
+
+                if (counted[word_id] != image)
+                {
+                    Ni[word_id]++;
+                    counted[word_id] = (unsigned int)image;
+                }
+            }
+        });
+
+        std::vector<unsigned int> Ni(NWords, 0);
+        for (size_t w = 0; w < worker_Ni.size(); ++w)
+        {
+            for (unsigned int i = 0; i < worker_Ni[w].size(); i++) Ni[i] += worker_Ni[w][i];
+        }
+
+        // set ln(N/Ni)
+        for (unsigned int i = 0; i < NWords; i++)
+        {
+            if (Ni[i] > 0)
+            {
+                m_words[i]->weight = log((double)NDocs / (double)Ni[i]);
+            }  // else // This cannot occur if using kmeans++
+        }
+    }
+
+    updateFlatWeights();
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::buildFlatTree()
+{
+    m_flat.clear();
+
+    if (m_nodes.empty() || m_nodes[0].isLeaf()) return;
+
+    // inner nodes in breadth first order and the first slot of their block.
+    // every block is padded to an even number of slots, so that each one starts on a cache line
+    std::vector<NodeId> parents;
+    std::vector<unsigned int> block_begin(m_nodes.size(), 0);
+    size_t slots = 0;
+
+    parents.push_back(0);
+    for (size_t b = 0; b < parents.size(); ++b)
+    {
+        const std::vector<NodeId>& children = m_nodes[parents[b]].children;
+        block_begin[parents[b]]             = slots;
+        slots += children.size() + children.size() % 2;
+
+        for (NodeId cid : children)
+        {
+            if (!m_nodes[cid].isLeaf()) parents.push_back(cid);
+        }
+    }
+
+    m_flat.root.begin = 0;
+    m_flat.root.size  = m_nodes[0].children.size();
+
+    m_flat.descriptors.reserve(slots);
+    m_flat.children.reserve(slots);
+    m_flat.node_ids.reserve(slots);
+    m_flat.word_ids.reserve(slots);
+    m_flat.weights.reserve(slots);
+
+    for (NodeId pid : parents)
+    {
+        const std::vector<NodeId>& children = m_nodes[pid].children;
+
+        for (NodeId cid : children)
+        {
+            const Node& child = m_nodes[cid];
+
+            typename FlatTree<TDescriptor>::Block block;
+            block.begin = block_begin[cid];
+            block.size  = child.children.size();
+
+            m_flat.descriptors.push_back(child.descriptor);
+            m_flat.children.push_back(block);
+            m_flat.node_ids.push_back(cid);
+            m_flat.word_ids.push_back(child.word_id);
+            m_flat.weights.push_back(child.weight);
+        }
+
+        if (children.size() % 2 == 1)
+        {
+            typename FlatTree<TDescriptor>::Block block;
+            block.begin = 0;
+            block.size  = 0;
+
+            m_flat.descriptors.push_back(TDescriptor());
+            m_flat.children.push_back(block);
+            m_flat.node_ids.push_back(0);
+            m_flat.word_ids.push_back(0);
+            m_flat.weights.push_back(0);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::updateFlatWeights()
+{
+    for (size_t i = 0; i < m_flat.node_ids.size(); ++i)
+    {
+        m_flat.weights[i] = m_nodes[m_flat.node_ids[i]].weight;
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+inline unsigned int TemplatedVocabulary<TDescriptor, F, Scoring>::size() const
+{
+    return m_words.size();
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+inline bool TemplatedVocabulary<TDescriptor, F, Scoring>::empty() const
+{
+    return m_words.empty();
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+float TemplatedVocabulary<TDescriptor, F, Scoring>::getEffectiveLevels() const
+{
+    long sum = 0;
+    typename std::vector<Node*>::const_iterator wit;
+    for (wit = m_words.begin(); wit != m_words.end(); ++wit)
+    {
+        const Node* p = *wit;
+
+        for (; p->id != 0; sum++) p = &m_nodes[p->parent];
+    }
+
+    return (float)((double)sum / (double)m_words.size());
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+TDescriptor TemplatedVocabulary<TDescriptor, F, Scoring>::getWord(WordId wid) const
+{
+    return m_words[wid]->descriptor;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+WordValue TemplatedVocabulary<TDescriptor, F, Scoring>::getWordWeight(WordId wid) const
+{
+    return m_words[wid]->weight;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+WordId TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const TDescriptor& feature) const
+{
+    if (empty())
+    {
+        return 0;
+    }
+
+    WordId wid;
+    transform(feature, wid);
+    return wid;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transformWords(const TDescriptor* features, size_t n,
+                                                                  WordId* word_ids, WordValue* weights, NodeId* nids,
+                                                                  int levelsup) const
+{
+    if (m_flat.empty())
+    {
+        for (size_t i = 0; i < n; ++i)
+            transform(features[i], word_ids[i], weights[i], nids ? nids + i : NULL, levelsup);
+        return;
+    }
+
+    typedef typename FlatTree<TDescriptor>::Block Block;
+
+    // level at which the node must be stored in nids, if given
+    const int nid_level = m_L - levelsup;
+
+    // features of a group that have not reached a leaf yet, and their current block
+    const int group = 32;
+    int active[group];
+    Block blocks[group];
+
+    for (size_t g = 0; g < n; g += group)
+    {
+        const TDescriptor* f = features + g;
+        int num_active       = (int)std::min<size_t>(group, n - g);
+
+        for (int i = 0; i < num_active; ++i)
+        {
+            active[i] = i;
+            blocks[i] = m_flat.root;
+            if (nids != NULL && nid_level <= 0) nids[g + i] = 0;  // root
+        }
+
+        for (int current_level = 1; num_active > 0; ++current_level)
+        {
+            int still_active = 0;
+            for (int a = 0; a < num_active; ++a)
+            {
+                const int i        = active[a];
+                const Block& block = blocks[i];
+                const unsigned int slot =
+                    block.begin + F::nearest(f[i], m_flat.descriptors.data() + block.begin, block.size);
+
+                if (nids != NULL && current_level == nid_level) nids[g + i] = m_flat.node_ids[slot];
+
+                const Block& next = m_flat.children[slot];
+                if (next.size > 0)
+                {
+                    // the other features of the group are processed before this block is needed
+                    m_flat.prefetch(next);
+                    blocks[i]              = next;
+                    active[still_active++] = i;
+                }
+                else
+                {
+                    word_ids[g + i] = m_flat.word_ids[slot];
+                    weights[g + i]  = m_flat.weights[slot];
+                }
+            }
+            num_active = still_active;
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+template <class TFeatureVector>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::addWords(WeightingType weighting, const WordId* ids,
+                                                            const WordValue* weights, const NodeId* nids, size_t n,
+                                                            unsigned int first_feature, BowVector& v,
+                                                            TFeatureVector* fv)
+{
+    // weights are the idf value if TF_IDF or IDF, 1 if TF or BINARY
+    const bool accumulate = weighting == TF || weighting == TF_IDF;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (weights[i] > 0)  // not stopped
+        {
+            if (accumulate)
+                v.addWeight(ids[i], weights[i]);
+            else
+                v.addIfNotExist(ids[i], weights[i]);
+
+            if (fv != NULL) fv->addFeature(nids[i], first_feature + i);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::finishBowVector(WeightingType weighting, BowVector& v)
+{
+    scaleBowVector(weighting, v);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::scaleBowVector(WeightingType weighting, BowVector& v)
+{
+    if ((weighting == TF || weighting == TF_IDF) && !v.empty() && !Scoring::mustNormalize)
+    {
+        // unnecessary when normalizing
+        const double nd = v.size();
+        for (BowVector::iterator vit = v.begin(); vit != v.end(); vit++) vit->second /= nd;
+    }
+
+    if (Scoring::mustNormalize) v.normalize();
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+template <class TFeatureVector>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::addWords(WeightingType weighting, const WordId* ids,
+                                                            const WordValue* weights, const NodeId* nids, size_t n,
+                                                            unsigned int first_feature, FlatBowVector& v,
+                                                            TFeatureVector* fv)
+{
+    (void)weighting;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (weights[i] > 0)  // not stopped
+        {
+            v.push_back(ids[i], weights[i]);
+            if (fv != NULL) fv->addFeature(nids[i], first_feature + i);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::finishBowVector(WeightingType weighting, FlatBowVector& v)
+{
+    v.sortAndMerge(weighting == TF || weighting == TF_IDF);
+    scaleBowVector(weighting, v);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::scaleBowVector(WeightingType weighting, FlatBowVector& v)
+{
+    if ((weighting == TF || weighting == TF_IDF) && !v.empty() && !Scoring::mustNormalize)
+    {
+        // unnecessary when normalizing
+        const double nd = v.size();
+        for (size_t i = 0; i < v.size(); ++i) v.values()[i] /= nd;
+    }
+
+    if (Scoring::mustNormalize) v.normalize();
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+template <class TFeatureVector>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::addWords(WeightingType weighting, const WordId* ids,
+                                                            const WordValue* weights, const NodeId* nids, size_t n,
+                                                            unsigned int first_feature, TransformContext& ctx,
+                                                            TFeatureVector* fv)
+{
+    const bool accumulate = weighting == TF || weighting == TF_IDF;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (weights[i] > 0)  // not stopped
+        {
+            ctx.add(ids[i], weights[i], accumulate);
+            if (fv != NULL) fv->addFeature(nids[i], first_feature + i);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+template <class TBowVector, class TFeatureVector>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transformImpl(const std::vector<TDescriptor>& features,
+                                                                 TBowVector& v, TFeatureVector* fv, int levelsup,
+                                                                 TransformContext* ctx) const
+{
+    v.clear();
+    if (fv != NULL) fv->clear();
+
+    if (empty())  // safe for subclasses
+    {
+        return;
+    }
+
+    // words and nodes of one chunk of features
+    const size_t chunk = 64;
+    WordId ids[chunk];
+    WordValue ws[chunk];
+    NodeId nids[chunk] = {};
+
+    if (ctx != NULL) ctx->resize(m_words.size());
+
+    for (size_t c = 0; c < features.size(); c += chunk)
+    {
+        const size_t n = std::min(chunk, features.size() - c);
+        transformWords(features.data() + c, n, ids, ws, fv != NULL ? nids : NULL, levelsup);
+        if (ctx != NULL)
+            addWords(m_weighting, ids, ws, nids, n, c, *ctx, fv);
+        else
+            addWords(m_weighting, ids, ws, nids, n, c, v, fv);
+    }
+
+    if (ctx != NULL)
+    {
+        ctx->flush(v);
+        scaleBowVector(m_weighting, v);
+    }
+    else
+    {
+        finishBowVector(m_weighting, v);
+    }
+    finishFeatureVector(fv);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             BowVector& v) const
+{
+    transformImpl(features, v, (FeatureVector*)NULL, 0);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features, BowVector& v,
+                                                             FeatureVector& fv, int levelsup) const
+{
+    transformImpl(features, v, &fv, levelsup);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             FlatBowVector& v) const
+{
+    transformImpl(features, v, (FeatureVector*)NULL, 0);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             FlatBowVector& v, FeatureVector& fv,
+                                                             int levelsup) const
+{
+    transformImpl(features, v, &fv, levelsup);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             BowVector& v, TransformContext& ctx) const
+{
+    transformImpl(features, v, (FeatureVector*)NULL, 0, &ctx);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             FlatBowVector& v, TransformContext& ctx) const
+{
+    transformImpl(features, v, (FeatureVector*)NULL, 0, &ctx);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             BowVector& v, FeatureVector& fv, int levelsup,
+                                                             TransformContext& ctx) const
+{
+    transformImpl(features, v, &fv, levelsup, &ctx);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             FlatBowVector& v, FeatureVector& fv, int levelsup,
+                                                             TransformContext& ctx) const
+{
+    transformImpl(features, v, &fv, levelsup, &ctx);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             BowVector& v, FlatFeatureVector& fv, int levelsup) const
+{
+    transformImpl(features, v, &fv, levelsup);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             BowVector& v, FlatFeatureVector& fv, int levelsup,
+                                                             TransformContext& ctx) const
+{
+    transformImpl(features, v, &fv, levelsup, &ctx);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             FlatBowVector& v, FlatFeatureVector& fv,
+                                                             int levelsup) const
+{
+    transformImpl(features, v, &fv, levelsup);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
+                                                             FlatBowVector& v, FlatFeatureVector& fv, int levelsup,
+                                                             TransformContext& ctx) const
+{
+    transformImpl(features, v, &fv, levelsup, &ctx);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features, BowVector& v,
+                                                             FeatureVector& fv, int levelsup, ThreadPool& pool) const
+{
+    v.clear();
+    fv.clear();
+
+    if (empty())
+    {
+        return;
+    }
+
+    // Every thread transforms a contiguous range of features and sorts its words and
+    // (node, feature) pairs. All features of a word have the same weight, so a word
+    // is summarized by its number of occurrences and the sums can be reproduced exactly.
+    struct WordCount
+    {
+        WordId id;
+        unsigned int count;
+        WordValue weight;
+    };
+    typedef std::pair<NodeId, unsigned int> NodeFeature;
+
+    const size_t min_chunk  = 256;
+    const size_t num_chunks = std::max<size_t>(1, std::min<size_t>(pool.size(), features.size() / min_chunk));
+
+    std::vector<std::vector<WordCount>> words(num_chunks);
+    std::vector<std::vector<NodeFeature>> nodes(num_chunks);
+
+    pool.parallelFor(num_chunks, [&](size_t c, int) {
+        const size_t begin = features.size() * c / num_chunks;
+        const size_t end   = features.size() * (c + 1) / num_chunks;
+        const size_t n     = end - begin;
+
+        std::vector<WordId> ids(n);
+        std::vector<WordValue> ws(n);
+        std::vector<NodeId> nids(n);
+        transformWords(features.data() + begin, n, ids.data(), ws.data(), nids.data(), levelsup);
+
+        std::vector<std::pair<WordId, WordValue>> word_weights;
+        word_weights.reserve(n);
+        nodes[c].reserve(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (ws[i] > 0)  // not stopped
+            {
+                word_weights.emplace_back(ids[i], ws[i]);
+                nodes[c].emplace_back(nids[i], (unsigned int)(begin + i));
+            }
+        }
+        std::sort(word_weights.begin(), word_weights.end());
+        std::sort(nodes[c].begin(), nodes[c].end());
+
+        for (size_t i = 0; i < word_weights.size();)
+        {
+            size_t j = i + 1;
+            while (j < word_weights.size() && word_weights[j].first == word_weights[i].first) ++j;
+
+            WordCount wc;
+            wc.id     = word_weights[i].first;
+            wc.count  = j - i;
+            wc.weight = word_weights[i].second;
+            words[c].push_back(wc);
+            i = j;
+        }
+    });
+
+    // merge the sorted per thread lists
+    std::vector<WordCount> all_words;
+    std::vector<NodeFeature> all_nodes;
+    for (size_t c = 0; c < num_chunks; ++c)
+    {
+        const size_t mid = all_nodes.size();
+        all_nodes.insert(all_nodes.end(), nodes[c].begin(), nodes[c].end());
+        std::inplace_merge(all_nodes.begin(), all_nodes.begin() + mid, all_nodes.end());
+
+        all_words.insert(all_words.end(), words[c].begin(), words[c].end());
+    }
+    std::stable_sort(all_words.begin(), all_words.end(),
+                     [](const WordCount& a, const WordCount& b) { return a.id < b.id; });
+
+    const bool accumulate = m_weighting == TF || m_weighting == TF_IDF;
+
+    for (size_t i = 0; i < all_words.size();)
+    {
+        unsigned int count = 0;
+        size_t j           = i;
+        for (; j < all_words.size() && all_words[j].id == all_words[i].id; ++j) count += all_words[j].count;
+
+        // same sequence of additions as addWeight
+        const WordValue w = all_words[i].weight;
+        WordValue value   = w;
+        if (accumulate)
+        {
+            for (unsigned int k = 1; k < count; ++k) value += w;
+        }
+        v.emplace_hint(v.end(), all_words[i].id, value);
+        i = j;
+    }
+
+    for (const NodeFeature& nf : all_nodes)
+    {
+        if (fv.empty() || fv.rbegin()->first != nf.first)
+        {
+            fv.emplace_hint(fv.end(), nf.first, std::vector<unsigned int>());
+        }
+        fv.rbegin()->second.push_back(nf.second);
+    }
+
+    finishBowVector(m_weighting, v);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features, BowVector& v,
+                                                             FeatureVector& fv, int levelsup, int threads) const
+{
+    ThreadPool pool(threads);
+    transform(features, v, fv, levelsup, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transformBatch(
+    const std::vector<std::vector<TDescriptor>>& images, std::vector<BowVector>& vs, std::vector<FeatureVector>* fvs,
+    int levelsup, ThreadPool& pool) const
+{
+    vs.resize(images.size());
+    if (fvs != NULL) fvs->resize(images.size());
+
+    // words of the image a thread is working on
+    struct Scratch
+    {
+        std::vector<WordId> ids;
+        std::vector<WordValue> ws;
+        std::vector<NodeId> nids;
+    };
+    std::vector<Scratch> scratch(pool.size());
+
+    pool.parallelFor(images.size(), [&](size_t i, int worker) {
+        const std::vector<TDescriptor>& features = images[i];
+        BowVector& v                             = vs[i];
+        FeatureVector* fv                        = fvs != NULL ? &(*fvs)[i] : NULL;
+
+        v.clear();
+        if (fv != NULL) fv->clear();
+
+        if (empty())
+        {
+            return;
+        }
+
+        Scratch& s = scratch[worker];
+        s.ids.resize(features.size());
+        s.ws.resize(features.size());
+        s.nids.resize(features.size());
+
+        transformWords(features.data(), features.size(), s.ids.data(), s.ws.data(), s.nids.data(), levelsup);
+        addWords(m_weighting, s.ids.data(), s.ws.data(), s.nids.data(), features.size(), 0, v, fv);
+        finishBowVector(m_weighting, v);
+    });
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transformBatch(
+    const std::vector<std::vector<TDescriptor>>& images, std::vector<BowVector>& vs, std::vector<FeatureVector>* fvs,
+    int levelsup, int threads) const
+{
+    ThreadPool pool(threads);
+    transformBatch(images, vs, fvs, levelsup, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+inline double TemplatedVocabulary<TDescriptor, F, Scoring>::score(const BowVector& v1, const BowVector& v2) const
+{
+    return Scoring::score(v1, v2);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+inline double TemplatedVocabulary<TDescriptor, F, Scoring>::score(const FlatBowVector& v1,
+                                                                  const FlatBowVector& v2) const
+{
+    return Scoring::score(v1, v2);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+template <class TBowVector>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::scoreMany(const TBowVector& q,
+                                                             const TBowVector* const* candidates, size_t n,
+                                                             double* out, ThreadPool& pool) const
+{
+    const typename Scoring::Query query(q);
+    pool.parallelFor(n, [&](size_t i, int) { out[i] = query.score(*candidates[i]); });
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+template <class TBowVector>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::scoreMany(const TBowVector& q,
+                                                             const TBowVector* const* candidates, size_t n,
+                                                             double* out, int threads) const
+{
+    if (threads <= 1)
+    {
+        const typename Scoring::Query query(q);
+        for (size_t i = 0; i < n; ++i) out[i] = query.score(*candidates[i]);
+        return;
+    }
+
+    ThreadPool pool(threads);
+    scoreMany(q, candidates, n, out, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+template <class TBowVector>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::scoreMany(const TBowVector& q,
+                                                             const TBowVector* const* candidates, size_t n,
+                                                             std::vector<std::pair<size_t, double>>& top,
+                                                             size_t max_results, int threads) const
+{
+    std::vector<double> scores(n);
+    scoreMany(q, candidates, n, scores.data(), threads);
+
+    top.resize(n);
+    for (size_t i = 0; i < n; ++i) top[i] = std::make_pair(i, scores[i]);
+
+    const size_t m = std::min(max_results, n);
+    std::partial_sort(top.begin(), top.begin() + m, top.end(),
+                      [](const std::pair<size_t, double>& a, const std::pair<size_t, double>& b)
+                      { return a.second > b.second || (a.second == b.second && a.first < b.first); });
+    top.resize(m);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const TDescriptor& feature, WordId& id) const
+{
+    WordValue weight;
+    transform(feature, id, weight);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const TDescriptor& feature, WordId& word_id,
+                                                             WordValue& weight, NodeId* nid, int levelsup) const
+{
+    // level at which the node must be stored in nid, if given
+    const int nid_level = m_L - levelsup;
+    if (nid_level <= 0 && nid != NULL) *nid = 0;  // root
+
+    if (!m_flat.empty())
+    {
+        // propagate the feature down the flat tree, one block per level
+        typename FlatTree<TDescriptor>::Block block = m_flat.root;
+        unsigned int slot                           = 0;
+        int current_level                           = 0;
+
+        do
+        {
+            ++current_level;
+            slot = block.begin + F::nearest(feature, m_flat.descriptors.data() + block.begin, block.size);
+
+            if (nid != NULL && current_level == nid_level) *nid = m_flat.node_ids[slot];
+
+            block = m_flat.children[slot];
+        } while (block.size > 0);
+
+        word_id = m_flat.word_ids[slot];
+        weight  = m_flat.weights[slot];
+        return;
+    }
+
+    // propagate the feature down the tree
+    std::vector<NodeId> nodes;
+    typename std::vector<NodeId>::const_iterator nit;
+
+    NodeId final_id   = 0;  // root
+    int current_level = 0;
+
+    do
+    {
+        ++current_level;
+        nodes    = m_nodes[final_id].children;
+        final_id = nodes[0];
+
+        double best_d = F::distance(feature, m_nodes[final_id].descriptor);
+
+        for (nit = nodes.begin() + 1; nit != nodes.end(); ++nit)
+        {
+            NodeId id = *nit;
+            double d  = F::distance(feature, m_nodes[id].descriptor);
+            if (d < best_d)
+            {
+                best_d   = d;
+                final_id = id;
+            }
+        }
+
+        if (nid != NULL && current_level == nid_level) *nid = final_id;
+
+    } while (!m_nodes[final_id].isLeaf());
+
+    // turn node id into word id
+    word_id = m_nodes[final_id].word_id;
+    weight  = m_nodes[final_id].weight;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+NodeId TemplatedVocabulary<TDescriptor, F, Scoring>::getParentNode(WordId wid, int levelsup) const
+{
+    NodeId ret = m_words[wid]->id;    // node id
+    while (levelsup > 0 && ret != 0)  // ret == 0 --> root
+    {
+        --levelsup;
+        ret = m_nodes[ret].parent;
+    }
+    return ret;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::getWordsFromNode(NodeId nid, std::vector<WordId>& words) const
+{
+    words.clear();
+
+    if (m_nodes[nid].isLeaf())
+    {
+        words.push_back(m_nodes[nid].word_id);
+    }
+    else
+    {
+        words.reserve(m_k);  // ^1, ^2, ...
+
+        std::vector<NodeId> parents;
+        parents.push_back(nid);
+
+        while (!parents.empty())
+        {
+            NodeId parentid = parents.back();
+            parents.pop_back();
+
+            const std::vector<NodeId>& child_ids = m_nodes[parentid].children;
+            std::vector<NodeId>::const_iterator cit;
+
+            for (cit = child_ids.begin(); cit != child_ids.end(); ++cit)
+            {
+                const Node& child_node = m_nodes[*cit];
+
+                if (child_node.isLeaf())
+                    words.push_back(child_node.word_id);
+                else
+                    parents.push_back(*cit);
+
+            }  // for each child
+        }      // while !parents.empty
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+int TemplatedVocabulary<TDescriptor, F, Scoring>::stopWords(double minWeight)
+{
+    int c = 0;
+    typename std::vector<Node*>::iterator wit;
+    for (wit = m_words.begin(); wit != m_words.end(); ++wit)
+    {
+        if ((*wit)->weight < minWeight)
+        {
+            ++c;
+            (*wit)->weight = 0;
+        }
+    }
+    updateFlatWeights();
+    return c;
+}
+
+
+struct BinaryFile
+{
+    BinaryFile(const std::string& file, std::ios_base::openmode __mode = std::ios_base::in)
+        : strm(file, std::ios::binary | __mode)
+    {
+    }
+
+    template <typename T>
+    void write(const T& v)
+    {
+        strm.write(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    template <typename T>
+    void write(const std::vector<T>& vec)
+    {
+        write((size_t)vec.size());
+        for (auto& v : vec) write(v);
+    }
+
+    template <typename T>
+    void read(std::vector<T>& vec)
+    {
+        size_t s;
+        read(s);
+        vec.resize(s);
+        for (auto& v : vec) read(v);
+    }
+
+    template <typename T>
+    void read(T& v)
+    {
+        strm.read(reinterpret_cast<char*>(&v), sizeof(T));
+    }
+
+    template <typename T>
+    BinaryFile& operator<<(const T& v)
+    {
+        write(v);
+        return *this;
+    }
+
+    template <typename T>
+    BinaryFile& operator>>(T& v)
+    {
+        read(v);
+        return *this;
+    }
+
+    std::fstream strm;
+};
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::loadRaw(const std::string& file)
+{
+    BinaryFile bf(file, std::ios_base::in);
+    int scoringid;
+    bf >> m_k >> m_L >> scoringid >> m_weighting;
+
+    if (m_weighting != TF_IDF)
+    {
+        std::cout << "fail1" << std::endl;
+        exit(0);
+    }
+    if (scoringid != Scoring::id)
+    {
+        std::cout << "fail2" << std::endl;
+        exit(0);
+    }
+
+
+    size_t nodecount;
+    bf >> nodecount;
+    m_nodes.resize(nodecount);
+    for (Node& n : m_nodes)
+    {
+        //        typename F::BinaryDescriptor des;
+        bf >> n.id >> n.parent >> n.weight >> n.word_id >> n.descriptor;
+        //        F::fromBinary(des, n.descriptor);
+        if (n.id != 0) m_nodes[n.parent].children.push_back(n.id);
+    }
+
+    // words
+    std::vector<std::pair<int, int>> words;
+    bf >> words;
+
+    m_words.resize(words.size());
+    for (auto i = 0; i < m_words.size(); ++i)
+    {
+        m_words[i] = &m_nodes[words[i].second];
+    }
+
+    buildFlatTree();
+}
+
+
+
+template <class TDescriptor, class F, class Scoring>
+void TemplatedVocabulary<TDescriptor, F, Scoring>::saveRaw(const std::string& file) const
+{
+    BinaryFile bf(file, std::ios_base::out);
+    bf << m_k << m_L << Scoring::id << m_weighting;
+    bf << (size_t)m_nodes.size();
+    for (const Node& n : m_nodes)
+    {
+        bf << n.id << n.parent << n.weight << n.word_id << n.descriptor;
+    }
+    // words
+    std::vector<std::pair<int, int>> words;
+    for (auto i = 0; i < m_words.size(); ++i)
+    {
+        words.emplace_back(i, m_words[i]->id);
+    }
+    bf << words;
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring>
+uint64_t TemplatedVocabulary<TDescriptor, F, Scoring>::checksum() const
+{
+    // FNV-1a on 64 bit words
+    uint64_t hash = 14695981039346656037ull;
+    auto mix      = [&hash](uint64_t x) { hash = (hash ^ x) * 1099511628211ull; };
+    auto mixBytes = [&mix](const void* data, size_t bytes) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; i += 8)
+        {
+            uint64_t x = 0;
+            std::memcpy(&x, p + i, std::min<size_t>(8, bytes - i));
+            mix(x);
+        }
+    };
+
+    mix(m_k);
+    mix(m_L);
+    mix(m_weighting);
+    mix(Scoring::id);
+    mix(m_nodes.size());
+    for (const Node& n : m_nodes)
+    {
+        mix(n.parent);
+        mix(n.word_id);
+        mixBytes(&n.weight, sizeof(n.weight));
+        mixBytes(&n.descriptor, sizeof(n.descriptor));
+    }
+    mix(m_words.size());
+    for (size_t i = 0; i < m_words.size(); ++i) mix(m_words[i]->id);
+    return hash;
+}
+
+
+
+// --------------------------------------------------------------------------
+
+/**
+ * Writes printable information of the vocabulary
+ * @param os stream to write to
+ * @param voc
+ */
+template <class TDescriptor, class F, class Scoring>
+std::ostream& operator<<(std::ostream& os, const TemplatedVocabulary<TDescriptor, F, Scoring>& voc)
+{
+    os << "Vocabulary: k = " << voc.getBranchingFactor() << ", L = " << voc.getDepthLevels() << ", Weighting = ";
+
+    switch (voc.getWeightingType())
+    {
+        case TF_IDF:
+            os << "tf-idf";
+            break;
+        case TF:
+            os << "tf";
+            break;
+        case IDF:
+            os << "idf";
+            break;
+        case BINARY:
+            os << "binary";
+            break;
+    }
+
+    os << ", Scoring = ";
+    switch (Scoring::id)
+    {
+        case 0:
+            os << "L1-norm";
+            break;
+    }
+
+    os << ", Number of words = " << voc.size();
+
+    return os;
+}
+
+// --------------------------------------------------------------------------
+
+/**
+ * Read-only vocabulary with the branching factor and the depth fixed at compile time,
+ * for example StaticVocabulary<FORB, L1Scoring, 10, 6> for the ORB vocabulary.
+ * Every node has a block of exactly K child slots, so the sibling scans and the
+ * descent can be unrolled, and there are no virtual calls.
+ * The transform results are identical to the ones of the TemplatedVocabulary it is built from.
+ */
+template <class F, class Scoring, int K, int L>
+class StaticVocabulary final
+{
+   public:
+    typedef typename F::TDescriptor TDescriptor;
+    typedef TemplatedVocabulary<TDescriptor, F, Scoring> Vocabulary;
+
+    static constexpr int BranchingFactor = K;
+    static constexpr int DepthLevels     = L;
+
+    StaticVocabulary() : m_weighting(TF_IDF), m_depth(L), m_num_words(0) {}
+
+    /**
+     * Compiles the given vocabulary, see build. The vocabulary is empty if it does not fit.
+     */
+    explicit StaticVocabulary(const Vocabulary& voc) { build(voc); }
+
+    /**
+     * Loads a vocabulary file created with TemplatedVocabulary::saveRaw, see loadRaw
+     */
+    explicit StaticVocabulary(const std::string& file) { loadRaw(file); }
+
+    /**
+     * Compiles the given vocabulary. Its branching factor must not be larger than K
+     * and its depth not larger than L, which is checked while the tree is compiled.
+     * @param voc
+     * @return false if the vocabulary does not fit, this vocabulary is left empty then
+     */
+    bool build(const Vocabulary& voc);
+
+    /**
+     * Loads a vocabulary file created with TemplatedVocabulary::saveRaw and compiles it
+     * @param file
+     * @return false if the vocabulary does not fit, this vocabulary is left empty then
+     */
+    bool loadRaw(const std::string& file)
+    {
+        Vocabulary voc(file);
+        return build(voc);
+    }
+
+    /**
+     * Returns the number of words in the vocabulary
+     */
+    unsigned int size() const { return m_num_words; }
+
+    /**
+     * Returns whether the vocabulary is empty
+     */
+    bool empty() const { return m_num_words == 0; }
+
+    WeightingType getWeightingType() const { return m_weighting; }
+
+    /**
+     * Transforms a single feature into a word (without weight)
+     */
+    WordId transform(const TDescriptor& feature) const
+    {
+        if (empty()) return 0;
+
+        WordId id;
+        WordValue w;
+        transformWords(&feature, 1, &id, &w);
+        return id;
+    }
+
+    /**
+     * Transforms a set of descriptors into a bow vector
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v) const
+    {
+        transformImpl(features, v, (FeatureVector*)NULL, 0);
+    }
+
+    /**
+     * Transforms a set of descriptors into a bow vector and a feature vector
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FeatureVector& fv, int levelsup) const
+    {
+        transformImpl(features, v, &fv, levelsup);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v) const
+    {
+        transformImpl(features, v, (FeatureVector*)NULL, 0);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FeatureVector& fv,
+                   int levelsup) const
+    {
+        transformImpl(features, v, &fv, levelsup);
+    }
+
+    /**
+     * Transforms accumulating the words in a context, see TemplatedVocabulary::transform
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, TransformContext& ctx) const
+    {
+        transformImpl(features, v, (FeatureVector*)NULL, 0, &ctx);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, TransformContext& ctx) const
+    {
+        transformImpl(features, v, (FeatureVector*)NULL, 0, &ctx);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FeatureVector& fv, int levelsup,
+                   TransformContext& ctx) const
+    {
+        transformImpl(features, v, &fv, levelsup, &ctx);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FeatureVector& fv, int levelsup,
+                   TransformContext& ctx) const
+    {
+        transformImpl(features, v, &fv, levelsup, &ctx);
+    }
+
+    /**
+     * Transforms filling a feature vector in compressed sparse row form
+     */
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FlatFeatureVector& fv,
+                   int levelsup) const
+    {
+        transformImpl(features, v, &fv, levelsup);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FlatFeatureVector& fv,
+                   int levelsup) const
+    {
+        transformImpl(features, v, &fv, levelsup);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, BowVector& v, FlatFeatureVector& fv, int levelsup,
+                   TransformContext& ctx) const
+    {
+        transformImpl(features, v, &fv, levelsup, &ctx);
+    }
+
+    void transform(const std::vector<TDescriptor>& features, FlatBowVector& v, FlatFeatureVector& fv,
+                   int levelsup, TransformContext& ctx) const
+    {
+        transformImpl(features, v, &fv, levelsup, &ctx);
+    }
+
+    /**
+     * Transforms n features into words, see TemplatedVocabulary::transformWords
+     */
+    void transformWords(const TDescriptor* features, size_t n, WordId* word_ids, WordValue* weights,
+                        NodeId* nids = NULL, int levelsup = 0) const;
+
+    double score(const BowVector& a, const BowVector& b) const { return Scoring::score(a, b); }
+    double score(const FlatBowVector& a, const FlatBowVector& b) const { return Scoring::score(a, b); }
+
+   private:
+    template <class TBowVector, class TFeatureVector>
+    void transformImpl(const std::vector<TDescriptor>& features, TBowVector& v, TFeatureVector* fv,
+                       int levelsup, TransformContext* ctx = NULL) const
+    {
+        v.clear();
+        if (fv != NULL) fv->clear();
+        if (empty()) return;
+        if (ctx != NULL) ctx->resize(m_num_words);
+
+        const size_t chunk = 64;
+        WordId ids[chunk];
+        WordValue ws[chunk];
+        NodeId nids[chunk] = {};
+        for (size_t c = 0; c < features.size(); c += chunk)
+        {
+            const size_t n = std::min(chunk, features.size() - c);
+            transformWords(features.data() + c, n, ids, ws, fv != NULL ? nids : NULL, levelsup);
+            if (ctx != NULL)
+                Vocabulary::addWords(m_weighting, ids, ws, nids, n, c, *ctx, fv);
+            else
+                Vocabulary::addWords(m_weighting, ids, ws, nids, n, c, v, fv);
+        }
+
+        if (ctx != NULL)
+        {
+            ctx->flush(v);
+            Vocabulary::scaleBowVector(m_weighting, v);
+        }
+        else
+        {
+            Vocabulary::finishBowVector(m_weighting, v);
+        }
+        Vocabulary::finishFeatureVector(fv);
+    }
+
+    void prefetch(int block) const
+    {
+#ifdef __GNUC__
+        const char* d = reinterpret_cast<const char*>(m_descriptors.data() + block * K);
+        for (size_t i = 0; i < K * sizeof(TDescriptor); i += 64) __builtin_prefetch(d + i);
+        __builtin_prefetch(m_next.data() + block * K);
+#endif
+    }
+
+    WeightingType m_weighting;
+    /// Depth levels of the source vocabulary, levelsup is relative to it
+    int m_depth;
+    unsigned int m_num_words;
+
+    /// Slot j of block b is at b * K + j. Unused slots repeat the first child,
+    /// which never wins against it because the first nearest child is taken.
+    std::vector<TDescriptor, AlignedAllocator<TDescriptor, 64>> m_descriptors;
+    /// Block of the child's children or -1 if the child is a leaf
+    std::vector<int> m_next;
+    std::vector<NodeId> m_node_ids;
+    std::vector<WordId> m_word_ids;
+    std::vector<WordValue> m_weights;
+};
+
+// --------------------------------------------------------------------------
+
+template <class F, class Scoring, int K, int L>
+bool StaticVocabulary<F, Scoring, K, L>::build(const Vocabulary& voc)
+{
+    typedef typename Vocabulary::Node Node;
+    const std::vector<Node>& nodes = voc.m_nodes;
+
+    m_weighting = voc.getWeightingType();
+    m_depth     = voc.getDepthLevels();
+    m_num_words = voc.size();
+    m_descriptors.clear();
+    m_next.clear();
+    m_node_ids.clear();
+    m_word_ids.clear();
+    m_weights.clear();
+
+    if (nodes.empty() || nodes[0].isLeaf())
+    {
+        m_num_words = 0;
+        return true;
+    }
+
+    // inner nodes in breadth first order and their depth
+    std::vector<NodeId> parents(1, 0);
+    std::vector<int> depth(1, 0);
+    for (size_t b = 0; b < parents.size(); ++b)
+    {
+        const std::vector<NodeId>& children = nodes[parents[b]].children;
+        if ((int)children.size() > K || depth[b] >= L)
+        {
+            m_depth     = L;
+            m_num_words = 0;
+            return false;
+        }
+        for (NodeId cid : children)
+        {
+            if (!nodes[cid].isLeaf())
+            {
+                parents.push_back(cid);
+                depth.push_back(depth[b] + 1);
+            }
+        }
+    }
+
+    m_descriptors.resize(parents.size() * K);
+    m_next.resize(parents.size() * K);
+    m_node_ids.resize(parents.size() * K);
+    m_word_ids.resize(parents.size() * K);
+    m_weights.resize(parents.size() * K);
+
+    int next_block = 1;
+    for (size_t b = 0; b < parents.size(); ++b)
+    {
+        const std::vector<NodeId>& children = nodes[parents[b]].children;
+        for (int j = 0; j < K; ++j)
+        {
+            const size_t slot = b * K + j;
+            if (j >= (int)children.size())
+            {
+                // padding, copy of the first child
+                m_descriptors[slot] = m_descriptors[b * K];
+                m_next[slot]        = m_next[b * K];
+                m_node_ids[slot]    = m_node_ids[b * K];
+                m_word_ids[slot]    = m_word_ids[b * K];
+                m_weights[slot]     = m_weights[b * K];
+                continue;
+            }
+
+            const Node& child   = nodes[children[j]];
+            m_descriptors[slot] = child.descriptor;
+            m_next[slot]        = child.isLeaf() ? -1 : next_block++;
+            m_node_ids[slot]    = child.id;
+            m_word_ids[slot]    = child.word_id;
+            m_weights[slot]     = child.weight;
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------
+
+template <class F, class Scoring, int K, int L>
+void StaticVocabulary<F, Scoring, K, L>::transformWords(const TDescriptor* features, size_t n, WordId* word_ids,
+                                                        WordValue* weights, NodeId* nids, int levelsup) const
+{
+    // level at which the node must be stored in nids, if given
+    const int nid_level = m_depth - levelsup;
+
+    const int group = 32;
+    int active[group];
+    int blocks[group];
+
+    for (size_t g = 0; g < n; g += group)
+    {
+        const TDescriptor* f = features + g;
+        int num_active       = (int)std::min<size_t>(group, n - g);
+
+        for (int i = 0; i < num_active; ++i)
+        {
+            active[i] = i;
+            blocks[i] = 0;
+            if (nids != NULL && nid_level <= 0) nids[g + i] = 0;  // root
+        }
+
+        for (int current_level = 1; current_level <= L && num_active > 0; ++current_level)
+        {
+            int still_active = 0;
+            for (int a = 0; a < num_active; ++a)
+            {
+                const int i        = active[a];
+                const size_t begin = (size_t)blocks[i] * K;
+                const size_t slot  = begin + F::template nearest<K>(f[i], m_descriptors.data() + begin);
+
+                if (nids != NULL && current_level == nid_level) nids[g + i] = m_node_ids[slot];
+
+                const int next = m_next[slot];
+                if (next >= 0)
+                {
+                    prefetch(next);
+                    blocks[i]              = next;
+                    active[still_active++] = i;
+                }
+                else
+                {
+                    word_ids[g + i] = m_word_ids[slot];
+                    weights[g + i]  = m_weights[slot];
+                }
+            }
+            num_active = still_active;
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+/// Pair of matching features of two images
+struct FeatureMatch
+{
+    /// Index of the feature in the first image
+    unsigned int index1;
+    /// Index of the feature in the second image
+    unsigned int index2;
+    /// Distance between their descriptors
+    int distance;
+};
+
+/**
+ * Matches the descriptors of two images among the features that share a vocabulary node,
+ * like SearchByBoW of ORB-SLAM. The node ids of the two feature vectors, computed by
+ * transform with the same levelsup, are co-iterated; the features of the shared nodes in the
+ * second image are gathered next to each other and every feature of a node in the first image
+ * is compared to all the features of the node in the second image with F::nearestTwo.
+ *
+ * A feature of the first image is matched to its nearest neighbour if their distance is at
+ * most the maximum distance and smaller than the ratio times the distance to the second
+ * nearest one. A feature of the second image matched several times keeps the closest match,
+ * with the lowest index on ties, so the matches do not depend on the number of threads.
+ * Every feature must be in one node, as transform computes them.
+ *
+ * A matcher keeps its scratch buffers between calls and must not be used by several threads
+ * at once.
+ */
+template <class TDescriptor, class F>
+class TemplatedMatcher
+{
+   public:
+    /**
+     * @param max_distance largest distance of a match
+     * @param ratio the distance of a match must be smaller than ratio times the distance to
+     *   the second nearest feature of the node
+     */
+    explicit TemplatedMatcher(int max_distance = 50, double ratio = 0.7)
+        : m_max_distance(max_distance), m_ratio(ratio)
+    {
+    }
+
+    int getMaxDistance() const { return m_max_distance; }
+    void setMaxDistance(int max_distance) { m_max_distance = max_distance; }
+
+    double getRatio() const { return m_ratio; }
+    void setRatio(double ratio) { m_ratio = ratio; }
+
+    /**
+     * Matches the features of two images
+     * @param fv1 feature vector of the first image
+     * @param features1 descriptors of the first image
+     * @param fv2 feature vector of the second image
+     * @param features2 descriptors of the second image
+     * @param matches (out) matches, grouped by node
+     */
+    template <class TFeatureVector>
+    void match(const TFeatureVector& fv1, const std::vector<TDescriptor>& features1, const TFeatureVector& fv2,
+               const std::vector<TDescriptor>& features2, std::vector<FeatureMatch>& matches);
+
+    /**
+     * Same as above, but the features of the first image are split into parts with about
+     * the same number of comparisons, matched in parallel. Worth it from a few thousand
+     * features per image.
+     * @param pool threads to use
+     */
+    template <class TFeatureVector>
+    void match(const TFeatureVector& fv1, const std::vector<TDescriptor>& features1, const TFeatureVector& fv2,
+               const std::vector<TDescriptor>& features2, std::vector<FeatureMatch>& matches, ThreadPool& pool);
+
+    /**
+     * Same as above with a temporary pool
+     * @param threads number of threads
+     */
+    template <class TFeatureVector>
+    void match(const TFeatureVector& fv1, const std::vector<TDescriptor>& features1, const TFeatureVector& fv2,
+               const std::vector<TDescriptor>& features2, std::vector<FeatureMatch>& matches, int threads);
+
+   private:
+    /// Features of a node in both images
+    struct SharedNode
+    {
+        const unsigned int* features1;
+        const unsigned int* features2;
+        unsigned int n1;
+        unsigned int n2;
+        /// Position of the first feature in m_candidates and in m_descriptors
+        unsigned int first1;
+        unsigned int first2;
+    };
+
+    /// Features [begin, end) of a shared node in the first image
+    struct Part
+    {
+        unsigned int node;
+        unsigned int begin;
+        unsigned int end;
+    };
+
+    /**
+     * Fills m_shared with the nodes of both feature vectors
+     */
+    void findSharedNodes(const FeatureVector& fv1, const FeatureVector& fv2);
+    void findSharedNodes(const FlatFeatureVector& fv1, const FlatFeatureVector& fv2);
+
+    /**
+     * Gathers the descriptors of the shared nodes and splits them into parts
+     * @param max_comparisons largest number of comparisons of a part, 0 for one part per node
+     */
+    void prepare(const std::vector<TDescriptor>& features2, size_t max_comparisons);
+
+    /**
+     * Finds the candidate match of every feature of a part
+     */
+    void matchPart(const Part& part, const std::vector<TDescriptor>& features1);
+
+    /**
+     * Keeps the closest candidate of every feature of the second image
+     */
+    void collectMatches(std::vector<FeatureMatch>& matches);
+
+    int m_max_distance;
+    double m_ratio;
+
+    std::vector<SharedNode> m_shared;
+    std::vector<Part> m_parts;
+    /// Descriptors of the shared nodes in the second image
+    std::vector<TDescriptor> m_descriptors;
+    /// Candidate match of every feature of the shared nodes in the first image, with the
+    /// position in m_descriptors as index2
+    std::vector<FeatureMatch> m_candidates;
+    /// Best candidate of every position of m_descriptors
+    std::vector<FeatureMatch> m_best;
+};
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+template <class TFeatureVector>
+void TemplatedMatcher<TDescriptor, F>::match(const TFeatureVector& fv1, const std::vector<TDescriptor>& features1,
+                                             const TFeatureVector& fv2, const std::vector<TDescriptor>& features2,
+                                             std::vector<FeatureMatch>& matches)
+{
+    findSharedNodes(fv1, fv2);
+    prepare(features2, 0);
+    for (size_t i = 0; i < m_parts.size(); ++i) matchPart(m_parts[i], features1);
+    collectMatches(matches);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+template <class TFeatureVector>
+void TemplatedMatcher<TDescriptor, F>::match(const TFeatureVector& fv1, const std::vector<TDescriptor>& features1,
+                                             const TFeatureVector& fv2, const std::vector<TDescriptor>& features2,
+                                             std::vector<FeatureMatch>& matches, ThreadPool& pool)
+{
+    findSharedNodes(fv1, fv2);
+
+    // a few parts per thread, so that the pool can balance them
+    size_t comparisons = 0;
+    for (size_t i = 0; i < m_shared.size(); ++i) comparisons += (size_t)m_shared[i].n1 * m_shared[i].n2;
+    prepare(features2, std::max<size_t>(comparisons / (8 * pool.size()), 1));
+
+    pool.parallelFor(m_parts.size(), [&](size_t i, int) { matchPart(m_parts[i], features1); });
+    collectMatches(matches);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+template <class TFeatureVector>
+void TemplatedMatcher<TDescriptor, F>::match(const TFeatureVector& fv1, const std::vector<TDescriptor>& features1,
+                                             const TFeatureVector& fv2, const std::vector<TDescriptor>& features2,
+                                             std::vector<FeatureMatch>& matches, int threads)
+{
+    ThreadPool pool(threads);
+    match(fv1, features1, fv2, features2, matches, pool);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::findSharedNodes(const FeatureVector& fv1, const FeatureVector& fv2)
+{
+    m_shared.clear();
+
+    FeatureVector::const_iterator it1 = fv1.begin();
+    FeatureVector::const_iterator it2 = fv2.begin();
+    while (it1 != fv1.end() && it2 != fv2.end())
+    {
+        if (it1->first < it2->first)
+        {
+            it1 = fv1.lower_bound(it2->first);
+        }
+        else if (it2->first < it1->first)
+        {
+            it2 = fv2.lower_bound(it1->first);
+        }
+        else
+        {
+            if (!it1->second.empty() && !it2->second.empty())
+            {
+                SharedNode node;
+                node.features1 = it1->second.data();
+                node.features2 = it2->second.data();
+                node.n1        = (unsigned int)it1->second.size();
+                node.n2        = (unsigned int)it2->second.size();
+                m_shared.push_back(node);
+            }
+            ++it1;
+            ++it2;
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::findSharedNodes(const FlatFeatureVector& fv1, const FlatFeatureVector& fv2)
+{
+    m_shared.clear();
+
+    const NodeId* nodes1 = fv1.nodes();
+    const NodeId* nodes2 = fv2.nodes();
+    size_t i1 = 0, i2 = 0;
+    while (i1 < fv1.size() && i2 < fv2.size())
+    {
+        if (nodes1[i1] < nodes2[i2])
+        {
+            i1 = std::lower_bound(nodes1 + i1, nodes1 + fv1.size(), nodes2[i2]) - nodes1;
+        }
+        else if (nodes2[i2] < nodes1[i1])
+        {
+            i2 = std::lower_bound(nodes2 + i2, nodes2 + fv2.size(), nodes1[i1]) - nodes2;
+        }
+        else
+        {
+            const FlatFeatureVector::Features f1 = fv1.features(i1);
+            const FlatFeatureVector::Features f2 = fv2.features(i2);
+            if (!f1.empty() && !f2.empty())
+            {
+                SharedNode node;
+                node.features1 = f1.first;
+                node.features2 = f2.first;
+                node.n1        = (unsigned int)f1.size();
+                node.n2        = (unsigned int)f2.size();
+                m_shared.push_back(node);
+            }
+            ++i1;
+            ++i2;
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::prepare(const std::vector<TDescriptor>& features2, size_t max_comparisons)
+{
+    m_parts.clear();
+    m_descriptors.clear();
+    unsigned int n1 = 0;
+    for (size_t i = 0; i < m_shared.size(); ++i)
+    {
+        SharedNode& node = m_shared[i];
+        node.first1      = n1;
+        node.first2      = (unsigned int)m_descriptors.size();
+        n1 += node.n1;
+        for (unsigned int j = 0; j < node.n2; ++j) m_descriptors.push_back(features2[node.features2[j]]);
+
+        // features of the first image per part
+        const unsigned int step =
+            max_comparisons == 0 ? node.n1
+                                 : (unsigned int)std::max<size_t>(max_comparisons / node.n2, 1);
+        for (unsigned int begin = 0; begin < node.n1; begin += step)
+        {
+            const Part part = {(unsigned int)i, begin, std::min(begin + step, node.n1)};
+            m_parts.push_back(part);
+        }
+    }
+    m_candidates.resize(n1);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::matchPart(const Part& part, const std::vector<TDescriptor>& features1)
+{
+    const SharedNode& node = m_shared[part.node];
+    const TDescriptor* b   = m_descriptors.data() + node.first2;
+    for (unsigned int i = part.begin; i < part.end; ++i)
+    {
+        FeatureMatch& candidate = m_candidates[node.first1 + i];
+        candidate.index1        = node.features1[i];
+
+        int best, second;
+        const int j = F::nearestTwo(features1[candidate.index1], b, (int)node.n2, best, second);
+        if (best <= m_max_distance && best < m_ratio * second)
+        {
+            candidate.index2   = node.first2 + j;
+            candidate.distance = best;
+        }
+        else
+        {
+            candidate.distance = std::numeric_limits<int>::max();
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::collectMatches(std::vector<FeatureMatch>& matches)
+{
+    const FeatureMatch none = {0, 0, std::numeric_limits<int>::max()};
+    m_best.assign(m_descriptors.size(), none);
+
+    for (size_t i = 0; i < m_candidates.size(); ++i)
+    {
+        const FeatureMatch& candidate = m_candidates[i];
+        if (candidate.distance == none.distance) continue;
+
+        FeatureMatch& best = m_best[candidate.index2];
+        if (candidate.distance < best.distance ||
+            (candidate.distance == best.distance && candidate.index1 < best.index1))
+        {
+            best = candidate;
+        }
+    }
+
+    matches.clear();
+    for (size_t i = 0; i < m_shared.size(); ++i)
+    {
+        const SharedNode& node = m_shared[i];
+        for (unsigned int j = 0; j < node.n2; ++j)
+        {
+            FeatureMatch best = m_best[node.first2 + j];
+            if (best.distance == none.distance) continue;
+            best.index2 = node.features2[j];
+            matches.push_back(best);
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+/// Single result of a database query
+struct Result
+{
+    /// Entry id
+    EntryId Id;
+    /// Score obtained
+    double Score;
+
+    Result() : Id(0), Score(0) {}
+    Result(EntryId id, double score) : Id(id), Score(score) {}
+
+    /// Orders results by descending score, ties by ascending id
+    static bool better(const Result& a, const Result& b)
+    {
+        return a.Score > b.Score || (a.Score == b.Score && a.Id < b.Id);
+    }
+};
+
+/// Results of a database query, best first
+class QueryResults : public std::vector<Result>
+{
+};
+
+/// Item of an inverted list
+struct IFPair
+{
+    EntryId entry_id;
+    WordValue word_weight;
+};
+
+/**
+ * Append-only list of postings that can be read while one thread appends to it.
+ * The postings are stored in chunks of growing size which never move, and the
+ * length of the list is published atomically after the posting is written, so a
+ * reader always sees a complete prefix of the list without locking. The writer can
+ * also compact the list, which publishes a new chain of chunks and its length together.
+ */
+class InvertedList
+{
+   public:
+    /// Format of the list in database snapshots
+    static const int id = 0;
+
+    InvertedList() : m_root(&m_first_root), m_tail(NULL), m_attached(false), m_max_weight(0) {}
+    ~InvertedList() { clear(); }
+
+    InvertedList(const InvertedList&) = delete;
+    InvertedList& operator=(const InvertedList&) = delete;
 
     /**
-     * Returns the ids of all the words that are under the given node id,
-     * by traversing any of the branches that goes down from the node
-     * @param nid starting node id
-     * @param words ids of words
+     * Number of postings published so far
      */
-    void getWordsFromNode(NodeId nid, std::vector<WordId>& words) const;
+    size_t size() const { return m_root.load(std::memory_order_acquire)->size.load(std::memory_order_acquire); }
 
     /**
-     * Returns the branching factor of the tree (k)
-     * @return k
+     * Largest absolute weight of the postings, at least of those counted by a previous size()
      */
-    inline int getBranchingFactor() const { return m_k; }
+    WordValue maxWeight() const { return m_max_weight.load(std::memory_order_relaxed); }
 
     /**
-     * Returns the depth levels of the tree (L)
-     * @return L
+     * Bytes of the chunks of the list, including the room for postings not appended yet
      */
-    inline int getDepthLevels() const { return m_L; }
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (const Chunk* chunk = m_root.load(std::memory_order_acquire)->head.load(std::memory_order_acquire);
+             chunk != NULL; chunk = chunk->next.load(std::memory_order_acquire))
+            total += sizeof(Chunk) + chunk->capacity * sizeof(IFPair);
+        return total;
+    }
 
     /**
-     * Returns the real depth levels of the tree on average
-     * @return average of depth levels of leaves
+     * Appends a posting. Only one thread may append at a time.
      */
-    float getEffectiveLevels() const;
+    void push_back(const IFPair& pair)
+    {
+        if (std::abs(pair.word_weight) > m_max_weight.load(std::memory_order_relaxed))
+            m_max_weight.store(std::abs(pair.word_weight), std::memory_order_relaxed);
+        append(*m_root.load(std::memory_order_relaxed), m_tail, pair);
+    }
 
     /**
-     * Returns the descriptor of a word
-     * @param wid word id
-     * @return descriptor
+     * Calls f(const IFPair* items, size_t count) on consecutive runs of the first n postings,
+     * until f returns false. n must not be larger than a previous size(). If the list was
+     * compacted since, the runs come from the compacted list, which keeps the order of the
+     * postings, and at most its size.
      */
-    virtual inline TDescriptor getWord(WordId wid) const;
+    template <class Fn>
+    void forEachRun(size_t n, Fn&& f) const
+    {
+        const Root* root   = m_root.load(std::memory_order_acquire);
+        const Chunk* chunk = root->head.load(std::memory_order_acquire);
+        n                  = std::min<size_t>(n, root->size.load(std::memory_order_acquire));
+        while (n > 0)
+        {
+            const size_t count = std::min<size_t>(n, chunk->capacity);
+            if (!f(chunk->items(), count)) return;
+            n -= count;
+            chunk = chunk->next.load(std::memory_order_acquire);
+        }
+    }
 
     /**
-     * Returns the weight of a word
-     * @param wid word id
-     * @return weight
+     * Calls f(const IFPair& pair) on the first n postings in order, until f returns false,
+     * like forEachRun
      */
-    virtual inline WordValue getWordWeight(WordId wid) const;
+    template <class Fn>
+    void forEach(size_t n, Fn&& f) const
+    {
+        forEachRun(n, [&f](const IFPair* pairs, size_t count) {
+            for (size_t i = 0; i < count; ++i)
+                if (!f(pairs[i])) return false;
+            return true;
+        });
+    }
 
     /**
-     * Returns the weighting method
-     * @return weighting method
+     * Keeps only the postings for which keep(const IFPair&) is true, copying them to new
+     * chunks. Concurrent readers may still be reading the old chunks, so they are not
+     * freed here: the returned function frees them, once no reader that started before
+     * compact is left. Only the thread appending may call it.
      */
-    inline WeightingType getWeightingType() const { return m_weighting; }
+    template <class Pred>
+    std::function<void()> compact(Pred keep)
+    {
+        Root* old   = m_root.load(std::memory_order_relaxed);
+        Root* root  = new Root;
+        Chunk* tail = NULL;
+        try
+        {
+            forEachRun(old->size.load(std::memory_order_relaxed), [&](const IFPair* pairs, size_t count) {
+                for (size_t i = 0; i < count; ++i)
+                    if (keep(pairs[i])) append(*root, tail, pairs[i]);
+                return true;
+            });
+        }
+        catch (...)
+        {
+            freeChunks(root->head.load(std::memory_order_relaxed));
+            delete root;
+            throw;
+        }
 
+        m_root.store(root, std::memory_order_release);
+        m_tail = tail;
+
+        Chunk* head = old->head.load(std::memory_order_relaxed);
+        if (m_attached && head != NULL) head = head->next.load(std::memory_order_relaxed);
+        m_attached = false;
+        if (old == &m_first_root) old = NULL;
+        return [head, old]() {
+            freeChunks(head);
+            delete old;
+        };
+    }
 
     /**
-     * Changes the weighting method
-     * @param type new weighting type
+     * Removes all the postings. There must not be any concurrent reader.
      */
-    inline void setWeightingType(WeightingType type);
+    void clear()
+    {
+        Root* root  = m_root.load(std::memory_order_relaxed);
+        Chunk* head = root->head.load(std::memory_order_relaxed);
+        if (m_attached && head != NULL) head = head->next.load(std::memory_order_relaxed);
+        freeChunks(head);
+        if (root != &m_first_root) delete root;
+
+        m_root.store(&m_first_root, std::memory_order_relaxed);
+        m_first_root.head.store(NULL, std::memory_order_relaxed);
+        m_first_root.size.store(0, std::memory_order_relaxed);
+        m_tail     = NULL;
+        m_attached = false;
+        m_max_weight.store(0, std::memory_order_relaxed);
+    }
 
     /**
-     * Changes the scoring method
-     * @param type new scoring type
+     * Writes postings sorted by entry id as one chunk that attach can use in place
+     * @return bytes written
      */
+    static size_t save(std::ostream& out, const IFPair* pairs, size_t n)
+    {
+        Chunk header;
+        header.next.store(NULL, std::memory_order_relaxed);
+        header.first    = 0;
+        header.capacity = (unsigned int)n;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(pairs), n * sizeof(IFPair));
+        return sizeof(header) + n * sizeof(IFPair);
+    }
 
+    /**
+     * Returns whether the given bytes start with a chunk written by save with n postings,
+     * which attach can use. Only its size is checked, not the postings.
+     */
+    static bool validChunk(const void* chunk, size_t bytes, size_t n)
+    {
+        if (bytes < sizeof(Chunk)) return false;
+        const Chunk* c = static_cast<const Chunk*>(chunk);
+        return c->next.load(std::memory_order_relaxed) == NULL && c->first == 0 && c->capacity == n &&
+               n <= (bytes - sizeof(Chunk)) / sizeof(IFPair);
+    }
 
-
-    virtual void saveRaw(const std::string& file) const;
-    virtual void loadRaw(const std::string& file);
-
+    /**
+     * Makes an empty list use a chunk written by save, with its n postings, without copying it.
+     * The memory must stay valid until clear, and writable if postings are appended, because
+     * the next chunk is linked to it.
+     * @param max_weight largest absolute weight of the postings
+     */
+    void attach(void* chunk, size_t n, WordValue max_weight)
+    {
+        assert(size() == 0);
+        if (n == 0) return;
+        m_tail     = static_cast<Chunk*>(chunk);
+        m_attached = true;
+        m_first_root.head.store(m_tail, std::memory_order_relaxed);
+        m_first_root.size.store((unsigned int)n, std::memory_order_relaxed);
+        m_max_weight.store(max_weight, std::memory_order_relaxed);
+    }
 
     /**
-     * Stops those words whose weight is below minWeight.
-     * Words are stopped by setting their weight to 0. There are not returned
-     * later when transforming image features into vectors.
-     * Note that when using IDF or TF_IDF, the weight is the idf part, which
-     * is equivalent to -log(f), where f is the frequency of the word
-     * (f = Ni/N, Ni: number of training images where the word is present,
-     * N: number of training images).
-     * Note that the old weight is forgotten, and subsequent calls to this
-     * function with a lower minWeight have no effect.
-     * @return number of words stopped now
+     * Reads the first n postings of a list in order, skipping to given entry ids
      */
-    virtual int stopWords(double minWeight);
+    class Cursor;
 
-   protected:
-    /// Pointer to descriptor
-    typedef const TDescriptor* pDescriptor;
+   private:
+    /// Header of a chunk, followed by the postings
+    struct Chunk
+    {
+        std::atomic<Chunk*> next;
+        /// Position of the first posting of the chunk in the list
+        unsigned int first;
+        unsigned int capacity;
 
-    /// Tree node
-    struct Node
+        IFPair* items() { return reinterpret_cast<IFPair*>(this + 1); }
+        const IFPair* items() const { return reinterpret_cast<const IFPair*>(this + 1); }
+    };
+
+    /// First chunk and number of postings of the list, replaced together by compact
+    struct Root
     {
-        /// Node id
-        NodeId id;
-        /// Weight if the node is a word
-        WordValue weight;
-        /// Children
-        std::vector<NodeId> children;
-        /// Parent node (undefined in case of root)
-        NodeId parent;
-        /// Node descriptor
-        TDescriptor descriptor;
+        Root() : head(NULL), size(0) {}
 
-        /// Word id if the node is a word
-        WordId word_id;
+        std::atomic<Chunk*> head;
+        std::atomic<unsigned int> size;
+    };
 
-        /**
-         * Empty constructor
-         */
-        Node() : id(0), weight(0), parent(0), word_id(0) {}
+    /// Appends a posting to the chunks of root, the last of which is tail
+    static void append(Root& root, Chunk*& tail, const IFPair& pair)
+    {
+        const unsigned int n = root.size.load(std::memory_order_relaxed);
+        if (tail == NULL || n == tail->first + tail->capacity)
+        {
+            // first chunk of 4 postings, then doubling up to 4096
+            const unsigned int capacity = tail == NULL ? 4 : std::min(2 * tail->capacity, 4096u);
+            void* raw                   = std::malloc(sizeof(Chunk) + capacity * sizeof(IFPair));
+            if (raw == NULL) throw std::bad_alloc();
+
+            Chunk* chunk = new (raw) Chunk;
+            chunk->next.store(NULL, std::memory_order_relaxed);
+            chunk->first    = n;
+            chunk->capacity = capacity;
+
+            if (tail == NULL)
+                root.head.store(chunk, std::memory_order_release);
+            else
+                tail->next.store(chunk, std::memory_order_release);
+            tail = chunk;
+        }
 
-        /**
-         * Constructor
-         * @param _id node id
-         */
-        Node(NodeId _id) : id(_id), weight(0), parent(0), word_id(0) {}
+        tail->items()[n - tail->first] = pair;
+        root.size.store(n + 1, std::memory_order_release);
+    }
 
-        /**
-         * Returns whether the node is a leaf node
-         * @return true iff the node is a leaf
-         */
-        inline bool isLeaf() const { return children.empty(); }
-    };
+    static void freeChunks(Chunk* chunk)
+    {
+        while (chunk != NULL)
+        {
+            Chunk* next = chunk->next.load(std::memory_order_relaxed);
+            chunk->~Chunk();
+            std::free(chunk);
+            chunk = next;
+        }
+    }
 
-   protected:
-    /**
-     * Returns a set of pointers to descriptores
-     * @param training_features all the features
-     * @param features (out) pointers to the training features
-     */
-    void getFeatures(const std::vector<std::vector<TDescriptor>>& training_features,
-                     std::vector<pDescriptor>& features) const;
+    std::atomic<Root*> m_root;
+    /// Root until the list is compacted
+    Root m_first_root;
+    Chunk* m_tail;
+    /// Whether the first chunk belongs to someone else
+    bool m_attached;
+    std::atomic<WordValue> m_max_weight;
+};
+
+class InvertedList::Cursor
+{
+   public:
+    Cursor(const InvertedList& list, size_t n) : m_chunk(NULL), m_pos(0), m_count(0), m_left(0)
+    {
+        const Root* root  = list.m_root.load(std::memory_order_acquire);
+        const Chunk* head = root->head.load(std::memory_order_acquire);
+        m_left            = std::min<size_t>(n, root->size.load(std::memory_order_acquire));
+        if (m_left > 0) next(head);
+    }
 
     /**
-     * Returns the word id associated to a feature
-     * @param feature
-     * @param id (out) word id
-     * @param weight (out) word weight
-     * @param nid (out) if given, id of the node "levelsup" levels up
-     * @param levelsup
+     * Moves to the first posting with an id not lower than entry_id. The cursor
+     * never moves back, so entry_id must not decrease between calls.
+     * @return the posting, or NULL if there is none
      */
-    virtual void transform(const TDescriptor& feature, WordId& id, WordValue& weight, NodeId* nid = NULL,
-                           int levelsup = 0) const;
+    const IFPair* seek(EntryId entry_id)
+    {
+        while (m_chunk != NULL)
+        {
+            const IFPair* items = m_chunk->items();
+            if (items[m_count - 1].entry_id >= entry_id)
+            {
+                // galloping search from the current position
+                size_t lo = m_pos, hi = m_pos, step = 1;
+                while (items[hi].entry_id < entry_id)
+                {
+                    lo = hi + 1;
+                    hi = std::min(hi + step, m_count - 1);
+                    step *= 2;
+                }
+                m_pos = std::lower_bound(items + lo, items + hi, entry_id,
+                                         [](const IFPair& p, EntryId id) { return p.entry_id < id; }) -
+                        items;
+                return items + m_pos;
+            }
+            next(m_left > 0 ? m_chunk->next.load(std::memory_order_acquire) : NULL);
+        }
+        return NULL;
+    }
 
     /**
-     * Returns the word id associated to a feature
-     * @param feature
-     * @param id (out) word id
+     * Calls f(const IFPair* items, size_t count) on consecutive runs of the postings from the
+     * current one on, until f returns false. The cursor cannot be used afterwards.
      */
-    virtual void transform(const TDescriptor& feature, WordId& id) const;
+    template <class Fn>
+    void forEachRun(Fn&& f)
+    {
+        while (m_chunk != NULL)
+        {
+            if (!f(m_chunk->items() + m_pos, m_count - m_pos)) return;
+            next(m_left > 0 ? m_chunk->next.load(std::memory_order_acquire) : NULL);
+        }
+    }
 
     /**
-     * Creates a level in the tree, under the parent, by running kmeans with
-     * a descriptor set, and recursively creates the subsequent levels too
-     * @param parent_id id of parent node
-     * @param descriptors descriptors to run the kmeans on
-     * @param current_level current level in the tree
+     * Calls f(const IFPair& pair) on the postings from the current one on, until f returns
+     * false. The cursor cannot be used afterwards.
      */
-    void HKmeansStep(NodeId parent_id, const std::vector<pDescriptor>& descriptors, int current_level);
+    template <class Fn>
+    void forEach(Fn&& f)
+    {
+        forEachRun([&f](const IFPair* pairs, size_t count) {
+            for (size_t i = 0; i < count; ++i)
+                if (!f(pairs[i])) return false;
+            return true;
+        });
+    }
+
+   private:
+    void next(const Chunk* chunk)
+    {
+        m_chunk = chunk;
+        m_pos   = 0;
+        if (chunk == NULL) return;
+        m_count = std::min<size_t>(m_left, chunk->capacity);
+        m_left -= m_count;
+    }
+
+    const Chunk* m_chunk;
+    /// Position in the chunk, postings of the chunk to read and postings after the chunk
+    size_t m_pos, m_count, m_left;
+};
+
+/**
+ * Inverted list that stores postings in about 3 bytes instead of 16: the entry ids as
+ * varint encoded differences to the previous posting and the weights as 16 bit floating
+ * point numbers, with 6 exponent and 10 mantissa bits (relative error below 2^-11, for
+ * weights between 2^-63 and 2). Postings are encoded as they are appended, so no
+ * per-list scale is needed, and queries decode them right into their scores with forEach,
+ * which is about as fast as reading the postings of InvertedList.
+ * An L1 score changes by at most the errors of the stored weights, so with bow vectors
+ * normalized to L1 norm 1, query scores differ from L1Scoring::score by about 2^-11 (5e-4)
+ * at most.
+ * Like InvertedList, it can be read while one thread appends to it or compacts it.
+ */
+class CompressedInvertedList
+{
+   public:
+    /// Format of the list in database snapshots
+    static const int id = 1;
+
+    CompressedInvertedList() : m_root(&m_first_root), m_attached(false), m_max_weight(0) {}
+    ~CompressedInvertedList() { clear(); }
+
+    CompressedInvertedList(const CompressedInvertedList&) = delete;
+    CompressedInvertedList& operator=(const CompressedInvertedList&) = delete;
 
     /**
-     * Creates k clusters from the given descriptors with some seeding algorithm.
-     * @note In this class, kmeans++ is used, but this function should be
-     *   overriden by inherited classes.
+     * Number of postings published so far
      */
-    virtual void initiateClusters(const std::vector<pDescriptor>& descriptors,
-                                  std::vector<TDescriptor>& clusters) const;
+    size_t size() const { return m_root.load(std::memory_order_acquire)->size.load(std::memory_order_acquire); }
 
     /**
-     * Creates k clusters from the given descriptor sets by running the
-     * initial step of kmeans++
-     * @param descriptors
-     * @param clusters resulting clusters
+     * Largest absolute stored weight of the postings, at least of those counted by a previous size()
      */
-    void initiateClustersKMpp(const std::vector<pDescriptor>& descriptors, std::vector<TDescriptor>& clusters) const;
+    WordValue maxWeight() const { return m_max_weight.load(std::memory_order_relaxed); }
 
     /**
-     * Create the words of the vocabulary once the tree has been built
+     * Bytes of the chunks of the list, including the room for postings not appended yet
      */
-    void createWords();
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (const Chunk* chunk = m_root.load(std::memory_order_acquire)->head.load(std::memory_order_acquire);
+             chunk != NULL; chunk = chunk->next.load(std::memory_order_acquire))
+            total += sizeof(Chunk) + chunk->capacity;
+        return total;
+    }
 
     /**
-     * Sets the weights of the nodes of tree according to the given features.
-     * Before calling this function, the nodes and the words must be already
-     * created (by calling HKmeansStep and createWords)
-     * @param features
+     * Appends a posting, its entry id must be larger than the previous one.
+     * Only one thread may append at a time.
      */
-    void setNodeWeights(const std::vector<std::vector<TDescriptor>>& features);
+    void push_back(const IFPair& pair)
+    {
+        const uint16_t weight = encodeWeight(pair.word_weight);
+        if (decodeWeight(weight) > m_max_weight.load(std::memory_order_relaxed))
+            m_max_weight.store(decodeWeight(weight), std::memory_order_relaxed);
+        append(*m_root.load(std::memory_order_relaxed), m_tail, pair.entry_id, weight);
+    }
 
     /**
-     * Returns a random number in the range [min..max]
-     * @param min
-     * @param max
-     * @return random T number in [min..max]
+     * Decodes the first n postings and calls f(const IFPair& pair) on each of them, until f
+     * returns false. n must not be larger than a previous size(). If the list was compacted
+     * since, the postings come from the compacted list, which keeps their order, and at most
+     * its size.
      */
-    template <class T>
-    static T RandomValue(T min, T max)
+    template <class Fn>
+    void forEach(size_t n, Fn&& f) const
     {
-        return ((T)rand() / (T)RAND_MAX) * (max - min) + min;
+        const Root* root = m_root.load(std::memory_order_acquire);
+        n                = std::min<size_t>(n, root->size.load(std::memory_order_acquire));
+        if (n == 0) return;
+
+        const Chunk* chunk       = root->head.load(std::memory_order_acquire);
+        const unsigned char* in  = chunk->data();
+        const unsigned char* end = in + chunk->capacity - MAX_POSTING_BYTES;
+        EntryId last_id          = 0;
+        for (; n > 0; --n)
+        {
+            if (in > end)
+            {
+                chunk   = chunk->next.load(std::memory_order_acquire);
+                in      = chunk->data();
+                end     = in + chunk->capacity - MAX_POSTING_BYTES;
+                last_id = 0;
+            }
+
+            IFPair pair;
+            in = decode(in, last_id, pair);
+            if (!f((const IFPair&)pair)) return;
+        }
     }
 
     /**
-     * Returns a random int in the range [min..max]
-     * @param min
-     * @param max
-     * @return random int in [min..max]
+     * Decodes the first n postings and calls f(const IFPair* items, size_t count) on runs
+     * of them, until f returns false, like forEach. Loops that do little per posting should
+     * use forEach, which does not copy the postings to a buffer.
      */
-    static int RandomInt(int min, int max)
+    template <class Fn>
+    void forEachRun(size_t n, Fn&& f) const
     {
-        int d = max - min + 1;
-        return int(((double)rand() / ((double)RAND_MAX + 1.0)) * d) + min;
+        RunBuffer<Fn> run(f);
+        forEach(n, run);
+        run.flush();
     }
 
-   protected:
-    /// Branching factor
-    int m_k;
-
-    /// Depth levels
-    int m_L;
-
-    /// Weighting method
-    WeightingType m_weighting;
-
-
-
-    /// Tree nodes
-    std::vector<Node> m_nodes;
-
-    /// Words of the vocabulary (tree leaves)
-    /// this condition holds: m_words[wid]->word_id == wid
-    std::vector<Node*> m_words;
-};
-
-// --------------------------------------------------------------------------
-
-template <class TDescriptor, class F, class Scoring>
-TemplatedVocabulary<TDescriptor, F, Scoring>::TemplatedVocabulary(int k, int L, WeightingType weighting)
-    : m_k(k), m_L(L), m_weighting(weighting)
-{
-}
-
-// --------------------------------------------------------------------------
-
-template <class TDescriptor, class F, class Scoring>
-TemplatedVocabulary<TDescriptor, F, Scoring>::TemplatedVocabulary(const std::string& filename)
-{
-    loadRaw(filename);
-}
-
+    /**
+     * Keeps only the postings for which keep(const IFPair&) is true, encoding them in new
+     * chunks. Concurrent readers may still be reading the old chunks, so they are not
+     * freed here: the returned function frees them, once no reader that started before
+     * compact is left. Only the thread appending may call it.
+     */
+    template <class Pred>
+    std::function<void()> compact(Pred keep)
+    {
+        Root* old  = m_root.load(std::memory_order_relaxed);
+        Root* root = new Root;
+        Tail tail;
+        try
+        {
+            forEachRun(old->size.load(std::memory_order_relaxed), [&](const IFPair* pairs, size_t count) {
+                for (size_t i = 0; i < count; ++i)
+                    if (keep(pairs[i])) append(*root, tail, pairs[i].entry_id, encodeWeight(pairs[i].word_weight));
+                return true;
+            });
+        }
+        catch (...)
+        {
+            freeChunks(root->head.load(std::memory_order_relaxed));
+            delete root;
+            throw;
+        }
 
-// --------------------------------------------------------------------------
+        m_root.store(root, std::memory_order_release);
+        m_tail = tail;
+
+        Chunk* head = old->head.load(std::memory_order_relaxed);
+        if (m_attached && head != NULL) head = head->next.load(std::memory_order_relaxed);
+        m_attached = false;
+        if (old == &m_first_root) old = NULL;
+        return [head, old]() {
+            freeChunks(head);
+            delete old;
+        };
+    }
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::setWeightingType(WeightingType type)
-{
-    this->m_weighting = type;
-}
+    /**
+     * Removes all the postings. There must not be any concurrent reader.
+     */
+    void clear()
+    {
+        Root* root  = m_root.load(std::memory_order_relaxed);
+        Chunk* head = root->head.load(std::memory_order_relaxed);
+        if (m_attached && head != NULL) head = head->next.load(std::memory_order_relaxed);
+        freeChunks(head);
+        if (root != &m_first_root) delete root;
+
+        m_root.store(&m_first_root, std::memory_order_relaxed);
+        m_first_root.head.store(NULL, std::memory_order_relaxed);
+        m_first_root.size.store(0, std::memory_order_relaxed);
+        m_tail     = Tail();
+        m_attached = false;
+        m_max_weight.store(0, std::memory_order_relaxed);
+    }
 
-// --------------------------------------------------------------------------
+    /**
+     * Writes postings sorted by entry id as one chunk that attach can use in place
+     * @return bytes written
+     */
+    static size_t save(std::ostream& out, const IFPair* pairs, size_t n)
+    {
+        std::vector<unsigned char> data(n * MAX_POSTING_BYTES + MAX_POSTING_BYTES);
+        unsigned char* end = data.data();
+        EntryId last_id    = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            end     = encode(end, pairs[i].entry_id - last_id, encodeWeight(pairs[i].word_weight));
+            last_id = pairs[i].entry_id;
+        }
 
-template <class TDescriptor, class F, class Scoring>
-TemplatedVocabulary<TDescriptor, F, Scoring>::~TemplatedVocabulary()
-{
-}
+        // the chunk is full for push_back, which starts a new one
+        Chunk header;
+        header.next.store(NULL, std::memory_order_relaxed);
+        header.first    = 0;
+        header.capacity = (unsigned int)(end - data.data()) + MAX_POSTING_BYTES - 1;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(data.data()), header.capacity);
+        return sizeof(header) + header.capacity;
+    }
 
-// --------------------------------------------------------------------------
+    /**
+     * Returns whether the given bytes start with a chunk written by save with n postings,
+     * which attach can use. Only its size is checked, not the postings: it must fit in the
+     * bytes and hold n postings of 3 to 7 bytes.
+     */
+    static bool validChunk(const void* chunk, size_t bytes, size_t n)
+    {
+        if (bytes < sizeof(Chunk)) return false;
+        const Chunk* c        = static_cast<const Chunk*>(chunk);
+        const size_t capacity = c->capacity;
+        return c->next.load(std::memory_order_relaxed) == NULL && c->first == 0 &&
+               capacity <= bytes - sizeof(Chunk) && capacity >= 3 * n + MAX_POSTING_BYTES - 1 &&
+               capacity <= (n + 1) * MAX_POSTING_BYTES - 1;
+    }
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
-    const std::vector<std::vector<TDescriptor>>& training_features)
-{
-    m_nodes.clear();
-    m_words.clear();
+    /**
+     * Makes an empty list use a chunk written by save, with its n postings, without copying it.
+     * The memory must stay valid until clear, and writable if postings are appended, because
+     * the next chunk is linked to it.
+     * @param max_weight largest absolute stored weight of the postings
+     */
+    void attach(void* chunk, size_t n, WordValue max_weight)
+    {
+        assert(size() == 0);
+        if (n == 0) return;
+        m_tail.chunk = static_cast<Chunk*>(chunk);
+        m_tail.used  = m_tail.chunk->capacity - MAX_POSTING_BYTES + 1;
+        m_attached   = true;
+        m_first_root.head.store(m_tail.chunk, std::memory_order_relaxed);
+        m_first_root.size.store((unsigned int)n, std::memory_order_relaxed);
+        m_max_weight.store(max_weight, std::memory_order_relaxed);
+    }
 
-    // expected_nodes = Sum_{i=0..L} ( k^i )
-    int expected_nodes = (int)((std::pow((double)m_k, (double)m_L + 1) - 1) / (m_k - 1));
+    /**
+     * Decodes the first n postings of a list in order, skipping to given entry ids
+     */
+    class Cursor;
 
-    m_nodes.reserve(expected_nodes);  // avoid allocations when creating the tree
+    /**
+     * Weight as stored in the list
+     */
+    static WordValue quantize(WordValue weight) { return decodeWeight(encodeWeight(weight)); }
 
+   private:
+    /// 5 bytes of id and 2 of weight
+    static const unsigned int MAX_POSTING_BYTES = 7;
 
-    std::vector<pDescriptor> features;
-    getFeatures(training_features, features);
+    /// Collects the postings passed to it in runs of 128 and calls f on them, for forEachRun
+    template <class Fn>
+    struct RunBuffer
+    {
+        explicit RunBuffer(Fn& f) : f(f), count(0), more(true) {}
 
+        bool operator()(const IFPair& pair)
+        {
+            pairs[count++] = pair;
+            if (count < RUN) return true;
+            count = 0;
+            return more = f((const IFPair*)pairs, RUN);
+        }
 
-    // create root
-    m_nodes.push_back(Node(0));  // root
+        /// Calls f on the last postings, unless it returned false before
+        void flush()
+        {
+            if (more && count > 0) f((const IFPair*)pairs, count);
+        }
 
-    // create the tree
-    HKmeansStep(0, features, 1);
+        static const size_t RUN = 128;
+        Fn& f;
+        IFPair pairs[RUN];
+        size_t count;
+        bool more;
+    };
 
-    // create the words
-    createWords();
+    /// Header of a chunk, followed by the encoded postings
+    struct Chunk
+    {
+        std::atomic<Chunk*> next;
+        /// Position of the first posting of the chunk in the list
+        unsigned int first;
+        unsigned int capacity;
 
-    // and set the weight of each node of the tree
-    setNodeWeights(training_features);
-}
+        unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+        const unsigned char* data() const { return reinterpret_cast<const unsigned char*>(this + 1); }
+    };
 
-// --------------------------------------------------------------------------
+    /// First chunk and number of postings of the list, replaced together by compact
+    struct Root
+    {
+        Root() : head(NULL), size(0) {}
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
-    const std::vector<std::vector<TDescriptor>>& training_features, int k, int L)
-{
-    m_k = k;
-    m_L = L;
+        std::atomic<Chunk*> head;
+        std::atomic<unsigned int> size;
+    };
 
-    create(training_features);
-}
+    /// Last chunk of a list, with the bytes used in it and the last id written to it
+    struct Tail
+    {
+        Tail() : chunk(NULL), used(0), last_id(0) {}
 
-// --------------------------------------------------------------------------
+        Chunk* chunk;
+        unsigned int used;
+        EntryId last_id;
+    };
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::create(
-    const std::vector<std::vector<TDescriptor>>& training_features, int k, int L, WeightingType weighting)
-{
-    m_k         = k;
-    m_L         = L;
-    m_weighting = weighting;
+    /// Appends a posting to the chunks of root
+    static void append(Root& root, Tail& tail, EntryId entry_id, uint16_t weight)
+    {
+        const unsigned int n = root.size.load(std::memory_order_relaxed);
+        if (tail.chunk == NULL || tail.chunk->capacity - tail.used < MAX_POSTING_BYTES)
+        {
+            // 64 bytes first, then doubling up to 4 KB
+            const unsigned int capacity = tail.chunk == NULL ? 64 : std::min(2 * tail.chunk->capacity, 4096u);
+            void* raw                   = std::malloc(sizeof(Chunk) + capacity);
+            if (raw == NULL) throw std::bad_alloc();
+
+            Chunk* chunk = new (raw) Chunk;
+            chunk->next.store(NULL, std::memory_order_relaxed);
+            chunk->first    = n;
+            chunk->capacity = capacity;
+
+            if (tail.chunk == NULL)
+                root.head.store(chunk, std::memory_order_release);
+            else
+                tail.chunk->next.store(chunk, std::memory_order_release);
+            tail.chunk   = chunk;
+            tail.used    = 0;
+            tail.last_id = 0;  // the first id of a chunk is stored as it is
+        }
 
+        unsigned char* data = tail.chunk->data();
+        tail.used           = encode(data + tail.used, entry_id - tail.last_id, weight) - data;
+        tail.last_id        = entry_id;
+        root.size.store(n + 1, std::memory_order_release);
+    }
 
-    create(training_features);
-}
+    static void freeChunks(Chunk* chunk)
+    {
+        while (chunk != NULL)
+        {
+            Chunk* next = chunk->next.load(std::memory_order_relaxed);
+            chunk->~Chunk();
+            std::free(chunk);
+            chunk = next;
+        }
+    }
 
-// --------------------------------------------------------------------------
+    /// Keeps 6 bits of the float exponent and 10 of the mantissa, rounding to nearest
+    static uint16_t encodeWeight(WordValue weight)
+    {
+        const float f = (float)weight;
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        const int64_t code = ((int64_t)bits - (64 << 23) + (1 << 12)) >> 13;
+        return (uint16_t)std::max<int64_t>(0, std::min<int64_t>(code, 0xffff));
+    }
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::getFeatures(
-    const std::vector<std::vector<TDescriptor>>& training_features, std::vector<pDescriptor>& features) const
-{
-    features.resize(0);
+    static WordValue decodeWeight(uint16_t code)
+    {
+        const uint32_t bits = ((uint32_t)code << 13) + (64u << 23);
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
 
-    typename std::vector<std::vector<TDescriptor>>::const_iterator vvit;
-    typename std::vector<TDescriptor>::const_iterator vit;
-    for (vvit = training_features.begin(); vvit != training_features.end(); ++vvit)
+    /// Encodes a posting at out and returns the end of it
+    static inline unsigned char* encode(unsigned char* out, uint32_t delta, uint16_t weight)
     {
-        features.reserve(features.size() + vvit->size());
-        for (vit = vvit->begin(); vit != vvit->end(); ++vit)
+        while (delta >= 0x80)
         {
-            features.push_back(&(*vit));
+            *out++ = (unsigned char)(delta | 0x80);
+            delta >>= 7;
         }
+        *out++ = (unsigned char)delta;
+        *out++ = (unsigned char)weight;
+        *out++ = (unsigned char)(weight >> 8);
+        return out;
     }
-}
 
-// --------------------------------------------------------------------------
-
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::HKmeansStep(NodeId parent_id,
-                                                               const std::vector<pDescriptor>& descriptors,
-                                                               int current_level)
-{
-    if (descriptors.empty()) return;
+    /// Decodes the posting at in, given the id of the previous posting of the chunk
+    static inline const unsigned char* decode(const unsigned char* in, EntryId& last_id, IFPair& pair)
+    {
+        uint32_t delta = *in++;
+        if (delta >= 0x80)
+        {
+            delta &= 0x7f;
+            for (int shift = 7;; shift += 7)
+            {
+                const uint32_t byte = *in++;
+                delta |= (byte & 0x7f) << shift;
+                if (byte < 0x80) break;
+            }
+        }
 
-    // features associated to each cluster
-    std::vector<TDescriptor> clusters;
-    std::vector<std::vector<unsigned int>> groups;  // groups[i] = [j1, j2, ...]
-                                                    // j1, j2, ... indices of descriptors associated to cluster i
+        last_id += delta;
+        pair.entry_id    = last_id;
+        pair.word_weight = decodeWeight((uint16_t)(in[0] | (in[1] << 8)));
+        return in + 2;
+    }
 
-    clusters.reserve(m_k);
-    groups.reserve(m_k);
+    std::atomic<Root*> m_root;
+    /// Root until the list is compacted
+    Root m_first_root;
+    Tail m_tail;
+    /// Whether the first chunk belongs to someone else
+    bool m_attached;
+    std::atomic<WordValue> m_max_weight;
+};
 
-    // const int msizes[] = { m_k, descriptors.size() };
-    // cv::SparseMat assoc(2, msizes, CV_8U);
-    // cv::SparseMat last_assoc(2, msizes, CV_8U);
-    //// assoc.row(cluster_idx).col(descriptor_idx) = 1 iif associated
+class CompressedInvertedList::Cursor
+{
+   public:
+    Cursor(const CompressedInvertedList& list, size_t n)
+        : m_chunk(NULL), m_in(NULL), m_end(NULL), m_pos(0), m_n(0), m_last_id(0), m_pair(), m_valid(false)
+    {
+        const Root* root  = list.m_root.load(std::memory_order_acquire);
+        const Chunk* head = root->head.load(std::memory_order_acquire);
+        m_n               = std::min<size_t>(n, root->size.load(std::memory_order_acquire));
+        if (m_n > 0) start(head);
+    }
 
-    if ((int)descriptors.size() <= m_k)
+    /**
+     * Moves to the first posting with an id not lower than entry_id. The cursor
+     * never moves back, so entry_id must not decrease between calls.
+     * @return the posting, or NULL if there is none
+     */
+    const IFPair* seek(EntryId entry_id)
     {
-        // trivial case: one cluster per feature
-        groups.resize(descriptors.size());
+        if (m_chunk == NULL) return NULL;
+        if (m_valid && m_pair.entry_id >= entry_id) return &m_pair;
 
-        for (unsigned int i = 0; i < descriptors.size(); i++)
+        // skips the chunks that end before entry_id, the first id of a chunk is stored as it is
+        for (const Chunk* next = m_chunk->next.load(std::memory_order_acquire);
+             next != NULL && next->first < m_n && firstId(next) <= entry_id;
+             next = next->next.load(std::memory_order_acquire))
         {
-            groups[i].push_back(i);
+            start(next);
+        }
 
-#ifdef USE_CV_FORB
-            clusters.push_back(descriptors[i]->clone());
-#else
-            clusters.push_back(*descriptors[i]);
-#endif
+        while (m_pos < m_n)
+        {
+            if (m_in > m_end) start(m_chunk->next.load(std::memory_order_acquire));
+            m_in    = decode(m_in, m_last_id, m_pair);
+            m_valid = true;
+            ++m_pos;
+            if (m_pair.entry_id >= entry_id) return &m_pair;
         }
+
+        m_chunk = NULL;
+        return NULL;
     }
-    else
-    {
-        // select clusters and groups with kmeans
 
-        bool first_time = true;
-        bool goon       = true;
+    /**
+     * Calls f(const IFPair& pair) on the postings from the current one on, until f returns
+     * false. The cursor cannot be used afterwards.
+     */
+    template <class Fn>
+    void forEach(Fn&& f)
+    {
+        if (m_chunk == NULL) return;
 
-        // to check if clusters move after iterations
-        std::vector<int> last_association, current_association;
+        // the current posting was decoded already
+        if (m_valid && !f((const IFPair&)m_pair)) return;
 
-        while (goon)
+        const unsigned char* in  = m_in;
+        const unsigned char* end = m_end;
+        EntryId last_id          = m_last_id;
+        for (size_t left = m_n - m_pos; left > 0; --left)
         {
-            // 1. Calculate clusters
-
-            if (first_time)
+            if (in > end)
             {
-                // random sample
-                initiateClusters(descriptors, clusters);
+                m_chunk = m_chunk->next.load(std::memory_order_acquire);
+                in      = m_chunk->data();
+                end     = in + m_chunk->capacity - MAX_POSTING_BYTES;
+                last_id = 0;
             }
-            else
-            {
-                // calculate cluster centres
 
-                for (unsigned int c = 0; c < clusters.size(); ++c)
-                {
-                    std::vector<pDescriptor> cluster_descriptors;
-                    cluster_descriptors.reserve(groups[c].size());
-
-                    /*
-                    for(unsigned int d = 0; d < descriptors.size(); ++d)
-                    {
-                      if( assoc.find<unsigned char>(c, d) )
-                      {
-                        cluster_descriptors.push_back(descriptors[d]);
-                      }
-                    }
-                    */
-
-                    std::vector<unsigned int>::const_iterator vit;
-                    for (vit = groups[c].begin(); vit != groups[c].end(); ++vit)
-                    {
-                        cluster_descriptors.push_back(descriptors[*vit]);
-                    }
+            IFPair pair;
+            in = decode(in, last_id, pair);
+            if (!f((const IFPair&)pair)) return;
+        }
+    }
 
+    /**
+     * Calls f(const IFPair* items, size_t count) on runs of the postings from the current one
+     * on, until f returns false, like forEach. The cursor cannot be used afterwards.
+     */
+    template <class Fn>
+    void forEachRun(Fn&& f)
+    {
+        RunBuffer<Fn> run(f);
+        forEach(run);
+        run.flush();
+    }
 
-                    F::meanValue(cluster_descriptors, clusters[c]);
-                }
+   private:
+    void start(const Chunk* chunk)
+    {
+        m_chunk   = chunk;
+        m_in      = chunk->data();
+        m_end     = m_in + chunk->capacity - MAX_POSTING_BYTES;
+        m_pos     = chunk->first;
+        m_last_id = 0;
+        m_valid   = false;
+    }
 
-            }  // if(!first_time)
+    static EntryId firstId(const Chunk* chunk)
+    {
+        EntryId id = 0;
+        IFPair pair;
+        decode(chunk->data(), id, pair);
+        return id;
+    }
 
-            // 2. Associate features with clusters
+    const Chunk* m_chunk;
+    const unsigned char* m_in;
+    const unsigned char* m_end;
+    /// Position in the list of the next posting to decode, and postings to read
+    size_t m_pos, m_n;
+    EntryId m_last_id;
+    /// Last decoded posting, if it is in the current chunk
+    IFPair m_pair;
+    bool m_valid;
+};
 
-            // calculate distances to cluster centers
-            groups.clear();
-            groups.resize(clusters.size(), std::vector<unsigned int>());
-            current_association.resize(descriptors.size());
+/**
+ * Image database with an inverted file: for every word, the entries that contain it and
+ * the weight of the word in each of them. Queries only visit the entries that share words
+ * with the query, and the scores are the same values as L1Scoring::score.
+ *
+ * Queries may run in any number of threads while one thread adds entries. They never
+ * block and see all the entries added before the query started, plus possibly some of
+ * the ones added meanwhile, each of them complete. clear() must not run concurrently
+ * with anything else.
+ *
+ * TInvertedList is InvertedList, or CompressedInvertedList to store the postings in about
+ * a fifth of the memory, with slightly rounded weights and therefore scores.
+ *
+ * A database with several shards splits every query into ranges of entry ids of about the
+ * same size, which are scored in parallel and merged, with the same results as one shard.
+ * The lists are sorted by entry id, so every range is a contiguous part of them and the
+ * postings are stored only once.
+ *
+ * With a direct index, the database also keeps the bow vector of every entry, and its
+ * feature vector if it is given.
+ *
+ * Entries of a database with a direct index can be erased, in amortized time proportional
+ * to their number of words: the entry is marked as erased and queries skip its postings,
+ * and a list is compacted once an eighth of its postings belong to erased entries, so
+ * queries do not slow down as entries are erased. With a maximum number of entries, the
+ * oldest ones are erased as new ones are added. Queries running while an entry is erased
+ * may or may not return it. Lists and records that queries may still be reading are only
+ * freed by a later add or erase, once every query that started before they were removed
+ * has finished.
+ *
+ * save writes a snapshot that load maps into memory and uses in place: the lists are stored
+ * as chunks in the format of TInvertedList, and the vectors of the entries in the same
+ * records as the direct index, so loading does not read the postings or the vectors.
+ */
+template <class TDescriptor, class F, class Scoring, class TInvertedList = InvertedList>
+class TemplatedDatabase
+{
+   public:
+    typedef TemplatedVocabulary<TDescriptor, F, Scoring> Vocabulary;
 
-            // assoc.clear();
+    /**
+     * Creates an empty database
+     * @param voc vocabulary, it must outlive the database
+     * @param shards number of ranges of entries every query is split into, and of threads
+     *   scoring them, including the one calling query
+     * @param direct_index whether to keep the vectors of the entries
+     */
+    explicit TemplatedDatabase(const Vocabulary& voc, int shards = 1, bool direct_index = false);
 
-            typename std::vector<pDescriptor>::const_iterator fit;
-            // unsigned int d = 0;
-            for (fit = descriptors.begin(); fit != descriptors.end(); ++fit)  //, ++d)
-            {
-                double best_dist      = F::distance(*(*fit), clusters[0]);
-                unsigned int icluster = 0;
+    ~TemplatedDatabase() { clear(); }
 
-                for (unsigned int c = 1; c < clusters.size(); ++c)
-                {
-                    double dist = F::distance(*(*fit), clusters[c]);
-                    if (dist < best_dist)
-                    {
-                        best_dist = dist;
-                        icluster  = c;
-                    }
-                }
+    /**
+     * Transforms the features of an image and adds them to the database
+     * @param features
+     * @return id of the new entry
+     */
+    EntryId add(const std::vector<TDescriptor>& features);
 
-                // assoc.ref<unsigned char>(icluster, d) = 1;
+    /**
+     * Adds a bow vector created with the vocabulary of the database
+     * @param v
+     * @return id of the new entry, entries are numbered from 0 on
+     */
+    EntryId add(const BowVector& v);
+    EntryId add(const FlatBowVector& v);
 
-                groups[icluster].push_back(fit - descriptors.begin());
-                current_association[fit - descriptors.begin()] = icluster;
-            }
+    /**
+     * Adds a bow vector and the feature vector of the same image, which is kept in the
+     * direct index, if the database has one
+     * @param v
+     * @param fv
+     * @return id of the new entry
+     */
+    EntryId add(const BowVector& v, const FeatureVector& fv);
+    EntryId add(const FlatBowVector& v, const FlatFeatureVector& fv);
 
-            // kmeans++ ensures all the clusters has any feature associated with them
+    /**
+     * Returns the entries with the best scores against a bow vector
+     * @param v query vector
+     * @param results (out) entries sharing words with the query, by descending score, ties by
+     *   ascending id
+     * @param max_results maximum number of results, all of them if <= 0
+     * @param max_id only entries with an id up to max_id are returned, all if < 0
+     */
+    void query(const BowVector& v, QueryResults& results, int max_results = 1, int max_id = -1) const;
+    void query(const FlatBowVector& v, QueryResults& results, int max_results = 1, int max_id = -1) const;
 
-            // 3. check convergence
-            if (first_time)
-            {
-                first_time = false;
-            }
-            else
-            {
-                // goon = !eqUChar(last_assoc, assoc);
+    /**
+     * Same as query, with exactly the same results, but skipping the postings that cannot change
+     * the best max_results entries, using an upper bound of the score every word can add. It pays
+     * off when a few entries score much higher than the rest and the lists of the frequent words
+     * are long, like loop closure queries for up to about 10 results in a large database, and it
+     * is slower than query otherwise.
+     * @param v query vector
+     * @param results (out) best entries, by descending score, ties by ascending id
+     * @param max_results maximum number of results, all of them if <= 0
+     * @param max_id only entries with an id up to max_id are returned, all if < 0
+     */
+    void queryTopK(const BowVector& v, QueryResults& results, int max_results, int max_id = -1) const;
+    void queryTopK(const FlatBowVector& v, QueryResults& results, int max_results, int max_id = -1) const;
 
-                goon = false;
-                for (unsigned int i = 0; i < current_association.size(); i++)
-                {
-                    if (current_association[i] != last_association[i])
-                    {
-                        goon = true;
-                        break;
-                    }
-                }
-            }
+    /**
+     * Returns the number of entries added, including the erased ones, which is the id of
+     * the next entry
+     */
+    unsigned int size() const { return m_num_entries.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
 
-            if (goon)
-            {
-                // copy last feature-cluster association
-                last_association = current_association;
-                // last_assoc = assoc.clone();
-            }
+    /**
+     * Returns the number of entries that are not erased
+     */
+    unsigned int liveSize() const;
 
-        }  // while(goon)
+    /**
+     * Returns the bytes of memory of the inverted lists, see TInvertedList::bytes
+     */
+    size_t invertedFileBytes() const;
 
-    }  // if must run kmeans
+    /**
+     * Erases an entry. Its id is not reused and the ids of the rest of entries do not change.
+     * The database must have a direct index, and only the thread adding entries may call it.
+     * @param entry_id id of an entry, lower than size(); nothing happens if it was erased already
+     */
+    void erase(EntryId entry_id);
 
-    // create nodes
-    for (unsigned int i = 0; i < clusters.size(); ++i)
-    {
-        NodeId id = m_nodes.size();
-        m_nodes.push_back(Node(id));
-        m_nodes.back().descriptor = clusters[i];
-        m_nodes.back().parent     = parent_id;
-        m_nodes[parent_id].children.push_back(id);
-    }
+    /**
+     * Returns whether an entry was erased
+     * @param entry_id id of an entry, lower than size()
+     */
+    bool isErased(EntryId entry_id) const;
 
-    // go on with the next level
-    if (current_level < m_L)
-    {
-        // iterate again with the resulting clusters
-        const std::vector<NodeId>& children_ids = m_nodes[parent_id].children;
-        for (unsigned int i = 0; i < clusters.size(); ++i)
-        {
-            NodeId id = children_ids[i];
+    /**
+     * Sets the maximum number of entries that are not erased, erasing the oldest ones when there
+     * are more. The database must have a direct index, and only the thread adding entries may
+     * call it.
+     * @param max_entries maximum number of entries, 0 for no limit
+     */
+    void setMaxEntries(unsigned int max_entries);
+    unsigned int getMaxEntries() const { return m_max_entries; }
 
-            std::vector<pDescriptor> child_features;
-            child_features.reserve(groups[i].size());
+    /**
+     * Removes all the entries
+     */
+    void clear();
 
-            std::vector<unsigned int>::const_iterator vit;
-            for (vit = groups[i].begin(); vit != groups[i].end(); ++vit)
-            {
-                child_features.push_back(descriptors[*vit]);
-            }
+    const Vocabulary& getVocabulary() const { return *m_voc; }
 
-            if (child_features.size() > 1)
-            {
-                HKmeansStep(id, child_features, current_level + 1);
-            }
-        }
-    }
-}
+    /**
+     * Returns the number of shards queries are split into
+     */
+    int shards() const { return m_shards; }
 
-// --------------------------------------------------------------------------
+    /**
+     * Returns whether the database keeps the vectors of the entries
+     */
+    bool hasDirectIndex() const { return m_direct_index; }
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::initiateClusters(const std::vector<pDescriptor>& descriptors,
-                                                                    std::vector<TDescriptor>& clusters) const
-{
-    initiateClustersKMpp(descriptors, clusters);
-}
+    /**
+     * Copies the bow vector of an entry, which is empty if the entry was erased. The database
+     * must have a direct index.
+     * @param entry_id id of an entry, lower than size()
+     * @param v (out)
+     */
+    void getBowVector(EntryId entry_id, FlatBowVector& v) const;
 
-// --------------------------------------------------------------------------
+    /**
+     * Copies the feature vector of an entry, which is empty if the entry was added without
+     * one or was erased. The database must have a direct index.
+     * @param entry_id id of an entry, lower than size()
+     * @param fv (out)
+     */
+    void getFeatureVector(EntryId entry_id, FlatFeatureVector& fv) const;
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::initiateClustersKMpp(const std::vector<pDescriptor>& pfeatures,
-                                                                        std::vector<TDescriptor>& clusters) const
-{
-    // Implements kmeans++ seeding algorithm
-    // Algorithm:
-    // 1. Choose one center uniformly at random from among the data points.
-    // 2. For each data point x, compute D(x), the distance between x and the nearest
-    //    center that has already been chosen.
-    // 3. Add one new data point as a center. Each point x is chosen with probability
-    //    proportional to D(x)^2.
-    // 4. Repeat Steps 2 and 3 until k centers have been chosen.
-    // 5. Now that the initial centers have been chosen, proceed using standard k-means
-    //    clustering.
+    /**
+     * Writes a snapshot of the database, with the entries added before the call. It may run
+     * while entries are added and erased, and lists are not compacted meanwhile. Erased
+     * entries are saved without their vectors.
+     * @param file
+     * @return false if the file could not be written
+     */
+    bool save(const std::string& file) const;
 
-    clusters.resize(0);
-    clusters.reserve(m_k);
-    std::vector<double> min_dists(pfeatures.size(), std::numeric_limits<double>::max());
+    /**
+     * Replaces the entries with the ones of a snapshot, which are used in place from the
+     * mapped file. More entries can be added afterwards. Like clear, it must not run
+     * concurrently with anything else. The positions and sizes of the lists and records are
+     * checked against the file, but the postings and vectors in them are not read.
+     * @param file
+     * @return false if the file is not a snapshot of a database of this type with the same
+     *   vocabulary, and with a direct index if this database has one, or if a list or record
+     *   is not aligned or not inside the file; the database is empty then
+     */
+    bool load(const std::string& file);
 
-    // 1.
+   protected:
+    /// Header of a snapshot file
+    struct SnapshotHeader
+    {
+        char magic[8];
+        uint32_t version;
+        /// Checks that the file was written on a platform with the same memory layout
+        uint32_t byte_order;
+        uint32_t pointer_bytes;
+        int32_t list_format;
+        uint64_t vocabulary_checksum;
+        uint32_t num_words;
+        uint32_t num_entries;
+        /// Entries before it are erased
+        uint32_t first_entry;
+        uint32_t reserved;
+        /// Offset of a SnapshotWord for every word
+        uint64_t words;
+        /// Offset of the offsets of the records of the entries, 0 if there are no records
+        uint64_t records;
+        /// Offset of the empty record of the erased entries, 0 if there are none
+        uint64_t erased_record;
+        uint64_t file_size;
+    };
 
-    int ifeature = RandomInt(0, pfeatures.size() - 1);
+    /// Inverted list of a word in a snapshot
+    struct SnapshotWord
+    {
+        /// Offset of the chunk written by TInvertedList::save
+        uint64_t offset;
+        uint64_t size;
+        WordValue max_weight;
+    };
 
-// create first cluster
-#ifdef USE_CV_FORB
-    clusters.push_back(pfeatures[ifeature]->clone());
-#else
-    clusters.push_back(*pfeatures[ifeature]);
-#endif
+    /// Record of an entry in the direct index and in snapshots, followed by the values and
+    /// ids of the words, and the node ids, offsets and feature indices of the feature vector
+    struct EntryRecord
+    {
+        unsigned int num_words;
+        unsigned int num_nodes;
+        unsigned int num_features;
+        unsigned int reserved;
+
+        WordValue* values() { return reinterpret_cast<WordValue*>(this + 1); }
+        WordId* words() { return reinterpret_cast<WordId*>(values() + num_words); }
+        NodeId* nodes() { return reinterpret_cast<NodeId*>(words() + num_words); }
+        unsigned int* offsets() { return nodes() + num_nodes; }
+        unsigned int* features() { return offsets() + num_nodes + 1; }
+
+        const WordValue* values() const { return reinterpret_cast<const WordValue*>(this + 1); }
+        const WordId* words() const { return reinterpret_cast<const WordId*>(values() + num_words); }
+        const NodeId* nodes() const { return reinterpret_cast<const NodeId*>(words() + num_words); }
+        const unsigned int* offsets() const { return nodes() + num_nodes; }
+        const unsigned int* features() const { return offsets() + num_nodes + 1; }
+
+        /// Size of a record, padded to keep the next one aligned
+        static size_t bytes(size_t num_words, size_t num_nodes, size_t num_features)
+        {
+            const size_t bytes = sizeof(EntryRecord) + num_words * (sizeof(WordValue) + sizeof(WordId)) +
+                                 (2 * num_nodes + 1 + num_features) * sizeof(unsigned int);
+            return (bytes + 7) & ~(size_t)7;
+        }
+        size_t bytes() const { return bytes(num_words, num_nodes, num_features); }
+    };
 
-    // compute the initial distances
-    typename std::vector<pDescriptor>::const_iterator fit;
-    std::vector<double>::iterator dit;
-    dit = min_dists.begin();
-    for (fit = pfeatures.begin(); fit != pfeatures.end(); ++fit, ++dit)
+    /// Records and erased marks of the entries from base on, which is replaced by a copy
+    /// from the oldest entry on when it is full
+    struct EntryTable
     {
-        *dit = F::distance(*(*fit), clusters.back());
-    }
+        EntryTable(EntryId base, size_t capacity)
+            : base(base), capacity(capacity), records(new EntryRecord*[capacity]()),
+              erased(new std::atomic<unsigned char>[capacity]())
+        {
+        }
+        ~EntryTable()
+        {
+            delete[] records;
+            delete[] erased;
+        }
 
-    while ((int)clusters.size() < m_k)
+        EntryId base;
+        size_t capacity;
+        /// NULL for the entries of the snapshot, and dangling for the erased ones
+        EntryRecord** records;
+        std::atomic<unsigned char>* erased;
+    };
+
+    /**
+     * Registers a reader for as long as it lives, so that the memory the writer removes
+     * meanwhile is not freed. Readers register in the current epoch, and the writer only
+     * advances it when no reader of the previous epoch is left, so memory retired in an
+     * epoch can be freed two epochs later.
+     */
+    class ReadGuard
     {
-        // 2.
-        dit = min_dists.begin();
-        for (fit = pfeatures.begin(); fit != pfeatures.end(); ++fit, ++dit)
+       public:
+        explicit ReadGuard(const TemplatedDatabase& db)
         {
-            if (*dit > 0)
+            for (;;)
             {
-                double dist = F::distance(*(*fit), clusters.back());
-                if (dist < *dit) *dit = dist;
+                const unsigned int epoch = db.m_epoch.load();
+                m_readers                = &db.m_readers[epoch & 1];
+                m_readers->fetch_add(1);
+                if (db.m_epoch.load() == epoch) return;
+                m_readers->fetch_sub(1);
             }
         }
+        ~ReadGuard() { m_readers->fetch_sub(1, std::memory_order_release); }
 
-        // 3.
-        double dist_sum = std::accumulate(min_dists.begin(), min_dists.end(), 0.0);
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
 
-        if (dist_sum > 0)
-        {
-            double cut_d;
-            do
-            {
-                cut_d = RandomValue<double>(0, dist_sum);
-            } while (cut_d == 0.0);
+       private:
+        std::atomic<unsigned int>* m_readers;
+    };
 
-            double d_up_now = 0;
-            for (dit = min_dists.begin(); dit != min_dists.end(); ++dit)
-            {
-                d_up_now += *dit;
-                if (d_up_now >= cut_d) break;
-            }
+    template <class TBowVector>
+    EntryId addImpl(const TBowVector& v, const FlatFeatureVector* fv);
 
-            if (dit == min_dists.end())
-                ifeature = pfeatures.size() - 1;
-            else
-                ifeature = dit - min_dists.begin();
+    /// Record of an entry of the direct index, from base on
+    const EntryRecord* record(const EntryTable* table, EntryId entry_id) const;
 
-#ifdef USE_CV_FORB
-            clusters.push_back(pfeatures[ifeature]->clone());
-#else
-            clusters.push_back(*pfeatures[ifeature]);
-#endif
+    /// Replaces the entry table by one with room for entry_id
+    void growTable(EntryId entry_id);
 
-        }  // if dist_sum > 0
-        else
-            break;
+    /// Compacts the lists in m_compact, unless a snapshot is being saved
+    void compactLists();
 
-    }  // while(used_clusters < m_k)
+    /// Frees f once no reader can be using the memory it frees
+    void retire(std::function<void()> f);
+
+    /// Frees the retired memory no reader can be using anymore
+    void reclaim();
+
+    static const uint32_t SNAPSHOT_VERSION = 2;
+
+    template <class TBowVector>
+    void queryImpl(const TBowVector& v, QueryResults& results, int max_results, int max_id, bool prune) const;
+
+    /// Scores of all the entries from first to last that share words with v, skipping the
+    /// ones marked in erased, if it is not NULL, from first on
+    template <class TBowVector>
+    void scoreAll(const TBowVector& v, EntryId first, EntryId last, const std::atomic<unsigned char>* erased,
+                  QueryResults& results) const;
+
+    /// Scores of the best max_results entries from first to last, plus possibly some others
+    template <class TBowVector>
+    void scoreTopK(const TBowVector& v, EntryId first, EntryId last, const std::atomic<unsigned char>* erased,
+                   size_t max_results, QueryResults& results) const;
+
+    /// Dense accumulators of a query indexed by entry id - first, reused by the queries of a thread.
+    /// They are all zero between queries: a query only resets the entries it touched.
+    struct QueryScratch
+    {
+        std::vector<double> scores;
+        std::vector<unsigned char> is_candidate;
+        std::vector<unsigned int> slot;
+        std::vector<EntryId> touched;
+    };
+
+    /// Scratch of the calling thread, with room for n scores and no touched entries
+    static QueryScratch& queryScratch(size_t n);
+
+    /// Calls f on runs of the first n postings of a list, from entry id first on
+    template <class Fn>
+    static void forEachRun(const TInvertedList& ilist, size_t n, EntryId first, Fn&& f);
+
+    /// Calls f on each of the first n postings of a list, from entry id first on
+    template <class Fn>
+    static void forEachPosting(const TInvertedList& ilist, size_t n, EntryId first, Fn&& f);
+
+    const Vocabulary* m_voc;
+    /// Inverted list of every word of the vocabulary, sorted by entry id
+    std::vector<TInvertedList> m_ifile;
+    /// Number of complete entries, published after their postings
+    std::atomic<unsigned int> m_num_entries;
+    int m_shards;
+    /// Threads scoring the shards, NULL with one shard
+    std::unique_ptr<ThreadPool> m_pool;
+
+    bool m_direct_index;
+    /// Records of the entries, NULL without a direct index
+    std::atomic<EntryTable*> m_table;
+
+    /// Entries before the oldest one are erased, and so are m_holes entries after it
+    std::atomic<EntryId> m_oldest;
+    std::atomic<unsigned int> m_holes;
+    unsigned int m_max_entries;
+    /// Postings of erased entries in every list, and lists to compact
+    std::vector<unsigned int> m_dead;
+    std::vector<WordId> m_compact;
+    /// Held by save, and by the writer while it compacts
+    mutable std::mutex m_compaction_mutex;
+
+    /// Current epoch, number of readers registered in even and odd epochs, and memory removed
+    /// by the writer, with the epoch it was retired in
+    mutable std::atomic<unsigned int> m_epoch;
+    mutable std::atomic<unsigned int> m_readers[2];
+    std::vector<std::pair<unsigned int, std::function<void()> > > m_retired;
+
+    /// Snapshot the first entries come from, and offsets of their records in it
+    MappedFile m_snapshot;
+    unsigned int m_snapshot_entries;
+    const uint64_t* m_snapshot_records;
+};
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::TemplatedDatabase(const Vocabulary& voc, int shards,
+                                                                              bool direct_index)
+    : m_voc(&voc),
+      m_ifile(voc.size()),
+      m_num_entries(0),
+      m_shards(std::max(shards, 1)),
+      m_direct_index(direct_index),
+      m_table(NULL),
+      m_oldest(0),
+      m_holes(0),
+      m_max_entries(0),
+      m_epoch(0),
+      m_snapshot_entries(0),
+      m_snapshot_records(NULL)
+{
+    if (m_shards > 1) m_pool.reset(new ThreadPool(m_shards));
+    m_readers[0].store(0);
+    m_readers[1].store(0);
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::createWords()
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::clear()
 {
-    m_words.resize(0);
+    for (size_t i = 0; i < m_ifile.size(); ++i) m_ifile[i].clear();
+    for (size_t i = 0; i < m_retired.size(); ++i) m_retired[i].second();
+    m_retired.clear();
 
-    if (!m_nodes.empty())
+    // the records of erased entries were retired already
+    EntryTable* table = m_table.load(std::memory_order_relaxed);
+    if (table != NULL)
     {
-        m_words.reserve((int)pow((double)m_k, (double)m_L));
+        const unsigned int num_entries = m_num_entries.load(std::memory_order_relaxed);
+        for (EntryId entry_id = table->base; entry_id < num_entries; ++entry_id)
+            if (!table->erased[entry_id - table->base].load(std::memory_order_relaxed))
+                std::free(table->records[entry_id - table->base]);
+        delete table;
+        m_table.store(NULL, std::memory_order_relaxed);
+    }
 
-        typename std::vector<Node>::iterator nit;
+    m_oldest.store(0, std::memory_order_relaxed);
+    m_holes.store(0, std::memory_order_relaxed);
+    m_dead.clear();
+    m_compact.clear();
 
-        nit = m_nodes.begin();  // ignore root
-        for (++nit; nit != m_nodes.end(); ++nit)
-        {
-            if (nit->isLeaf())
-            {
-                nit->word_id = m_words.size();
-                m_words.push_back(&(*nit));
-            }
-        }
-    }
+    m_snapshot.close();
+    m_snapshot_entries = 0;
+    m_snapshot_records = NULL;
+    m_num_entries.store(0, std::memory_order_release);
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::setNodeWeights(
-    const std::vector<std::vector<TDescriptor>>& training_features)
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+EntryId TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::add(const std::vector<TDescriptor>& features)
 {
-    const unsigned int NWords = m_words.size();
-    const unsigned int NDocs  = training_features.size();
+    FlatBowVector v;
+    m_voc->transform(features, v);
+    return addImpl(v, (const FlatFeatureVector*)NULL);
+}
 
-    if (m_weighting == TF || m_weighting == BINARY)
-    {
-        // idf part must be 1 always
-        for (unsigned int i = 0; i < NWords; i++) m_words[i]->weight = 1;
-    }
-    else if (m_weighting == IDF || m_weighting == TF_IDF)
-    {
-        // IDF and TF-IDF: we calculte the idf path now
+// --------------------------------------------------------------------------
 
-        // Note: this actually calculates the idf part of the tf-idf score.
-        // The complete tf-idf score is calculated in ::transform
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+EntryId TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::add(const BowVector& v)
+{
+    return addImpl(v, (const FlatFeatureVector*)NULL);
+}
 
-        std::vector<unsigned int> Ni(NWords, 0);
-        std::vector<bool> counted(NWords, false);
+// --------------------------------------------------------------------------
 
-        typename std::vector<std::vector<TDescriptor>>::const_iterator mit;
-        typename std::vector<TDescriptor>::const_iterator fit;
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+EntryId TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::add(const FlatBowVector& v)
+{
+    return addImpl(v, (const FlatFeatureVector*)NULL);
+}
 
-        for (mit = training_features.begin(); mit != training_features.end(); ++mit)
-        {
-            fill(counted.begin(), counted.end(), false);
+// --------------------------------------------------------------------------
 
-            for (fit = mit->begin(); fit < mit->end(); ++fit)
-            {
-                WordId word_id;
-                transform(*fit, word_id);
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+EntryId TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::add(const BowVector& v, const FeatureVector& fv)
+{
+    if (!m_direct_index) return addImpl(v, (const FlatFeatureVector*)NULL);
+    const FlatFeatureVector flat(fv);
+    return addImpl(v, &flat);
+}
 
-                if (!counted[word_id])
-                {
-                    Ni[word_id]++;
-                    counted[word_id] = true;
-                }
-            }
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+EntryId TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::add(const FlatBowVector& v,
+                                                                       const FlatFeatureVector& fv)
+{
+    return addImpl(v, &fv);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+template <class TBowVector>
+EntryId TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::addImpl(const TBowVector& v,
+                                                                           const FlatFeatureVector* fv)
+{
+    const EntryId entry_id = m_num_entries.load(std::memory_order_relaxed);
+
+    if (m_direct_index)
+    {
+        const size_t num_nodes    = fv != NULL ? fv->size() : 0;
+        const size_t num_features = num_nodes > 0 ? fv->offsets()[num_nodes] : 0;
+        const size_t bytes        = EntryRecord::bytes(v.size(), num_nodes, num_features);
+        EntryRecord* record       = static_cast<EntryRecord*>(std::calloc(1, bytes));
+        if (record == NULL) throw std::bad_alloc();
+
+        record->num_words    = v.size();
+        record->num_nodes    = num_nodes;
+        record->num_features = num_features;
+        record->reserved     = 0;
+        WordValue* values    = record->values();
+        WordId* words        = record->words();
+        for (typename TBowVector::const_iterator it = v.begin(); it != v.end(); ++it)
+        {
+            *words++  = (*it).first;
+            *values++ = (*it).second;
+        }
+        record->offsets()[0] = 0;
+        if (num_nodes > 0)
+        {
+            std::memcpy(record->nodes(), fv->nodes(), num_nodes * sizeof(NodeId));
+            std::memcpy(record->offsets(), fv->offsets(), (num_nodes + 1) * sizeof(unsigned int));
+            std::memcpy(record->features(), fv->indices(), num_features * sizeof(unsigned int));
         }
 
-        // set ln(N/Ni)
-        for (unsigned int i = 0; i < NWords; i++)
+        EntryTable* table = m_table.load(std::memory_order_relaxed);
+        if (table == NULL || entry_id - table->base >= table->capacity)
         {
-            if (Ni[i] > 0)
+            try
             {
-                m_words[i]->weight = log((double)NDocs / (double)Ni[i]);
-            }  // else // This cannot occur if using kmeans++
+                growTable(entry_id);
+            }
+            catch (...)
+            {
+                std::free(record);
+                throw;
+            }
+            table = m_table.load(std::memory_order_relaxed);
         }
+        table->records[entry_id - table->base] = record;
+    }
+
+    for (typename TBowVector::const_iterator it = v.begin(); it != v.end(); ++it)
+    {
+        const WordId word_id = (*it).first;
+        if (word_id >= m_ifile.size()) continue;  // not a word of the vocabulary
+
+        IFPair pair;
+        pair.entry_id    = entry_id;
+        pair.word_weight = (*it).second;
+        m_ifile[word_id].push_back(pair);
     }
+
+    // readers see the entry from now on
+    m_num_entries.store(entry_id + 1, std::memory_order_release);
+
+    while (m_max_entries > 0 && liveSize() > m_max_entries) erase(m_oldest.load(std::memory_order_relaxed));
+    if (!m_compact.empty()) compactLists();
+    if (!m_retired.empty()) reclaim();
+    return entry_id;
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-inline unsigned int TemplatedVocabulary<TDescriptor, F, Scoring>::size() const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+unsigned int TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::liveSize() const
 {
-    return m_words.size();
+    // the entries before the oldest one are not counted in m_holes
+    const unsigned int holes = m_holes.load(std::memory_order_acquire);
+    const EntryId oldest     = m_oldest.load(std::memory_order_acquire);
+    return size() - oldest - holes;
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-inline bool TemplatedVocabulary<TDescriptor, F, Scoring>::empty() const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+size_t TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::invertedFileBytes() const
 {
-    return m_words.empty();
+    size_t bytes = 0;
+    for (size_t i = 0; i < m_ifile.size(); ++i) bytes += m_ifile[i].bytes();
+    return bytes;
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-float TemplatedVocabulary<TDescriptor, F, Scoring>::getEffectiveLevels() const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::erase(EntryId entry_id)
 {
-    long sum = 0;
-    typename std::vector<Node*>::const_iterator wit;
-    for (wit = m_words.begin(); wit != m_words.end(); ++wit)
+    assert(m_direct_index && entry_id < size());
+    EntryTable* table    = m_table.load(std::memory_order_relaxed);
+    const EntryId oldest = m_oldest.load(std::memory_order_relaxed);
+    if (entry_id < oldest || table->erased[entry_id - table->base].load(std::memory_order_relaxed)) return;
+
+    // Queries skip the entry from now on: the entries before the oldest one are out of their
+    // range, and those after it are checked while there are any. Queries read m_holes before
+    // m_oldest, so they cannot miss the entries erased before both of them.
+    table->erased[entry_id - table->base].store(1);
+    if (entry_id == oldest)
     {
-        const Node* p = *wit;
+        const unsigned int num_entries = size();
+        EntryId next                   = oldest + 1;
+        while (next < num_entries && table->erased[next - table->base].load(std::memory_order_relaxed)) ++next;
+        m_oldest.store(next);
+        if (next > oldest + 1) m_holes.fetch_sub(next - oldest - 1, std::memory_order_release);
+    }
+    else
+    {
+        m_holes.fetch_add(1, std::memory_order_release);
+    }
 
-        for (; p->id != 0; sum++) p = &m_nodes[p->parent];
+    // the lists of the words of the entry are compacted when an eighth of their postings are erased
+    if (m_dead.empty()) m_dead.resize(m_ifile.size(), 0);
+    const EntryRecord* r = record(table, entry_id);
+    for (unsigned int i = 0; i < r->num_words; ++i)
+    {
+        const WordId word_id = r->words()[i];
+        if (word_id >= m_ifile.size()) continue;
+        const size_t n = m_ifile[word_id].size();
+        if (8 * (size_t)m_dead[word_id] < n && 8 * (size_t)++m_dead[word_id] >= n) m_compact.push_back(word_id);
     }
 
-    return (float)((double)sum / (double)m_words.size());
+    EntryRecord* owned = table->records[entry_id - table->base];
+    if (owned != NULL) retire([owned]() { std::free(owned); });
+
+    if (!m_compact.empty()) compactLists();
+    reclaim();
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-TDescriptor TemplatedVocabulary<TDescriptor, F, Scoring>::getWord(WordId wid) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+bool TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::isErased(EntryId entry_id) const
 {
-    return m_words[wid]->descriptor;
+    assert(entry_id < size());
+    ReadGuard guard(*this);
+    const EntryTable* table = m_table.load(std::memory_order_acquire);
+    if (table == NULL) return false;
+    return entry_id < table->base || table->erased[entry_id - table->base].load(std::memory_order_relaxed);
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-WordValue TemplatedVocabulary<TDescriptor, F, Scoring>::getWordWeight(WordId wid) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::setMaxEntries(unsigned int max_entries)
 {
-    return m_words[wid]->weight;
+    assert(m_direct_index || max_entries == 0);
+    m_max_entries = max_entries;
+    while (m_max_entries > 0 && liveSize() > m_max_entries) erase(m_oldest.load(std::memory_order_relaxed));
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-WordId TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const TDescriptor& feature) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::growTable(EntryId entry_id)
 {
-    if (empty())
+    // the erased entries before the oldest one are dropped, and there is room for as many
+    // entries again, so the table is copied once every so many entries
+    const EntryTable* old = m_table.load(std::memory_order_relaxed);
+    const EntryId base    = m_oldest.load(std::memory_order_relaxed);
+    EntryTable* table     = new EntryTable(base, std::max<size_t>(4096, 2 * (size_t)(entry_id + 1 - base)));
+    if (old != NULL)
     {
-        return 0;
+        for (EntryId id = base; id < entry_id; ++id)
+        {
+            table->records[id - base] = old->records[id - old->base];
+            table->erased[id - base].store(old->erased[id - old->base].load(std::memory_order_relaxed),
+                                           std::memory_order_relaxed);
+        }
+        retire([old]() { delete old; });
     }
-
-    WordId wid;
-    transform(feature, wid);
-    return wid;
+    m_table.store(table, std::memory_order_release);
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features,
-                                                             BowVector& v) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::compactLists()
 {
-    v.clear();
+    // save keeps the postings of the entries erased meanwhile, the lists are compacted later
+    std::unique_lock<std::mutex> lock(m_compaction_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) return;
 
-    if (empty())
+    const EntryTable* table = m_table.load(std::memory_order_relaxed);
+    const EntryId oldest    = m_oldest.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < m_compact.size(); ++i)
     {
-        return;
+        const WordId word_id = m_compact[i];
+        retire(m_ifile[word_id].compact([table, oldest](const IFPair& pair) {
+            return pair.entry_id >= oldest &&
+                   !table->erased[pair.entry_id - table->base].load(std::memory_order_relaxed);
+        }));
+        m_dead[word_id] = 0;
     }
+    m_compact.clear();
+}
 
-    // normalize
-    //    LNorm norm;
-    //    bool must = m_scoring_object->mustNormalize(norm);
-
-    typename std::vector<TDescriptor>::const_iterator fit;
+// --------------------------------------------------------------------------
 
-    if (m_weighting == TF || m_weighting == TF_IDF)
-    {
-        for (fit = features.begin(); fit < features.end(); ++fit)
-        {
-            WordId id;
-            WordValue w;
-            // w is the idf value if TF_IDF, 1 if TF
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::retire(std::function<void()> f)
+{
+    m_retired.push_back(std::make_pair(m_epoch.load(std::memory_order_relaxed), std::move(f)));
+}
 
-            transform(*fit, id, w);
+// --------------------------------------------------------------------------
 
-            // not stopped
-            if (w > 0) v.addWeight(id, w);
-        }
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::reclaim()
+{
+    // readers are only left in the current epoch and the previous one
+    unsigned int epoch = m_epoch.load(std::memory_order_relaxed);
+    if (m_readers[(epoch - 1) & 1].load() == 0) m_epoch.store(++epoch);
 
-        if (!v.empty() && !Scoring::mustNormalize)
-        {
-            // unnecessary when normalizing
-            const double nd = v.size();
-            for (BowVector::iterator vit = v.begin(); vit != v.end(); vit++) vit->second /= nd;
-        }
-    }
-    else  // IDF || BINARY
+    size_t kept = 0;
+    for (size_t i = 0; i < m_retired.size(); ++i)
     {
-        for (fit = features.begin(); fit < features.end(); ++fit)
-        {
-            WordId id;
-            WordValue w;
-            // w is idf if IDF, or 1 if BINARY
-
-            transform(*fit, id, w);
-
-            // not stopped
-            if (w > 0) v.addIfNotExist(id, w);
+        if (epoch - m_retired[i].first >= 2)
+            m_retired[i].second();
+        else
+            m_retired[kept++] = std::move(m_retired[i]);
+    }
+    m_retired.resize(kept);
+}
 
-        }  // if add_features
-    }      // if m_weighting == ...
+// --------------------------------------------------------------------------
 
-    if (Scoring::mustNormalize) v.normalize();
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+const typename TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::EntryRecord*
+TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::record(const EntryTable* table, EntryId entry_id) const
+{
+    const EntryRecord* r = table->records[entry_id - table->base];
+    if (r != NULL) return r;
+    return reinterpret_cast<const EntryRecord*>(m_snapshot.data() + m_snapshot_records[entry_id]);
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const std::vector<TDescriptor>& features, BowVector& v,
-                                                             FeatureVector& fv, int levelsup) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::getBowVector(EntryId entry_id,
+                                                                             FlatBowVector& v) const
 {
+    assert(m_direct_index && entry_id < size());
     v.clear();
-    fv.clear();
 
+    ReadGuard guard(*this);
+    const EntryTable* table = m_table.load(std::memory_order_acquire);
+    if (entry_id < table->base || table->erased[entry_id - table->base].load(std::memory_order_relaxed)) return;
 
-    if (empty())  // safe for subclasses
+    const EntryRecord* r = record(table, entry_id);
+    v.reserve(r->num_words);
+    for (unsigned int i = 0; i < r->num_words; ++i) v.push_back(r->words()[i], r->values()[i]);
+}
+
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::getFeatureVector(EntryId entry_id,
+                                                                                 FlatFeatureVector& fv) const
+{
+    assert(m_direct_index && entry_id < size());
+
+    ReadGuard guard(*this);
+    const EntryTable* table = m_table.load(std::memory_order_acquire);
+    if (entry_id < table->base || table->erased[entry_id - table->base].load(std::memory_order_relaxed))
     {
+        fv.clear();
         return;
     }
 
+    const EntryRecord* r = record(table, entry_id);
+    fv.assign(r->nodes(), r->offsets(), r->num_nodes, r->features());
+}
 
-    typename std::vector<TDescriptor>::const_iterator fit;
-
-    if (m_weighting == TF || m_weighting == TF_IDF)
-    {
-        unsigned int i_feature = 0;
-        for (fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
-        {
-            WordId id;
-            NodeId nid;
-            WordValue w;
-            // w is the idf value if TF_IDF, 1 if TF
+// --------------------------------------------------------------------------
 
-            transform(*fit, id, w, &nid, levelsup);
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+bool TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::save(const std::string& file) const
+{
+    std::ofstream out(file, std::ios::binary);
+    if (!out) return false;
+
+    // lists are not compacted while the snapshot is written, so the entries erased meanwhile
+    // keep their postings and are saved either way
+    ReadGuard guard(*this);
+    std::lock_guard<std::mutex> lock(m_compaction_mutex);
+
+    const unsigned int num_entries = size();
+    const EntryTable* table        = m_table.load(std::memory_order_acquire);
+    const EntryId first_entry      = std::min<EntryId>(m_oldest.load(std::memory_order_acquire), num_entries);
+    std::vector<unsigned char> erased(num_entries - first_entry, 0);
+    if (table != NULL)
+        for (EntryId entry_id = first_entry; entry_id < num_entries; ++entry_id)
+            erased[entry_id - first_entry] = table->erased[entry_id - table->base].load(std::memory_order_relaxed);
+    auto is_erased = [&](EntryId entry_id) { return entry_id < first_entry || erased[entry_id - first_entry]; };
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "MINIBOWD", sizeof(header.magic));
+    header.version             = SNAPSHOT_VERSION;
+    header.byte_order          = 0x01020304;
+    header.pointer_bytes       = sizeof(void*);
+    header.list_format         = TInvertedList::id;
+    header.vocabulary_checksum = m_voc->checksum();
+    header.num_words           = m_ifile.size();
+    header.num_entries         = num_entries;
+    header.first_entry         = first_entry;
+    header.words               = sizeof(SnapshotHeader);
+    header.records             = m_direct_index ? header.words + m_ifile.size() * sizeof(SnapshotWord) : 0;
+
+    // the tables are written again at the end, with the offsets
+    std::vector<SnapshotWord> words(m_ifile.size());
+    std::vector<uint64_t> records(m_direct_index ? num_entries : 0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(SnapshotWord));
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(uint64_t));
+    uint64_t pos = sizeof(header) + words.size() * sizeof(SnapshotWord) + records.size() * sizeof(uint64_t);
+
+    auto align = [&out, &pos]() {
+        const char zeros[8]  = {0};
+        const size_t padding = (8 - pos % 8) % 8;
+        out.write(zeros, padding);
+        pos += padding;
+    };
 
-            if (w > 0)  // not stopped
+    std::vector<IFPair> postings;
+    for (size_t w = 0; w < m_ifile.size(); ++w)
+    {
+        // postings of the entries added before the call and not erased, and their largest weight
+        const TInvertedList& ilist = m_ifile[w];
+        WordValue max_weight       = 0;
+        postings.clear();
+        ilist.forEachRun(ilist.size(), [&](const IFPair* pairs, size_t count) {
+            for (size_t i = 0; i < count; ++i)
             {
-                v.addWeight(id, w);
-                fv.addFeature(nid, i_feature);
+                if (pairs[i].entry_id >= num_entries) return false;
+                if (is_erased(pairs[i].entry_id)) continue;
+                max_weight = std::max(max_weight, std::abs(pairs[i].word_weight));
+                postings.push_back(pairs[i]);
             }
-        }
-
-        if (!v.empty() && !Scoring::mustNormalize)
-        {
-            // unnecessary when normalizing
-            const double nd = v.size();
-            for (BowVector::iterator vit = v.begin(); vit != v.end(); vit++) vit->second /= nd;
-        }
+            return true;
+        });
+        if (postings.empty()) continue;
+
+        align();
+        words[w].offset     = pos;
+        words[w].size       = postings.size();
+        words[w].max_weight = max_weight;
+        pos += TInvertedList::save(out, postings.data(), postings.size());
     }
-    else  // IDF || BINARY
+
+    // records are a multiple of 8 bytes, the erased entries share an empty one
+    align();
+    for (EntryId entry_id = 0; entry_id < records.size(); ++entry_id)
     {
-        unsigned int i_feature = 0;
-        for (fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
+        if (is_erased(entry_id))
         {
-            WordId id;
-            NodeId nid;
-            WordValue w;
-            // w is idf if IDF, or 1 if BINARY
-
-            transform(*fit, id, w, &nid, levelsup);
-
-            if (w > 0)  // not stopped
+            if (header.erased_record == 0)
             {
-                v.addIfNotExist(id, w);
-                fv.addFeature(nid, i_feature);
+                const std::vector<char> empty(EntryRecord::bytes(0, 0, 0), 0);
+                header.erased_record = pos;
+                out.write(empty.data(), empty.size());
+                pos += empty.size();
             }
+            records[entry_id] = header.erased_record;
+            continue;
         }
-    }  // if m_weighting == ...
-
-    if (Scoring::mustNormalize) v.normalize();
-}
 
-// --------------------------------------------------------------------------
+        const EntryRecord* r = record(table, entry_id);
+        records[entry_id]    = pos;
+        out.write(reinterpret_cast<const char*>(r), r->bytes());
+        pos += r->bytes();
+    }
 
-template <class TDescriptor, class F, class Scoring>
-inline double TemplatedVocabulary<TDescriptor, F, Scoring>::score(const BowVector& v1, const BowVector& v2) const
-{
-    return Scoring::score(v1, v2);
+    header.file_size = pos;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(SnapshotWord));
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(uint64_t));
+    out.close();
+    return !out.fail();
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const TDescriptor& feature, WordId& id) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+bool TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::load(const std::string& file)
 {
-    WordValue weight;
-    transform(feature, id, weight);
-}
+    clear();
+    if (!m_snapshot.open(file)) return false;
 
-// --------------------------------------------------------------------------
-
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::transform(const TDescriptor& feature, WordId& word_id,
-                                                             WordValue& weight, NodeId* nid, int levelsup) const
-{
-    // propagate the feature down the tree
-    std::vector<NodeId> nodes;
-    typename std::vector<NodeId>::const_iterator nit;
+    const unsigned char* data = m_snapshot.data();
+    const size_t size         = m_snapshot.size();
 
-    // level at which the node must be stored in nid, if given
-    const int nid_level = m_L - levelsup;
-    if (nid_level <= 0 && nid != NULL) *nid = 0;  // root
+    SnapshotHeader header;
+    bool valid = size >= sizeof(header);
+    if (valid)
+    {
+        std::memcpy(&header, data, sizeof(header));
+        valid = std::memcmp(header.magic, "MINIBOWD", sizeof(header.magic)) == 0 &&
+                header.version == SNAPSHOT_VERSION && header.byte_order == 0x01020304 &&
+                header.pointer_bytes == sizeof(void*) && header.list_format == TInvertedList::id &&
+                header.num_words == m_ifile.size() && header.file_size == size &&
+                header.first_entry <= header.num_entries && header.erased_record < size &&
+                header.words % 8 == 0 && header.records % 8 == 0 &&
+                header.words + header.num_words * sizeof(SnapshotWord) <= size &&
+                (header.records == 0 ? !m_direct_index
+                                     : header.records + header.num_entries * sizeof(uint64_t) <= size) &&
+                header.vocabulary_checksum == m_voc->checksum();
+    }
 
-    NodeId final_id   = 0;  // root
-    int current_level = 0;
+    // the lists and records are used in place, so they must be aligned and inside the file
+    const SnapshotWord* words = valid ? reinterpret_cast<const SnapshotWord*>(data + header.words) : NULL;
+    for (size_t w = 0; valid && w < m_ifile.size(); ++w)
+    {
+        if (words[w].size == 0) continue;
+        const uint64_t offset = words[w].offset;
+        valid                 = offset % 8 == 0 && offset < size && words[w].size <= header.num_entries &&
+                                TInvertedList::validChunk(data + offset, size - offset, words[w].size);
+        if (valid) m_ifile[w].attach(m_snapshot.data() + offset, words[w].size, words[w].max_weight);
+    }
 
-    do
+    const uint64_t* records = valid && m_direct_index ? reinterpret_cast<const uint64_t*>(data + header.records) : NULL;
+    for (EntryId entry_id = 0; records != NULL && valid && entry_id < header.num_entries; ++entry_id)
     {
-        ++current_level;
-        nodes    = m_nodes[final_id].children;
-        final_id = nodes[0];
+        const uint64_t offset = records[entry_id];
+        valid                 = offset % 8 == 0 && offset < size && size - offset >= sizeof(EntryRecord) &&
+                                reinterpret_cast<const EntryRecord*>(data + offset)->bytes() <= size - offset;
+    }
 
-        double best_d = F::distance(feature, m_nodes[final_id].descriptor);
+    if (!valid)
+    {
+        clear();
+        return false;
+    }
 
-        for (nit = nodes.begin() + 1; nit != nodes.end(); ++nit)
+    m_snapshot_entries = header.num_entries;
+    m_oldest.store(header.first_entry, std::memory_order_relaxed);
+    if (m_direct_index)
+    {
+        m_snapshot_records = records;
+
+        // the records of the snapshot are used in place, only the erased entries are marked
+        const size_t capacity = 2 * (size_t)(header.num_entries - header.first_entry);
+        EntryTable* table     = new EntryTable(header.first_entry, std::max<size_t>(4096, capacity));
+        unsigned int holes    = 0;
+        for (EntryId entry_id = header.first_entry; header.erased_record != 0 && entry_id < header.num_entries;
+             ++entry_id)
         {
-            NodeId id = *nit;
-            double d  = F::distance(feature, m_nodes[id].descriptor);
-            if (d < best_d)
-            {
-                best_d   = d;
-                final_id = id;
-            }
+            if (m_snapshot_records[entry_id] != header.erased_record) continue;
+            table->erased[entry_id - table->base].store(1, std::memory_order_relaxed);
+            ++holes;
         }
+        m_table.store(table, std::memory_order_relaxed);
+        m_holes.store(holes, std::memory_order_relaxed);
+    }
+    m_num_entries.store(header.num_entries, std::memory_order_release);
+    return true;
+}
 
-        if (nid != NULL && current_level == nid_level) *nid = final_id;
+// --------------------------------------------------------------------------
 
-    } while (!m_nodes[final_id].isLeaf());
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::query(const BowVector& v, QueryResults& results,
+                                                                      int max_results, int max_id) const
+{
+    queryImpl(v, results, max_results, max_id, false);
+}
 
-    // turn node id into word id
-    word_id = m_nodes[final_id].word_id;
-    weight  = m_nodes[final_id].weight;
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::query(const FlatBowVector& v, QueryResults& results,
+                                                                      int max_results, int max_id) const
+{
+    queryImpl(v, results, max_results, max_id, false);
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-NodeId TemplatedVocabulary<TDescriptor, F, Scoring>::getParentNode(WordId wid, int levelsup) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::queryTopK(const BowVector& v, QueryResults& results,
+                                                                          int max_results, int max_id) const
 {
-    NodeId ret = m_words[wid]->id;    // node id
-    while (levelsup > 0 && ret != 0)  // ret == 0 --> root
-    {
-        --levelsup;
-        ret = m_nodes[ret].parent;
-    }
-    return ret;
+    queryImpl(v, results, max_results, max_id, true);
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::getWordsFromNode(NodeId nid, std::vector<WordId>& words) const
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::queryTopK(const FlatBowVector& v,
+                                                                          QueryResults& results, int max_results,
+                                                                          int max_id) const
 {
-    words.clear();
+    queryImpl(v, results, max_results, max_id, true);
+}
 
-    if (m_nodes[nid].isLeaf())
-    {
-        words.push_back(m_nodes[nid].word_id);
-    }
-    else
-    {
-        words.reserve(m_k);  // ^1, ^2, ...
+// --------------------------------------------------------------------------
 
-        std::vector<NodeId> parents;
-        parents.push_back(nid);
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+template <class TBowVector>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::queryImpl(const TBowVector& v, QueryResults& results,
+                                                                          int max_results, int max_id,
+                                                                          bool prune) const
+{
+    results.clear();
+    ReadGuard guard(*this);
+
+    // entries added after this point are ignored, even if some of their postings are visible
+    const unsigned int num_entries = size();
+    if (num_entries == 0) return;
+
+    // erased entries are the ones before the oldest one, and the ones marked in the table
+    const EntryTable* table = m_table.load(std::memory_order_acquire);
+    const bool holes        = m_holes.load(std::memory_order_acquire) > 0;
+    const EntryId oldest    = m_oldest.load(std::memory_order_acquire);
+
+    const EntryId last = max_id < 0 ? num_entries - 1 : std::min((EntryId)max_id, num_entries - 1);
+    if (oldest > last) return;
+
+    // every shard returns its best max_results entries, sorted, and they are merged as they come;
+    // Result::better is a total order, so the merged results do not depend on the order
+    auto score = [&](EntryId first, EntryId shard_last, QueryResults& shard_results) {
+        const std::atomic<unsigned char>* erased = holes ? table->erased + (first - table->base) : NULL;
+        if (prune && max_results > 0)
+            scoreTopK(v, first, shard_last, erased, max_results, shard_results);
+        else
+            scoreAll(v, first, shard_last, erased, shard_results);
 
-        while (!parents.empty())
+        if (max_results > 0 && (size_t)max_results < shard_results.size())
         {
-            NodeId parentid = parents.back();
-            parents.pop_back();
-
-            const std::vector<NodeId>& child_ids = m_nodes[parentid].children;
-            std::vector<NodeId>::const_iterator cit;
+            std::partial_sort(shard_results.begin(), shard_results.begin() + max_results, shard_results.end(),
+                              Result::better);
+            shard_results.resize(max_results);
+        }
+        else
+        {
+            std::sort(shard_results.begin(), shard_results.end(), Result::better);
+        }
+    };
 
-            for (cit = child_ids.begin(); cit != child_ids.end(); ++cit)
-            {
-                const Node& child_node = m_nodes[*cit];
+    // shards of fewer entries do not pay off the threads
+    const size_t min_shard_entries = 4096;
+    const uint64_t span            = last + 1 - oldest;
+    const size_t shards            = std::min<size_t>(m_shards, std::max<size_t>(span / min_shard_entries, 1));
+    if (shards == 1)
+    {
+        score(oldest, last, results);
+        return;
+    }
 
-                if (child_node.isLeaf())
-                    words.push_back(child_node.word_id);
-                else
-                    parents.push_back(*cit);
+    std::vector<QueryResults> shard_results(shards);
+    m_pool->parallelFor(shards, [&](size_t s, int) {
+        const EntryId first = oldest + (EntryId)(span * s / shards);
+        score(first, oldest + (EntryId)(span * (s + 1) / shards) - 1, shard_results[s]);
+    });
 
-            }  // for each child
-        }      // while !parents.empty
+    for (size_t s = 0; s < shards; ++s)
+    {
+        const size_t middle = results.size();
+        results.insert(results.end(), shard_results[s].begin(), shard_results[s].end());
+        std::inplace_merge(results.begin(), results.begin() + middle, results.end(), Result::better);
+        if (max_results > 0 && (size_t)max_results < results.size()) results.resize(max_results);
     }
 }
 
 // --------------------------------------------------------------------------
 
-template <class TDescriptor, class F, class Scoring>
-int TemplatedVocabulary<TDescriptor, F, Scoring>::stopWords(double minWeight)
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+template <class Fn>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::forEachRun(const TInvertedList& ilist, size_t n,
+                                                                           EntryId first, Fn&& f)
 {
-    int c = 0;
-    typename std::vector<Node*>::iterator wit;
-    for (wit = m_words.begin(); wit != m_words.end(); ++wit)
+    if (first == 0)
     {
-        if ((*wit)->weight < minWeight)
-        {
-            ++c;
-            (*wit)->weight = 0;
-        }
+        ilist.forEachRun(n, f);
+        return;
     }
-    return c;
+
+    typename TInvertedList::Cursor cursor(ilist, n);
+    if (cursor.seek(first) != NULL) cursor.forEachRun(f);
 }
 
+// --------------------------------------------------------------------------
 
-struct BinaryFile
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+template <class Fn>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::forEachPosting(const TInvertedList& ilist, size_t n,
+                                                                               EntryId first, Fn&& f)
 {
-    BinaryFile(const std::string& file, std::ios_base::openmode __mode = std::ios_base::in)
-        : strm(file, std::ios::binary | __mode)
+    if (first == 0)
     {
+        ilist.forEach(n, f);
+        return;
     }
 
-    template <typename T>
-    void write(const T& v)
-    {
-        strm.write(reinterpret_cast<const char*>(&v), sizeof(T));
-    }
+    typename TInvertedList::Cursor cursor(ilist, n);
+    if (cursor.seek(first) != NULL) cursor.forEach(f);
+}
 
-    template <typename T>
-    void write(const std::vector<T>& vec)
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+template <class TBowVector>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::scoreAll(const TBowVector& v, EntryId first,
+                                                                         EntryId last,
+                                                                         const std::atomic<unsigned char>* erased,
+                                                                         QueryResults& results) const
+{
+    // The words of the query are visited in ascending order, so the terms of every entry are
+    // added in the same order as L1Scoring::score adds them and the scores are identical.
+    QueryScratch& scratch         = queryScratch(last - first + 1);
+    std::vector<double>& scores   = scratch.scores;
+    std::vector<EntryId>& touched = scratch.touched;
+
+    for (typename TBowVector::const_iterator it = v.begin(); it != v.end(); ++it)
     {
-        write((size_t)vec.size());
-        for (auto& v : vec) write(v);
+        const WordId word_id = (*it).first;
+        if (word_id >= m_ifile.size()) continue;
+
+        // The postings are decoded right into the scores, and the lambda keeps copies of the
+        // values it reads, which the stores to the scores would make it load again otherwise.
+        const WordValue qvalue     = (*it).second;
+        const TInvertedList& ilist = m_ifile[word_id];
+        double* const accumulator  = scores.data();
+        forEachPosting(ilist, ilist.size(), first,
+                       [accumulator, erased, first, last, qvalue, &touched](const IFPair& pair) {
+                           const EntryId entry_id = pair.entry_id;
+                           if (entry_id > last) return false;
+                           if (erased != NULL && erased[entry_id - first].load(std::memory_order_relaxed)) return true;
+
+                           double& score = accumulator[entry_id - first];
+                           if (score == 0) touched.push_back(entry_id);
+                           score += Scoring::term(qvalue, pair.word_weight);
+                           return true;
+                       });
     }
 
-    template <typename T>
-    void read(std::vector<T>& vec)
+    results.reserve(touched.size());
+    for (size_t i = 0; i < touched.size(); ++i)
     {
-        size_t s;
-        read(s);
-        vec.resize(s);
-        for (auto& v : vec) read(v);
+        // an entry could be touched twice if a term was exactly 0, its score is reset the first time
+        double& score = scores[touched[i] - first];
+        if (score != 0) results.push_back(Result(touched[i], -score / 2.0));
+        score = 0;
     }
+}
 
-    template <typename T>
-    void read(T& v)
+// --------------------------------------------------------------------------
+
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+template <class TBowVector>
+void TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::scoreTopK(const TBowVector& v, EntryId first,
+                                                                          EntryId last,
+                                                                          const std::atomic<unsigned char>* erased,
+                                                                          size_t max_results,
+                                                                          QueryResults& results) const
+{
+    struct QueryWord
     {
-        strm.read(reinterpret_cast<char*>(&v), sizeof(T));
-    }
+        WordValue qvalue;
+        const TInvertedList* ilist;
+        /// Postings of the list read by the query, and about how many of them are in [first, last]
+        size_t n, in_range;
+        /// Upper bound of the score the word can add to an entry
+        double bound;
+    };
 
-    template <typename T>
-    BinaryFile& operator<<(const T& v)
+    // query words in ascending order; the postings of the entries before the oldest one are
+    // mostly compacted away
+    const EntryId oldest = std::min(m_oldest.load(std::memory_order_relaxed), first);
+    const double share   = (double)(last - first + 1) / (last + 1 - oldest);
+    std::vector<QueryWord> words;
+    words.reserve(v.size());
+    size_t postings = 0;
+    for (typename TBowVector::const_iterator it = v.begin(); it != v.end(); ++it)
     {
-        write(v);
-        return *this;
+        const WordId word_id = (*it).first;
+        if (word_id >= m_ifile.size()) continue;
+
+        QueryWord word;
+        word.qvalue = (*it).second;
+        word.ilist  = &m_ifile[word_id];
+        word.n      = word.ilist->size();
+        word.bound  = Scoring::termBound(word.qvalue, word.ilist->maxWeight());  // read after size()
+        if (word.n == 0) continue;
+
+        word.in_range = (size_t)(word.n * share);
+        words.push_back(word);
+        postings += word.in_range;
     }
 
-    template <typename T>
-    BinaryFile& operator>>(T& v)
+    // the results are rescored by searching the lists, which does not pay off for short lists
+    if (postings < 4 * words.size() * max_results)
     {
-        read(v);
-        return *this;
+        scoreAll(v, first, last, erased, results);
+        return;
     }
 
-    std::fstream strm;
-};
+    // MaxScore: the lists with the largest bounds are scanned first. Once the k-th best partial
+    // score is larger than what the rest of words can add, entries not found yet cannot make it to
+    // the results, and the rest of lists are only searched for the candidates found so far.
+    std::vector<size_t> order(words.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&words](size_t a, size_t b) { return words[a].bound > words[b].bound; });
+
+    // bound of the words order[j..]
+    std::vector<double> remaining(order.size() + 1, 0);
+    for (size_t j = order.size(); j-- > 0;) remaining[j] = remaining[j + 1] + words[order[j]].bound;
+
+    // Partial scores are added in another order than the final scores, so they may differ in the
+    // last bits. Bounds are compared with some tolerance and the candidates are rescored exactly.
+    auto below = [](double bound, double threshold) { return bound * (1 + 1e-9) < threshold; };
+
+    // partial scores, and a lower bound of the k-th best final score
+    const size_t range            = last - first + 1;
+    QueryScratch& scratch         = queryScratch(range);
+    std::vector<double>& scores   = scratch.scores;
+    std::vector<EntryId>& touched = scratch.touched;
+    double threshold              = 0;
+
+    size_t j = 0, scanned = 0;
+    double target = 0;
+    for (; j < order.size(); ++j)
+    {
+        // Stops once k entries are above twice the bound of the remaining words, which leaves
+        // much fewer candidates than stopping as soon as possible. Checking costs about as much
+        // as scanning a posting per touched entry.
+        if (touched.size() >= max_results && scanned >= touched.size())
+        {
+            target       = 2 * remaining[j] * (1 + 1e-9);
+            size_t above = 0;
+            if (4 * touched.size() > range)
+                for (size_t i = 0; i < range; ++i) above += scores[i] > target;
+            else
+                for (size_t i = 0; i < touched.size(); ++i) above += scores[touched[i] - first] > target;
+            if (above >= max_results) break;
+            target  = 0;
+            scanned = 0;
+        }
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::loadRaw(const std::string& file)
-{
-    BinaryFile bf(file, std::ios_base::in);
-    int scoringid;
-    bf >> m_k >> m_L >> scoringid >> m_weighting;
+        const QueryWord& word = words[order[j]];
+        forEachRun(*word.ilist, word.n, first, [&](const IFPair* pairs, size_t n) {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (pairs[i].entry_id > last) return false;
+                if (erased != NULL && erased[pairs[i].entry_id - first].load(std::memory_order_relaxed)) continue;
+
+                // terms are never positive, so partial scores only grow
+                const double add = -Scoring::term(word.qvalue, pairs[i].word_weight) / 2.0;
+                double& score    = scores[pairs[i].entry_id - first];
+                if (score == 0 && add > 0) touched.push_back(pairs[i].entry_id);
+                score += add;
+            }
+            return true;
+        });
+        scanned += word.in_range;
+    }
+    const size_t scanned_words = j;
 
-    if (m_weighting != TF_IDF)
+    // touched entries in id order, all the entries with a non-zero score
+    if (4 * touched.size() > range)
     {
-        std::cout << "fail1" << std::endl;
-        exit(0);
+        touched.clear();
+        for (EntryId entry_id = first; entry_id <= last; ++entry_id)
+            if (scores[entry_id - first] != 0) touched.push_back(entry_id);
     }
-    if (scoringid != Scoring::id)
+    else
     {
-        std::cout << "fail2" << std::endl;
-        exit(0);
+        std::sort(touched.begin(), touched.end());
     }
 
-
-    size_t nodecount;
-    bf >> nodecount;
-    m_nodes.resize(nodecount);
-    for (Node& n : m_nodes)
+    // the k-th best score is above the target if the scan stopped early
+    std::vector<double> best;
+    for (size_t i = 0; i < touched.size(); ++i)
+        if (scores[touched[i] - first] > target) best.push_back(scores[touched[i] - first]);
+    if (best.size() >= max_results)
     {
-        //        typename F::BinaryDescriptor des;
-        bf >> n.id >> n.parent >> n.weight >> n.word_id >> n.descriptor;
-        //        F::fromBinary(des, n.descriptor);
-        if (n.id != 0) m_nodes[n.parent].children.push_back(n.id);
+        std::nth_element(best.begin(), best.begin() + (max_results - 1), best.end(), std::greater<double>());
+        threshold = best[max_results - 1];
     }
 
-    // words
-    std::vector<std::pair<int, int>> words;
-    bf >> words;
+    std::vector<EntryId> candidates;
+    for (size_t i = 0; i < touched.size(); ++i)
+        if (!below(scores[touched[i] - first] + remaining[j], threshold)) candidates.push_back(touched[i]);
 
-    m_words.resize(words.size());
-    for (auto i = 0; i < m_words.size(); ++i)
+    // The rest of lists only add to the candidates, which are dropped as soon as they cannot reach
+    // the k-th best score anymore. A list is scanned if it is short compared to the number of
+    // candidates, otherwise it is searched for every candidate.
+    struct Found
     {
-        m_words[i] = &m_nodes[words[i].second];
-    }
-}
+        EntryId entry_id;
+        unsigned int word;
+        WordValue weight;
+    };
+    std::vector<Found> found;
+    std::vector<unsigned char>& is_candidate = scratch.is_candidate;
+    if (is_candidate.size() < range) is_candidate.resize(range, 0);
+    for (size_t c = 0; c < candidates.size(); ++c) is_candidate[candidates[c] - first] = 1;
 
+    for (; j < order.size() && !candidates.empty(); ++j)
+    {
+        const QueryWord& word = words[order[j]];
+        auto add              = [&](const IFPair& pair) {
+            scores[pair.entry_id - first] -= Scoring::term(word.qvalue, pair.word_weight) / 2.0;
+            Found f;
+            f.entry_id = pair.entry_id;
+            f.word     = order[j];
+            f.weight   = pair.word_weight;
+            found.push_back(f);
+        };
+
+        if (word.in_range < 32 * candidates.size())
+        {
+            forEachRun(*word.ilist, word.n, first, [&](const IFPair* pairs, size_t n) {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    if (pairs[i].entry_id > last) return false;
+                    if (is_candidate[pairs[i].entry_id - first]) add(pairs[i]);
+                }
+                return true;
+            });
+        }
+        else
+        {
+            typename TInvertedList::Cursor cursor(*word.ilist, word.n);
+            for (size_t c = 0; c < candidates.size(); ++c)
+            {
+                const IFPair* pair = cursor.seek(candidates[c]);
+                if (pair == NULL) break;
+                if (pair->entry_id == candidates[c]) add(*pair);
+            }
+        }
 
+        if (candidates.size() >= max_results)
+        {
+            best.resize(candidates.size());
+            for (size_t c = 0; c < candidates.size(); ++c) best[c] = scores[candidates[c] - first];
+            std::nth_element(best.begin(), best.begin() + (max_results - 1), best.end(), std::greater<double>());
+            threshold = std::max(threshold, best[max_results - 1]);
+        }
 
-template <class TDescriptor, class F, class Scoring>
-void TemplatedVocabulary<TDescriptor, F, Scoring>::saveRaw(const std::string& file) const
-{
-    BinaryFile bf(file, std::ios_base::out);
-    bf << m_k << m_L << Scoring::id << m_weighting;
-    bf << (size_t)m_nodes.size();
-    for (const Node& n : m_nodes)
-    {
-        bf << n.id << n.parent << n.weight << n.word_id << n.descriptor;
-    }
-    // words
-    std::vector<std::pair<int, int>> words;
-    for (auto i = 0; i < m_words.size(); ++i)
-    {
-        words.emplace_back(i, m_words[i]->id);
+        size_t kept = 0;
+        for (size_t c = 0; c < candidates.size(); ++c)
+        {
+            if (below(scores[candidates[c] - first] + remaining[j + 1], threshold))
+                is_candidate[candidates[c] - first] = 0;
+            else
+                candidates[kept++] = candidates[c];
+        }
+        candidates.resize(kept);
     }
-    bf << words;
-}
 
+    // the terms of the final candidates: the ones found in the rest of lists, and the scanned lists
+    // again, scanning them if they are short or searching them for the candidates
+    std::vector<unsigned int>& slot = scratch.slot;
+    if (slot.size() < range) slot.resize(range, 0);
+    for (size_t c = 0; c < candidates.size(); ++c) slot[candidates[c] - first] = c + 1;
 
+    std::vector<std::vector<std::pair<size_t, WordValue> > > terms(candidates.size());
+    for (size_t i = 0; i < found.size(); ++i)
+        if (slot[found[i].entry_id - first] != 0)
+            terms[slot[found[i].entry_id - first] - 1].push_back(std::make_pair(found[i].word, found[i].weight));
 
-// --------------------------------------------------------------------------
-
-/**
- * Writes printable information of the vocabulary
- * @param os stream to write to
- * @param voc
- */
-template <class TDescriptor, class F, class Scoring>
-std::ostream& operator<<(std::ostream& os, const TemplatedVocabulary<TDescriptor, F, Scoring>& voc)
-{
-    os << "Vocabulary: k = " << voc.getBranchingFactor() << ", L = " << voc.getDepthLevels() << ", Weighting = ";
+    for (size_t i = 0; i < scanned_words; ++i)
+    {
+        const QueryWord& word = words[order[i]];
+        if (word.in_range < 16 * candidates.size())
+        {
+            forEachRun(*word.ilist, word.n, first, [&](const IFPair* pairs, size_t n) {
+                for (size_t k = 0; k < n; ++k)
+                {
+                    if (pairs[k].entry_id > last) return false;
+                    const unsigned int c = slot[pairs[k].entry_id - first];
+                    if (c != 0) terms[c - 1].push_back(std::make_pair(order[i], pairs[k].word_weight));
+                }
+                return true;
+            });
+        }
+        else
+        {
+            typename TInvertedList::Cursor cursor(*word.ilist, word.n);
+            for (size_t c = 0; c < candidates.size(); ++c)
+            {
+                const IFPair* pair = cursor.seek(candidates[c]);
+                if (pair == NULL) break;
+                if (pair->entry_id == candidates[c]) terms[c].push_back(std::make_pair(order[i], pair->word_weight));
+            }
+        }
+    }
 
-    switch (voc.getWeightingType())
+    // exact scores, adding the terms in word order
+    results.reserve(candidates.size());
+    for (size_t c = 0; c < candidates.size(); ++c)
     {
-        case TF_IDF:
-            os << "tf-idf";
-            break;
-        case TF:
-            os << "tf";
-            break;
-        case IDF:
-            os << "idf";
-            break;
-        case BINARY:
-            os << "binary";
-            break;
+        std::sort(terms[c].begin(), terms[c].end());
+
+        double score = 0;
+        for (size_t i = 0; i < terms[c].size(); ++i)
+            score += Scoring::term(words[terms[c][i].first].qvalue, terms[c][i].second);
+        if (score != 0) results.push_back(Result(candidates[c], -score / 2.0));
     }
 
-    os << ", Scoring = ";
-    switch (Scoring::id)
+    // the candidates left are the only entries marked, and the touched ones the only scored
+    for (size_t c = 0; c < candidates.size(); ++c)
     {
-        case 0:
-            os << "L1-norm";
-            break;
+        is_candidate[candidates[c] - first] = 0;
+        slot[candidates[c] - first]         = 0;
     }
+    for (size_t i = 0; i < touched.size(); ++i) scores[touched[i] - first] = 0;
+}
 
-    os << ", Number of words = " << voc.size();
+// --------------------------------------------------------------------------
 
-    return os;
+template <class TDescriptor, class F, class Scoring, class TInvertedList>
+typename TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::QueryScratch&
+TemplatedDatabase<TDescriptor, F, Scoring, TInvertedList>::queryScratch(size_t n)
+{
+    // grows to the largest range queried by the thread, 8 bytes per entry plus 5 for queryTopK
+    static thread_local QueryScratch scratch;
+    if (scratch.scores.size() < n) scratch.scores.resize(n, 0);
+    scratch.touched.clear();
+    return scratch;
 }
 
 }  // namespace DBoW2
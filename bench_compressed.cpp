@@ -0,0 +1,133 @@
+/**
+ * Compares the inverted lists of TemplatedDatabase: the memory per posting and the query
+ * latency of InvertedList and CompressedInvertedList, on images whose words follow a Zipf
+ * distribution. It fails if the scores of the compressed lists are further from
+ * L1Scoring::score than the quantization error of their weights, or if their queries take
+ * more than MAX_LATENCY_RATIO times as long as with InvertedList.
+ *
+ * Usage: bench_compressed [entries] [Zipf exponent] [vocabulary file]
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+
+#include "bench_util.h"
+
+using namespace DBoW2;
+using namespace std;
+using namespace bench;
+
+/// Largest ratio of the query latency of CompressedInvertedList to the one of InvertedList
+const double MAX_LATENCY_RATIO = 1.2;
+
+/**
+ * A database with the images, the time it took to add them, and its best query latency
+ */
+template <class TInvertedList>
+struct Candidate
+{
+    Candidate(const OrbVocabulary& voc, const vector<FlatBowVector>& images)
+        : db(voc), latency(numeric_limits<double>::max())
+    {
+        const double start = now();
+        for (size_t i = 0; i < images.size(); ++i) db.add(images[i]);
+        add_time = now() - start;
+    }
+
+    /// Runs all the queries once, keeping the best latency
+    void runQueries(const vector<FlatBowVector>& queries)
+    {
+        QueryResults results;
+        const double start = now();
+        for (size_t i = 0; i < queries.size(); ++i) db.query(queries[i], results, 10);
+        latency = min(latency, (now() - start) / queries.size());
+    }
+
+    /**
+     * Prints the memory and query latency of the database and returns the number of scores
+     * further than max_error from L1Scoring::score
+     */
+    int report(const char* name, const vector<FlatBowVector>& images, const vector<FlatBowVector>& queries,
+               size_t postings, double max_error) const
+    {
+        // the scores of all the entries sharing words with the queries
+        QueryResults results;
+        int wrong        = 0;
+        double max_found = 0;
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            db.query(queries[i], results, 0);
+            for (size_t j = 0; j < results.size(); ++j)
+            {
+                const double error = abs(results[j].Score - L1Scoring::score(queries[i], images[results[j].Id]));
+                max_found          = max(max_found, error);
+                if (error > max_error) wrong++;
+            }
+        }
+
+        const size_t bytes = db.invertedFileBytes();
+        printf("%-24s %12zu %10.2f %10.2f %12.3f %12.2e\n", name, bytes, (double)bytes / postings,
+               add_time / images.size() * 1e6, latency * 1e3, max_found);
+        return wrong;
+    }
+
+    TemplatedDatabase<Descriptor, FORB, L1Scoring, TInvertedList> db;
+    double add_time, latency;
+};
+
+int main(int argc, char** argv)
+{
+    const int entries = argc > 1 ? atoi(argv[1]) : 20000;
+    const double s    = argc > 2 ? atof(argv[2]) : 1.0;
+
+    OrbVocabulary voc;
+    makeVocabulary(voc, argc > 3 ? argv[3] : "", 10, 4);
+
+    const int per_image = 500;
+    mt19937_64 rng(3);
+    ZipfWords zipf(voc.size(), s, per_image, rng);
+
+    // a sequence of images where each one looks like the previous one, like a video
+    vector<FlatBowVector> images, queries;
+    size_t postings = 0;
+    for (int i = 0; i < entries; ++i)
+    {
+        images.push_back(i == 0 ? zipf.image(rng, per_image) : zipf.similar(images.back(), rng, per_image));
+        postings += images.back().size();
+    }
+    for (int i = 0; i < 100; ++i) queries.push_back(zipf.similar(images[rng() % images.size()], rng, per_image));
+
+    cout << voc.size() << " words, Zipf exponent " << s << ", " << entries << " entries, " << postings
+         << " postings" << endl;
+    printf("%-24s %12s %10s %10s %12s %12s\n", "list", "bytes", "bytes/post", "add us", "query ms", "max error");
+
+    Candidate<InvertedList> plain(voc, images);
+    Candidate<CompressedInvertedList> compressed(voc, images);
+
+    // best of 10 runs of all the queries, alternating the lists so that both see the same
+    // load of the machine
+    for (int run = 0; run < 10; ++run)
+    {
+        plain.runQueries(queries);
+        compressed.runQueries(queries);
+    }
+
+    int wrong = 0;
+    wrong += plain.report("InvertedList", images, queries, postings, ROUNDING_ERROR);
+    wrong += compressed.report("CompressedInvertedList", images, queries, postings, QUANTIZATION_ERROR);
+
+    const double ratio = compressed.latency / plain.latency;
+    printf("query latency CompressedInvertedList / InvertedList: %.2f, at most %.2f\n", ratio, MAX_LATENCY_RATIO);
+
+    if (wrong > 0)
+    {
+        cout << wrong << " scores further from L1Scoring::score than the quantization error" << endl;
+        return 1;
+    }
+    if (ratio > MAX_LATENCY_RATIO)
+    {
+        cout << "the queries of CompressedInvertedList are too slow" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * Compares TemplatedDatabase::queryTopK to query on images whose words follow a Zipf
+ * distribution, where the lists of the frequent words are long. The results of both must
+ * be identical, ids and scores, before and after erasing entries; the program fails
+ * otherwise. It prints the latency of both.
+ *
+ * Usage: bench_topk [entries] [Zipf exponent] [vocabulary file]
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+
+#include "bench_util.h"
+
+using namespace DBoW2;
+using namespace std;
+using namespace bench;
+
+template <class TDatabase>
+int compare(const TDatabase& db, const vector<FlatBowVector>& queries, const char* state)
+{
+    int different = 0;
+    for (int k : {1, 10, 50})
+    {
+        // best of 3 runs of all the queries
+        vector<QueryResults> exhaustive(queries.size()), top(queries.size());
+        double latency[2] = {numeric_limits<double>::max(), numeric_limits<double>::max()};
+        for (int run = 0; run < 3; ++run)
+        {
+            double start = now();
+            for (size_t i = 0; i < queries.size(); ++i) db.query(queries[i], exhaustive[i], k);
+            latency[0] = min(latency[0], (now() - start) / queries.size());
+
+            start = now();
+            for (size_t i = 0; i < queries.size(); ++i) db.queryTopK(queries[i], top[i], k);
+            latency[1] = min(latency[1], (now() - start) / queries.size());
+        }
+
+        int same = 0;
+        for (size_t i = 0; i < queries.size(); ++i) same += sameResults(exhaustive[i], top[i]);
+
+        // the bow vector overload and queries limited to the older entries
+        const int max_id = db.size() / 2;
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            QueryResults a, b;
+            db.query(queries[i], a, k, max_id);
+            db.queryTopK(BowVector(queries[i]), b, k, max_id);
+            if (!sameResults(a, b)) different++;
+        }
+
+        printf("%-14s %5d %12.3f %12.3f %8.1fx %6d/%zu\n", state, k, latency[0] * 1e3, latency[1] * 1e3,
+               latency[0] / latency[1], same, queries.size());
+        different += queries.size() - same;
+    }
+    return different;
+}
+
+template <class TInvertedList>
+int run(const char* name, const OrbVocabulary& voc, const vector<FlatBowVector>& images,
+        const vector<FlatBowVector>& queries)
+{
+    TemplatedDatabase<Descriptor, FORB, L1Scoring, TInvertedList> db(voc, 1, true);
+    for (size_t i = 0; i < images.size(); ++i) db.add(images[i]);
+
+    cout << name << ", latency in ms:" << endl;
+    printf("%-14s %5s %12s %12s %9s %8s\n", "entries", "k", "query", "queryTopK", "speedup", "same");
+    int different = compare(db, queries, "all");
+
+    // erase a tenth of the entries, among them the best matches of some queries
+    mt19937_64 rng(5);
+    for (size_t i = 0; i < images.size() / 10; ++i) db.erase(rng() % images.size());
+    for (size_t i = 0; i < queries.size(); i += 4)
+    {
+        QueryResults results;
+        db.query(queries[i], results, 1);
+        if (!results.empty()) db.erase(results[0].Id);
+    }
+    different += compare(db, queries, "after erase");
+    cout << endl;
+    return different;
+}
+
+int main(int argc, char** argv)
+{
+    const int entries = argc > 1 ? atoi(argv[1]) : 20000;
+    const double s    = argc > 2 ? atof(argv[2]) : 1.0;
+
+    OrbVocabulary voc;
+    makeVocabulary(voc, argc > 3 ? argv[3] : "", 10, 4);
+
+    const int per_image = 500;
+    mt19937_64 rng(3);
+    ZipfWords zipf(voc.size(), s, per_image, rng);
+
+    // a sequence of images where each one looks like the previous one, like a video,
+    // and queries that revisit some of them
+    vector<FlatBowVector> images, queries;
+    for (int i = 0; i < entries; ++i)
+        images.push_back(i == 0 ? zipf.image(rng, per_image) : zipf.similar(images.back(), rng, per_image));
+    for (int i = 0; i < 64; ++i) queries.push_back(zipf.similar(images[rng() % images.size()], rng, per_image));
+
+    cout << voc.size() << " words, Zipf exponent " << s << ", " << entries << " entries" << endl << endl;
+
+    int different = 0;
+    different += run<InvertedList>("InvertedList", voc, images, queries);
+    different += run<CompressedInvertedList>("CompressedInvertedList", voc, images, queries);
+
+    if (different > 0)
+    {
+        cout << different << " queries where queryTopK differs from query" << endl;
+        return 1;
+    }
+    return 0;
+}
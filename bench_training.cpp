@@ -0,0 +1,88 @@
+/**
+ * Trains the same vocabulary with the exhaustive kmeans assignments and with
+ * TrainingParameters::bounded_assignment, printing the time of both and the fraction of the
+ * distances the bounds skip on every level. The two vocabularies must be identical; the
+ * program fails otherwise.
+ *
+ * Usage: bench_training [images] [k] [L] [threads]
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+
+#include "bench_util.h"
+
+using namespace DBoW2;
+using namespace std;
+using namespace bench;
+
+/**
+ * Features of images of a few thousand distinct points: each descriptor is one of the
+ * centers with up to 60 random bits flipped, like views of a point under changing conditions
+ */
+void makeFeatures(vector<vector<Descriptor>>& features, int images, int per_image)
+{
+    mt19937_64 rng(1);
+    vector<Descriptor> centers(2000);
+    for (Descriptor& c : centers)
+        for (uint64_t& w : c) w = rng();
+
+    features.assign(images, vector<Descriptor>(per_image));
+    for (vector<Descriptor>& image : features)
+    {
+        for (Descriptor& d : image)
+        {
+            d           = centers[rng() % centers.size()];
+            const int n = rng() % 60;
+            for (int i = 0; i < n; ++i)
+            {
+                const int bit = rng() % 256;
+                d[bit / 64] ^= 1ull << (bit % 64);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const int images  = argc > 1 ? atoi(argv[1]) : 1000;
+    const int k       = argc > 2 ? atoi(argv[2]) : 10;
+    const int L       = argc > 3 ? atoi(argv[3]) : 4;
+    const int threads = argc > 4 ? atoi(argv[4]) : 1;
+
+    vector<vector<Descriptor>> features;
+    makeFeatures(features, images, 500);
+    cout << images * 500 << " descriptors, k = " << k << ", L = " << L << ", " << threads << " threads" << endl;
+
+    uint64_t checksums[2];
+    for (int bounded = 0; bounded < 2; ++bounded)
+    {
+        TrainingParameters params;
+        params.seed               = 1;
+        params.bounded_assignment = bounded != 0;
+
+        OrbVocabulary voc(k, L);
+        voc.setTrainingParameters(params);
+        const double start = now();
+        voc.create(features, threads);
+        const double time  = now() - start;
+        checksums[bounded] = voc.checksum();
+
+        cout << (bounded ? "bounded" : "exhaustive") << ": " << time << " s, " << voc.size() << " words" << endl;
+        const TrainingStatistics& stats = voc.getTrainingStatistics();
+        for (size_t level = 0; bounded && level < stats.computed_distances.size(); ++level)
+        {
+            const double total = (double)stats.exhaustive_distances[level];
+            printf("  level %zu: %llu of %llu distances computed, %.1f%% skipped\n", level + 1,
+                   (unsigned long long)stats.computed_distances[level], (unsigned long long)total,
+                   total > 0 ? 100 * (1 - stats.computed_distances[level] / total) : 0.0);
+        }
+    }
+
+    if (checksums[0] != checksums[1])
+    {
+        cout << "the bounded assignments created a different vocabulary" << endl;
+        return 1;
+    }
+    return 0;
+}
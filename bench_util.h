@@ -0,0 +1,180 @@
+/**
+ * Helpers shared by the benchmark and stress programs: a vocabulary trained on random
+ * descriptors, bow vectors with a skewed word distribution, and timing.
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+#pragma once
+
+#include "MiniBow.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+namespace bench
+{
+using Descriptor    = DBoW2::FORB::TDescriptor;
+using OrbVocabulary = DBoW2::TemplatedVocabulary<Descriptor, DBoW2::FORB, DBoW2::L1Scoring>;
+
+/**
+ * Returns the time in seconds since some fixed point
+ */
+inline double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Loads the given vocabulary file, or trains a k^L vocabulary on random descriptors if the
+ * file name is empty. The words of random descriptors are about equally likely, which does
+ * not matter here: the bow vectors of the benchmarks draw their words themselves.
+ */
+inline void makeVocabulary(OrbVocabulary& voc, const std::string& file, int k, int L, int threads = 1)
+{
+    if (!file.empty())
+    {
+        voc.loadRaw(file);
+        return;
+    }
+
+    std::mt19937_64 rng(1);
+    size_t words = 1;
+    for (int i = 0; i < L; ++i) words *= k;
+
+    const int per_image = 500;
+    std::vector<std::vector<Descriptor>> features(std::max<size_t>(10, words * 4 / per_image + 1));
+    for (std::vector<Descriptor>& image : features)
+    {
+        image.resize(per_image);
+        for (Descriptor& d : image)
+            for (uint64_t& w : d) w = rng();
+    }
+
+    voc = OrbVocabulary(k, L);
+    DBoW2::TrainingParameters params;
+    params.max_iterations = 10;
+    params.seed           = 1;
+    voc.setTrainingParameters(params);
+    voc.create(features, threads);
+}
+
+/**
+ * Draws word ids with probability proportional to 1 / rank^s, like the words of real images,
+ * where a few words appear in most of them. The ranks are shuffled over the word ids, and the
+ * weights are the idf of a database of images with the given number of features.
+ */
+class ZipfWords
+{
+   public:
+    ZipfWords(unsigned int words, double s, int per_image, std::mt19937_64& rng)
+        : m_cdf(words), m_ids(words), m_idf(words)
+    {
+        std::vector<double> p(words);
+        double sum = 0;
+        for (unsigned int i = 0; i < words; ++i)
+        {
+            p[i] = 1.0 / std::pow(i + 1.0, s);
+            sum += p[i];
+        }
+
+        double acc = 0;
+        for (unsigned int i = 0; i < words; ++i)
+        {
+            p[i] /= sum;
+            acc += p[i];
+            m_cdf[i] = acc;
+            m_ids[i] = i;
+        }
+        std::shuffle(m_ids.begin(), m_ids.end(), rng);
+
+        for (unsigned int i = 0; i < words; ++i)
+        {
+            // fraction of the images with the word at least once
+            const double df = 1 - std::pow(1 - p[i], per_image);
+            m_idf[m_ids[i]] = std::log(1 / std::max(df, 1e-12));
+        }
+    }
+
+    DBoW2::WordId draw(std::mt19937_64& rng) const
+    {
+        const double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        const size_t i = std::lower_bound(m_cdf.begin(), m_cdf.end(), u) - m_cdf.begin();
+        return m_ids[std::min(i, m_ids.size() - 1)];
+    }
+
+    /**
+     * Returns the normalized bow vector of an image with n features
+     */
+    DBoW2::FlatBowVector image(std::mt19937_64& rng, int n) const
+    {
+        DBoW2::FlatBowVector v;
+        for (int i = 0; i < n; ++i) add(v, draw(rng));
+        v.sortAndMerge(true);
+        v.normalize();
+        return v;
+    }
+
+    /**
+     * Returns another view of the same place: it keeps about 60% of the words of an image
+     * and adds 40% of n new features
+     */
+    DBoW2::FlatBowVector similar(const DBoW2::FlatBowVector& image, std::mt19937_64& rng, int n) const
+    {
+        DBoW2::FlatBowVector v;
+        for (size_t i = 0; i < image.size(); ++i)
+            if (rng() % 10 < 6) add(v, image.word(i));
+        for (int i = 0; i < n * 4 / 10; ++i) add(v, draw(rng));
+        v.sortAndMerge(true);
+        v.normalize();
+        return v;
+    }
+
+   private:
+    void add(DBoW2::FlatBowVector& v, DBoW2::WordId id) const { v.push_back(id, m_idf[id]); }
+
+    std::vector<double> m_cdf;
+    std::vector<DBoW2::WordId> m_ids;
+    std::vector<double> m_idf;
+};
+
+/// Largest difference of a score of InvertedList to L1Scoring::score, which only comes from rounding
+const double ROUNDING_ERROR = 1e-9;
+
+/// Largest difference of a score of CompressedInvertedList to L1Scoring::score, see its doc
+const double QUANTIZATION_ERROR = std::ldexp(1.0, -11) * (1 + std::ldexp(1.0, -10));
+
+/**
+ * Returns the largest difference of the scores of a database with the given lists to
+ * L1Scoring::score
+ */
+template <class TInvertedList>
+double maxScoreError()
+{
+    return std::is_same<TInvertedList, DBoW2::CompressedInvertedList>::value ? QUANTIZATION_ERROR
+                                                                             : ROUNDING_ERROR;
+}
+
+/**
+ * Returns whether two query results have the same ids and scores, in the same order
+ */
+inline bool sameResults(const DBoW2::QueryResults& a, const DBoW2::QueryResults& b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i)
+        if (a[i].Id != b[i].Id || a[i].Score != b[i].Score) return false;
+    return true;
+}
+
+/**
+ * Returns the p-th percentile of some samples, which are sorted
+ */
+inline double percentile(std::vector<double>& samples, double p)
+{
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, (size_t)(p / 100 * samples.size()))];
+}
+
+}  // namespace bench
@@ -0,0 +1,175 @@
+/**
+ * Stress test of TemplatedDatabase: reader threads query while one writer adds entries at
+ * several rates, erasing the oldest ones past a window and some random ones. Every result
+ * must be an entry added before the query ended, scored like its whole bow vector, so that
+ * queries see a prefix of the entries. The query latency should not depend on the insert
+ * rate, because queries never wait for the writer: the program fails if the p99 latency with
+ * the writer adding as fast as it can is more than MAX_P99_RATIO times the one without writer,
+ * scaled by the cpu share the writer takes from the readers.
+ * Build it with -DMINIBOW_SANITIZE_THREAD=ON to run it under ThreadSanitizer.
+ *
+ * Usage: stress_database [seconds per rate] [readers] [vocabulary file]
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+
+#include "bench_util.h"
+
+using namespace DBoW2;
+using namespace std;
+using namespace bench;
+
+/// Largest ratio of the p99 latency with an unlimited insert rate to the one without writer
+const double MAX_P99_RATIO = 2;
+
+/**
+ * Runs the readers against a writer adding insert_rate entries per second, 0 for no writer
+ * and -1 for as fast as it can. Returns the number of invalid results, and the p99 latency
+ * in p99.
+ */
+template <class TInvertedList>
+int run(const OrbVocabulary& voc, const ZipfWords& zipf, const vector<FlatBowVector>& images, double seconds,
+        int readers, int insert_rate, double& p99)
+{
+    typedef TemplatedDatabase<Descriptor, FORB, L1Scoring, TInvertedList> Database;
+
+    const unsigned int window = 5000;
+    Database db(voc, 1, true);
+    db.setMaxEntries(window);
+    for (unsigned int i = 0; i < window; ++i) db.add(images[i % images.size()]);
+
+    atomic<bool> done(false);
+    atomic<int> invalid(0);
+    atomic<size_t> inserted(0);
+
+    thread writer([&]() {
+        mt19937_64 rng(7);
+        const double start = now();
+        size_t n           = 0;
+        while (!done.load())
+        {
+            if (insert_rate == 0) break;
+            if (insert_rate > 0 && n >= (now() - start) * insert_rate)
+            {
+                this_thread::sleep_for(chrono::microseconds(200));
+                continue;
+            }
+            db.add(zipf.similar(images[n % images.size()], rng, 300));
+            if (n % 10 == 0) db.erase(db.size() - 1 - rng() % 100);
+            ++n;
+        }
+        inserted.store(n);
+    });
+
+    const double max_error = maxScoreError<TInvertedList>();
+    vector<vector<double>> latencies(readers);
+    vector<thread> threads;
+    for (int t = 0; t < readers; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            mt19937_64 rng(100 + t);
+            QueryResults results;
+            FlatBowVector stored;
+            for (int q = 0; !done.load(); ++q)
+            {
+                const FlatBowVector v     = zipf.similar(images[rng() % images.size()], rng, 300);
+                const unsigned int before = db.size();
+                const double start        = now();
+                if (q % 2 == 0)
+                    db.query(v, results, 10);
+                else
+                    db.queryTopK(v, results, 10);
+                latencies[t].push_back((now() - start) * 1e3);
+                const unsigned int after = db.size();
+
+                // The query only sees the entries added before it took its snapshot of the size,
+                // somewhere between before and after, and exactly those if no entry was added
+                // meanwhile. The postings of the entry being added are ignored: every entry is
+                // scored like its whole vector. Entries erased meanwhile are not checked.
+                for (size_t i = 0; i < results.size(); ++i)
+                {
+                    if (results[i].Id >= after || (before == after && results[i].Id >= before))
+                    {
+                        invalid++;
+                        continue;
+                    }
+                    db.getBowVector(results[i].Id, stored);
+                    if (!stored.empty() && abs(results[i].Score - L1Scoring::score(v, stored)) > max_error)
+                        invalid++;
+                }
+            }
+        });
+    }
+
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+    done.store(true);
+    writer.join();
+    for (thread& t : threads) t.join();
+
+    vector<double> all;
+    for (size_t t = 0; t < latencies.size(); ++t) all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+    const size_t queries = all.size();
+    const double p50     = percentile(all, 50);
+    p99                  = percentile(all, 99);
+
+    if (insert_rate < 0)
+        printf("%10s", "unlimited");
+    else
+        printf("%10d", insert_rate);
+    printf(" %10.0f %9zu %9.3f %9.3f %9u\n", inserted.load() / seconds, queries, p50, p99, db.liveSize());
+    return invalid.load();
+}
+
+template <class TInvertedList>
+int runRates(const char* name, const OrbVocabulary& voc, double seconds, int readers)
+{
+    mt19937_64 rng(3);
+    ZipfWords zipf(voc.size(), 1.0, 500, rng);
+    vector<FlatBowVector> images;
+    for (int i = 0; i < 2000; ++i) images.push_back(zipf.image(rng, 500));
+
+    cout << name << ", " << readers << " readers, query latency in ms:" << endl;
+    printf("%10s %10s %9s %9s %9s %9s\n", "rate", "inserted/s", "queries", "p50", "p99", "entries");
+    int invalid = 0;
+    double p99  = 0, idle_p99 = 0;
+    for (int rate : {0, 100, 1000, 10000, -1})
+    {
+        invalid += run<TInvertedList>(voc, zipf, images, seconds, readers, rate, p99);
+        if (rate == 0) idle_p99 = p99;
+    }
+
+    // with more threads than cores, the writer takes a share of the cpu from the readers
+    const double cores     = max(1u, thread::hardware_concurrency());
+    const double slowdown  = max(1.0, (readers + 1) / cores) / max(1.0, readers / cores);
+    const double max_ratio = MAX_P99_RATIO * slowdown;
+    const double ratio     = p99 / idle_p99;
+    printf("p99 unlimited / no writer: %.2f, at most %.2f\n", ratio, max_ratio);
+    if (ratio > max_ratio)
+    {
+        cout << "the writer slows down the queries" << endl;
+        invalid++;
+    }
+    cout << endl;
+    return invalid;
+}
+
+int main(int argc, char** argv)
+{
+    const double seconds = argc > 1 ? atof(argv[1]) : 2;
+    const int readers    = argc > 2 ? atoi(argv[2]) : max(1, (int)thread::hardware_concurrency() - 1);
+
+    OrbVocabulary voc;
+    makeVocabulary(voc, argc > 3 ? argv[3] : "", 10, 4);
+
+    int invalid = 0;
+    invalid += runRates<InvertedList>("InvertedList", voc, seconds, readers);
+    invalid += runRates<CompressedInvertedList>("CompressedInvertedList", voc, seconds, readers);
+
+    if (invalid > 0)
+    {
+        cout << invalid << " invalid results or latencies" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+/**
+ * Checks that the descriptor kernels return the same results with every instruction set the
+ * cpu supports, selected with setSimdLevel, and that they match a plain reference. The
+ * bit-sliced FORB::meanValue is compared with counting every bit of every descriptor.
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+
+#include "bench_util.h"
+
+using namespace DBoW2;
+using namespace std;
+using namespace bench;
+
+static const char* levelName(SimdLevel level)
+{
+    return level == SIMD_AVX512 ? "avx512" : level == SIMD_AVX2 ? "avx2" : "scalar";
+}
+
+/// Random descriptors with few bits set, so that many distances are equal
+static Descriptor randomDescriptor(mt19937_64& rng, bool sparse)
+{
+    Descriptor d;
+    for (uint64_t& w : d) w = sparse ? rng() & rng() & rng() & rng() : rng();
+    return d;
+}
+
+static int referenceDistance(const Descriptor& a, const Descriptor& b)
+{
+    int dist = 0;
+    for (size_t w = 0; w < a.size(); ++w)
+        for (int bit = 0; bit < 64; ++bit) dist += ((a[w] ^ b[w]) >> bit) & 1;
+    return dist;
+}
+
+/**
+ * The majority of the descriptors, counting every bit: set if at least N2 = ceil(n / 2) of
+ * them have it set, unchanged mean if there are none
+ */
+static void referenceMean(const vector<FORB::pDescriptor>& descriptors, Descriptor& mean)
+{
+    const size_t n = descriptors.size();
+    if (n == 0) return;
+
+    vector<size_t> sum(mean.size() * 64, 0);
+    for (size_t i = 0; i < n; ++i)
+        for (size_t bit = 0; bit < sum.size(); ++bit) sum[bit] += ((*descriptors[i])[bit / 64] >> (bit % 64)) & 1;
+
+    const size_t N2 = n / 2 + n % 2;
+    for (uint64_t& w : mean) w = 0;
+    for (size_t bit = 0; bit < sum.size(); ++bit)
+        if (sum[bit] >= N2) mean[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+/**
+ * Computes the means of n = 0 to 20 descriptors and of random larger sets, across the
+ * blocks of 255 descriptors of the counters, and returns them in one vector
+ */
+static vector<uint64_t> runMeanValue(int& wrong)
+{
+    mt19937_64 rng(2);
+    vector<size_t> sizes;
+    for (size_t n = 0; n <= 20; ++n) sizes.insert(sizes.end(), 8, n);
+    for (size_t n : {254, 255, 256, 509, 510, 511, 65535, 65536, 65537}) sizes.insert(sizes.end(), 3, n);
+    for (int i = 0; i < 100; ++i) sizes.push_back(21 + rng() % 3000);
+
+    vector<uint64_t> out;
+    for (size_t t = 0; t < sizes.size(); ++t)
+    {
+        // one in three sets is made of pairs of complementary descriptors, so that every bit is
+        // set in exactly half of them and the mean has all bits set for even n, and for odd n
+        // the last descriptor decides between (n - 1) / 2 and N2. One in three are copies of
+        // one descriptor, whose bits are set in all n
+        const size_t n = sizes[t];
+        vector<Descriptor> descriptors(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (t % 3 == 0 && i % 2 == 1)
+                for (size_t w = 0; w < descriptors[i].size(); ++w) descriptors[i][w] = ~descriptors[i - 1][w];
+            else if (t % 3 == 1 && i > 0)
+                descriptors[i] = descriptors[0];
+            else
+                descriptors[i] = randomDescriptor(rng, t % 4 == 2);
+        }
+
+        vector<FORB::pDescriptor> pointers(n);
+        vector<unsigned int> indices(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            indices[i]  = (unsigned int)(n - 1 - i);
+            pointers[i] = &descriptors[indices[i]];
+        }
+
+        // meanValue leaves the mean unchanged for n = 0
+        const Descriptor initial = randomDescriptor(rng, false);
+        Descriptor reference     = initial, mean = initial, mean_indices = initial, mean_pointers = initial;
+        referenceMean(pointers, reference);
+        FORB::meanValue(pointers, mean);
+        FORB::meanValue(descriptors.data(), indices.data(), n, mean_indices);
+        FORB::meanValue(pointers.data(), indices.data(), n, mean_pointers);
+        if (mean != reference || mean_indices != reference || mean_pointers != reference) wrong++;
+        out.insert(out.end(), mean.begin(), mean.end());
+    }
+    return out;
+}
+
+/**
+ * Runs every kernel on the same random cases and returns their results in one vector
+ */
+static vector<int> runKernels(int& wrong)
+{
+    mt19937_64 rng(1);
+    vector<int> out;
+    for (int t = 0; t < 20000; ++t)
+    {
+        const bool sparse  = t % 2 == 0;
+        const int n        = 1 + t % 70;
+        const Descriptor a = randomDescriptor(rng, sparse);
+        vector<Descriptor> b(n);
+        for (Descriptor& d : b) d = rng() % 4 == 0 && n > 1 ? b[rng() % n] : randomDescriptor(rng, sparse);
+
+        vector<int> dist(n), reference(n);
+        const int index = FORB::distanceMany(a, b.data(), n, dist.data());
+        out.push_back(index);
+        out.insert(out.end(), dist.begin(), dist.end());
+
+        int ref_best = 0, ref_second = numeric_limits<int>::max();
+        for (int i = 0; i < n; ++i)
+        {
+            reference[i] = referenceDistance(a, b[i]);
+            if (reference[i] != (int)FORB::distance(a, b[i])) wrong++;
+            if (reference[i] < reference[ref_best]) ref_best = i;
+        }
+        for (int i = 0; i < n; ++i)
+            if (i != ref_best) ref_second = min(ref_second, reference[i]);
+        if (dist != reference || index != ref_best) wrong++;
+
+        FORB::distances(a, b.data(), n, dist.data());
+        if (dist != reference) wrong++;
+
+        int best, second;
+        const int nearest = FORB::nearestTwo(a, b.data(), n, best, second);
+        if (nearest != ref_best || best != reference[ref_best] || second != ref_second) wrong++;
+        if (FORB::nearest(a, b.data(), n) != ref_best) wrong++;
+        out.push_back(nearest);
+        out.push_back(best);
+        out.push_back(second);
+
+        if (n >= 10)
+        {
+            // first 10 descriptors, the branching factor of the ORB vocabulary
+            const int nearest10 = FORB::nearest<10>(a, b.data());
+            out.push_back(nearest10);
+            if (reference[nearest10] != *min_element(reference.begin(), reference.begin() + 10) ||
+                find(reference.begin(), reference.begin() + 10, reference[nearest10]) !=
+                    reference.begin() + nearest10)
+                wrong++;
+        }
+    }
+    return out;
+}
+
+int main()
+{
+    const SimdLevel detected = detectSimdLevel();
+    vector<int> expected;
+    vector<uint64_t> expected_means;
+    int failed = 0;
+    for (int level = SIMD_SCALAR; level <= detected; ++level)
+    {
+        setSimdLevel((SimdLevel)level);
+        int wrong                    = 0;
+        const vector<int> output     = runKernels(wrong);
+        const vector<uint64_t> means = runMeanValue(wrong);
+        if (level == SIMD_SCALAR)
+        {
+            expected       = output;
+            expected_means = means;
+        }
+
+        const bool same = output == expected && means == expected_means;
+        cout << levelName((SimdLevel)level) << ": " << wrong << " results different from the reference, "
+             << (same ? "same" : "different") << " output as scalar" << endl;
+        failed += wrong > 0 || !same;
+    }
+    setSimdLevel(detected);
+    return failed > 0 ? 1 : 0;
+}
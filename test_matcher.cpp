@@ -0,0 +1,173 @@
+/**
+ * Checks TemplatedMatcher on random image pairs: its matches, with FeatureVector and
+ * FlatFeatureVector, must be the ones of a brute-force loop over the shared nodes with the
+ * same distance threshold and ratio test, and the overloads with a thread pool must return
+ * the same matches in the same order as the serial one.
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+
+#include "bench_util.h"
+
+using namespace DBoW2;
+using namespace std;
+using namespace bench;
+
+typedef TemplatedMatcher<Descriptor, FORB> Matcher;
+
+/**
+ * Matches of every feature of the first image to its nearest neighbour in the same node of
+ * the second one, if it is closer than max_distance and than ratio times the second nearest.
+ * A feature of the second image matched several times keeps the closest match, and the one
+ * with the lowest index on ties.
+ */
+static vector<FeatureMatch> bruteForce(const FeatureVector& fv1, const vector<Descriptor>& features1,
+                                       const FeatureVector& fv2, const vector<Descriptor>& features2,
+                                       int max_distance, double ratio)
+{
+    map<unsigned int, FeatureMatch> best;
+    for (FeatureVector::const_iterator node = fv1.begin(); node != fv1.end(); ++node)
+    {
+        FeatureVector::const_iterator other = fv2.find(node->first);
+        if (other == fv2.end()) continue;
+
+        for (unsigned int i1 : node->second)
+        {
+            int dist1 = numeric_limits<int>::max(), dist2 = numeric_limits<int>::max();
+            unsigned int i2 = 0;
+            for (unsigned int j : other->second)
+            {
+                const int dist = (int)FORB::distance(features1[i1], features2[j]);
+                if (dist < dist1)
+                {
+                    dist2 = dist1;
+                    dist1 = dist;
+                    i2    = j;
+                }
+                else if (dist < dist2)
+                {
+                    dist2 = dist;
+                }
+            }
+            if (dist1 > max_distance || !(dist1 < ratio * dist2)) continue;
+
+            map<unsigned int, FeatureMatch>::iterator it = best.find(i2);
+            if (it == best.end() || dist1 < it->second.distance ||
+                (dist1 == it->second.distance && i1 < it->second.index1))
+            {
+                const FeatureMatch match = {i1, i2, dist1};
+                best[i2]                 = match;
+            }
+        }
+    }
+
+    vector<FeatureMatch> matches;
+    for (map<unsigned int, FeatureMatch>::const_iterator it = best.begin(); it != best.end(); ++it)
+        matches.push_back(it->second);
+    return matches;
+}
+
+static bool sameMatch(const FeatureMatch& a, const FeatureMatch& b)
+{
+    return a.index1 == b.index1 && a.index2 == b.index2 && a.distance == b.distance;
+}
+
+static bool sameMatches(const vector<FeatureMatch>& a, const vector<FeatureMatch>& b)
+{
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), sameMatch);
+}
+
+/// Same matches in any order
+static bool sameMatchSets(vector<FeatureMatch> a, vector<FeatureMatch> b)
+{
+    auto byIndex = [](const FeatureMatch& x, const FeatureMatch& y) { return x.index1 < y.index1; };
+    sort(a.begin(), a.end(), byIndex);
+    sort(b.begin(), b.end(), byIndex);
+    return sameMatches(a, b);
+}
+
+/**
+ * Two images of n features, where most features of the first one appear in the second one
+ * with up to max_flips bits changed, in another order, and the others are random
+ */
+static void randomPair(mt19937_64& rng, int n, int max_flips, vector<Descriptor>& a, vector<Descriptor>& b)
+{
+    a.resize(n);
+    b.resize(n);
+    for (Descriptor& d : a)
+        for (uint64_t& w : d) w = rng();
+
+    vector<int> order(n);
+    for (int i = 0; i < n; ++i) order[i] = i;
+    shuffle(order.begin(), order.end(), rng);
+
+    const int bits = (int)a[0].size() * 64;
+    for (int i = 0; i < n; ++i)
+    {
+        Descriptor& d = b[order[i]];
+        if (i % 5 == 0)
+        {
+            for (uint64_t& w : d) w = rng();
+            continue;
+        }
+        d               = a[i];
+        const int flips = max_flips > 0 ? rng() % (max_flips + 1) : 0;
+        for (int f = 0; f < flips; ++f)
+        {
+            const int bit = rng() % bits;
+            d[bit / 64] ^= uint64_t(1) << (bit % 64);
+        }
+    }
+    // some exact duplicates, so that nearest neighbours tie
+    for (int i = 0; i < n / 20; ++i) b[rng() % n] = b[rng() % n];
+}
+
+int main()
+{
+    OrbVocabulary voc;
+    makeVocabulary(voc, "", 10, 3);
+
+    mt19937_64 rng(7);
+    ThreadPool pool(4);
+    int pairs = 0, total = 0, wrong = 0, wrong_flat = 0, wrong_pool = 0;
+    for (int t = 0; t < 60; ++t)
+    {
+        vector<Descriptor> a, b;
+        randomPair(rng, 1 + rng() % 1500, rng() % 40, a, b);
+
+        // levels up from the words, up to the root where all the features share one node
+        const int levelsup = t % 4;
+        BowVector v;
+        FeatureVector fv1, fv2;
+        FlatFeatureVector flat1, flat2;
+        voc.transform(a, v, fv1, levelsup);
+        voc.transform(b, v, fv2, levelsup);
+        voc.transform(a, v, flat1, levelsup);
+        voc.transform(b, v, flat2, levelsup);
+
+        const int max_distance = t % 3 == 0 ? 256 : 50;
+        const double ratio     = t % 2 == 0 ? 0.7 : 0.9;
+        Matcher matcher(max_distance, ratio);
+
+        const vector<FeatureMatch> expected = bruteForce(fv1, a, fv2, b, max_distance, ratio);
+        vector<FeatureMatch> matches, flat, parallel, threads;
+        matcher.match(fv1, a, fv2, b, matches);
+        matcher.match(flat1, a, flat2, b, flat);
+        wrong += !sameMatchSets(matches, expected);
+        wrong_flat += !sameMatchSets(flat, expected);
+
+        matcher.match(fv1, a, fv2, b, parallel, pool);
+        matcher.match(flat1, a, flat2, b, threads, 3);
+        wrong_pool += !sameMatches(parallel, matches) || !sameMatches(threads, flat);
+
+        pairs++;
+        total += (int)expected.size();
+    }
+
+    cout << pairs << " pairs, " << total << " matches" << endl;
+    cout << "FeatureVector: " << wrong << " pairs different from the brute force" << endl;
+    cout << "FlatFeatureVector: " << wrong_flat << " pairs different from the brute force" << endl;
+    cout << "thread pool: " << wrong_pool << " pairs different from the serial match" << endl;
+    return wrong > 0 || wrong_flat > 0 || wrong_pool > 0 || total == 0 ? 1 : 0;
+}
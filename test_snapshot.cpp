@@ -0,0 +1,240 @@
+/**
+ * Checks database snapshots: a loaded database returns the same query results, bow vectors
+ * and feature vectors as the saved one, also after adding entries to it, which links new
+ * chunks to the lists of the mapped file. load must reject snapshots of a database with
+ * another vocabulary, truncated files and files with offsets that point outside of them,
+ * and leave the database empty.
+ *
+ * License: MIT
+ *          https://github.com/darglein/DBoW2/blob/master/LICENSE.txt
+ */
+
+#include "bench_util.h"
+
+#include <cstddef>
+#include <fstream>
+
+using namespace DBoW2;
+using namespace std;
+using namespace bench;
+
+/**
+ * Database with access to the layout of its snapshots
+ */
+template <class TInvertedList>
+struct Database : TemplatedDatabase<Descriptor, FORB, L1Scoring, TInvertedList>
+{
+    typedef TemplatedDatabase<Descriptor, FORB, L1Scoring, TInvertedList> Base;
+    typedef typename Base::SnapshotHeader Header;
+    typedef typename Base::SnapshotWord Word;
+
+    explicit Database(const OrbVocabulary& voc) : Base(voc, 1, true) {}
+};
+
+static string readFile(const string& file)
+{
+    ifstream in(file, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static void writeFile(const string& file, const string& data)
+{
+    ofstream out(file, ios::binary);
+    out.write(data.data(), data.size());
+}
+
+/// Feature vector of an image with n features in random nodes
+static FlatFeatureVector randomFeatures(mt19937_64& rng, int n)
+{
+    FeatureVector fv;
+    for (int i = 0; i < n; ++i) fv[rng() % 100].push_back(i);
+    return FlatFeatureVector(fv);
+}
+
+/**
+ * Returns the number of queries, bow vectors and feature vectors in which two databases differ
+ */
+template <class TDatabase>
+int compare(const TDatabase& a, const TDatabase& b, const vector<FlatBowVector>& queries)
+{
+    if (a.size() != b.size() || a.liveSize() != b.liveSize()) return 1;
+
+    int different = 0;
+    for (size_t i = 0; i < queries.size(); ++i)
+    {
+        QueryResults ra, rb;
+        a.query(queries[i], ra, 10);
+        b.query(queries[i], rb, 10);
+        different += !sameResults(ra, rb);
+        a.queryTopK(queries[i], ra, 10);
+        b.queryTopK(queries[i], rb, 10);
+        different += !sameResults(ra, rb);
+    }
+
+    for (EntryId entry_id = 0; entry_id < a.size(); ++entry_id)
+    {
+        FlatBowVector va, vb;
+        a.getBowVector(entry_id, va);
+        b.getBowVector(entry_id, vb);
+        bool same = va.size() == vb.size();
+        for (size_t i = 0; same && i < va.size(); ++i) same = va.word(i) == vb.word(i) && va.value(i) == vb.value(i);
+
+        FlatFeatureVector fa, fb;
+        a.getFeatureVector(entry_id, fa);
+        b.getFeatureVector(entry_id, fb);
+        same = same && FeatureVector(fa) == FeatureVector(fb) && a.isErased(entry_id) == b.isErased(entry_id);
+        different += !same;
+    }
+    return different;
+}
+
+/**
+ * Returns 1 if load accepts the data or leaves entries in the database, 0 otherwise
+ */
+template <class TDatabase>
+int accepts(TDatabase& db, const string& file, const string& data, const vector<FlatBowVector>& queries,
+            const char* what)
+{
+    writeFile(file, data);
+    QueryResults results;
+    const bool loaded = db.load(file);
+    db.query(queries[0], results, 10);
+    if (!loaded && db.size() == 0 && results.empty()) return 0;
+    cout << "  " << what << ": " << (loaded ? "loaded" : "not empty") << endl;
+    return 1;
+}
+
+template <class TInvertedList>
+int run(const char* name, const OrbVocabulary& voc, const OrbVocabulary& other)
+{
+    typedef Database<TInvertedList> Db;
+    typedef typename Db::Header Header;
+    typedef typename Db::Word Word;
+
+    mt19937_64 rng(3);
+    ZipfWords zipf(voc.size(), 1.0, 300, rng);
+    vector<FlatBowVector> images, queries;
+    vector<FlatFeatureVector> features;
+    for (int i = 0; i < 2000; ++i)
+    {
+        images.push_back(zipf.image(rng, 50 + rng() % 300));
+        features.push_back(randomFeatures(rng, rng() % 200));
+    }
+    for (int i = 0; i < 50; ++i) queries.push_back(zipf.similar(images[rng() % images.size()], rng, 300));
+
+    // some entries without feature vector, and some erased ones
+    Db db(voc);
+    for (size_t i = 0; i < images.size() / 2; ++i)
+    {
+        if (i % 3 == 0)
+            db.add(images[i]);
+        else
+            db.add(images[i], features[i]);
+    }
+    for (int i = 0; i < 50; ++i) db.erase(rng() % db.size());
+
+    const string file = string("test_snapshot_") + name + ".db";
+    int failed        = 0;
+    Db loaded(voc);
+    if (!db.save(file) || !loaded.load(file))
+    {
+        cout << name << ": could not save and load a snapshot" << endl;
+        return 1;
+    }
+    const int different = compare(db, loaded, queries);
+
+    // the first chunk of every list is in the mapped file, the next ones are linked to it
+    for (size_t i = images.size() / 2; i < images.size(); ++i)
+    {
+        db.add(images[i], features[i]);
+        loaded.add(images[i], features[i]);
+    }
+    for (int i = 0; i < 50; ++i)
+    {
+        const EntryId entry_id = rng() % db.size();
+        db.erase(entry_id);
+        loaded.erase(entry_id);
+    }
+    const int different_added = compare(db, loaded, queries);
+
+    // a snapshot of the loaded database, saved while it uses the mapped file
+    const string resaved = string("test_snapshot_") + name + "_resaved.db";
+    Db reloaded(voc);
+    const bool resaved_ok        = loaded.save(resaved) && reloaded.load(resaved);
+    const int different_reloaded = resaved_ok ? compare(db, reloaded, queries) : 1;
+
+    cout << name << ": " << different << " differences after load, " << different_added
+         << " after adding entries, " << different_reloaded << " after saving it again" << endl;
+    failed += different > 0 || different_added > 0 || different_reloaded > 0;
+
+    // the header and the first word with postings
+    const string data = readFile(file);
+    Header header;
+    memcpy(&header, data.data(), sizeof(header));
+    size_t word_at = header.words;
+    Word word;
+    for (;; word_at += sizeof(Word))
+    {
+        memcpy(&word, data.data() + word_at, sizeof(word));
+        if (word.size > 0) break;
+    }
+    const size_t record_at = header.records + header.num_entries / 2 * sizeof(uint64_t);
+    uint64_t record;
+    memcpy(&record, data.data() + record_at, sizeof(record));
+
+    auto corrupt = [&data](size_t at, uint64_t value, size_t bytes) {
+        string s = data;
+        memcpy(&s[at], &value, bytes);
+        return s;
+    };
+
+    // The vocabularies have the same number of words, so only the checksum in the header
+    // tells them apart
+    int wrong = 0;
+    Db other_db(other);
+    other_db.add(images[0]);
+    wrong += other.size() != voc.size() || accepts(other_db, file, data, queries, "other vocabulary");
+
+    const vector<pair<const char*, string>> invalid_files = {
+        {"empty", ""},
+        {"truncated header", data.substr(0, sizeof(Header) - 1)},
+        {"truncated at half", data.substr(0, data.size() / 2)},
+        {"truncated at the last byte", data.substr(0, data.size() - 1)},
+        {"longer", data + '\0'},
+        {"magic", corrupt(0, 'X', 1)},
+        {"vocabulary checksum", corrupt(offsetof(Header, vocabulary_checksum), ~header.vocabulary_checksum, 8)},
+        {"unaligned list", corrupt(word_at + offsetof(Word, offset), word.offset + 4, 8)},
+        {"list outside of the file", corrupt(word_at + offsetof(Word, offset), data.size(), 8)},
+        {"list with more postings than entries", corrupt(word_at + offsetof(Word, size), header.num_entries + 1, 8)},
+        {"record outside of the file", corrupt(record_at, data.size() - 8, 8)},
+        {"unaligned record", corrupt(record_at, record + 4, 8)},
+    };
+
+    // loaded into a database with entries, which load must clear
+    const string invalid = string("test_snapshot_") + name + "_invalid.db";
+    Db target(voc);
+    for (size_t i = 0; i < invalid_files.size(); ++i)
+    {
+        target.add(images[0]);
+        wrong += accepts(target, invalid, invalid_files[i].second, queries, invalid_files[i].first);
+    }
+
+    cout << name << ": " << wrong << " invalid files loaded" << endl;
+    failed += wrong > 0;
+
+    for (const string& f : {file, resaved, invalid}) remove(f.c_str());
+    return failed;
+}
+
+int main()
+{
+    // vocabularies with the same number of words and different trees
+    OrbVocabulary voc, other;
+    makeVocabulary(voc, "", 10, 3);
+    makeVocabulary(other, "", 1000, 1);
+
+    int failed = 0;
+    failed += run<InvertedList>("InvertedList", voc, other);
+    failed += run<CompressedInvertedList>("CompressedInvertedList", voc, other);
+    return failed > 0 ? 1 : 0;
+}